@@ -1,25 +1,634 @@
 // Some constants for communication
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <span>
+#include <utility>
 
-enum : int{
+// Wire format between host and pi
+//
+//   frame   := SYNC0 SYNC1 seq len check payload[len] crc_lo crc_hi
+//   payload := record*
+//   record  := type body
+//
+// check is a CRC-8 of seq and len, so a corrupted length is caught as soon as
+// the header is in rather than after waiting for up to 255 bytes that may
+// never come on an idle link. The crc (CRC-16/CCITT-FALSE) covers seq, len,
+// check and the payload. A receiver that sees a bad check or crc drops one
+// byte and scans for the next sync pair, so a corrupted stream recovers at
+// the next intact frame.
+//
+// Mouse records carry the report id, so absolute and relative reports can be
+// mixed. Absolute positions are delta encoded against the previous absolute
+// record of the same frame (the first one against 0,0), so frames never depend
+// on each other.
+//
+// With CAP_TELEMETRY a frame may start with a CMD_STAMP record carrying the
+// host's send time. Once every report of that frame has been written to the
+// HID gadget the pi answers with a CMD_ECHO record holding the host stamp,
+// its receive time, HID completion time and send time. All times are the
+// low 32 bits of each side's monotonic clock in microseconds.
+//
+// With CAP_MACRO the host can hand the pi a timed batch to play back on its
+// own clock. CMD_MACRO_BEGIN opens a macro; the keyboard and mouse records
+// after it, across any number of frames, are stored instead of written, each
+// due at the offset of the last CMD_AT before it (microseconds from the start
+// of the macro). CMD_MACRO_END closes it and starts playback delay
+// microseconds after it arrives. When the last report is out the pi answers
+// with CMD_MACRO_DONE and how far off schedule it was. A recording whose end
+// never comes (a CMD_MACRO_BEGIN while it's open, a CMD_MACRO_END for another
+// id, or no records for a second) is aborted rather than left to swallow live
+// input, and answered with CMD_MACRO_DONE as well, as is a playback the target
+// stops taking reports from.
+//
+// With CAP_NKRO the host may send CMD_KEYBOARD_NKRO records instead of
+// CMD_KEYBOARD, which the pi writes to its N-key rollover keyboard. The boot
+// keyboard stays, for targets that only speak the boot protocol.
+
+static constexpr uint8_t PROTOCOL_VERSION = 4;
+
+static constexpr uint8_t SYNC0 = 0xA5;
+static constexpr uint8_t SYNC1 = 0x5A;
+
+static constexpr size_t FRAME_HEADER = 5;
+static constexpr size_t FRAME_TRAILER = 2;
+static constexpr size_t MAX_PAYLOAD = 255;
+static constexpr size_t MAX_FRAME = FRAME_HEADER + MAX_PAYLOAD + FRAME_TRAILER;
+
+enum : uint8_t {
+  CMD_HELLO = 1,
   CMD_KEYBOARD,
   CMD_MOUSE,
+  CMD_STATS,
+  CMD_STAMP,
+  CMD_ECHO,
+  CMD_MACRO_BEGIN,
+  CMD_AT,
+  CMD_MACRO_END,
+  CMD_MACRO_DONE,
+  CMD_DRAIN,
+  CMD_KEYBOARD_NKRO,
+};
+
+// capability bits exchanged in CMD_HELLO
+enum : uint32_t {
+  CAP_NONE = 0,
+  CAP_TELEMETRY = 1 << 0,
+  CAP_MACRO = 1 << 1,
+  CAP_NKRO = 1 << 2,
 };
 
 typedef std::array<uint8_t, 8> keyboard_t;
-typedef std::array<uint8_t, 6> mouse_t;
+// N-key rollover report: one bit per keyboard usage, bit u % 8 of byte u / 8,
+// so the modifiers (0xE0..0xE7) are byte 28. See harness_usb for the
+// descriptor.
+struct keyboard_nkro_t: std::array<uint8_t, 32> {};
+
+static constexpr uint8_t NKRO_MODIFIERS = 0xE0 / 8;
+
+// The boot report for the same keys. More than six keys is the rollover
+// error state, every slot set to ErrorRollOver.
+inline keyboard_t boot_report(const keyboard_nkro_t& k) {
+  keyboard_t ret {};
+  ret[0] = k[NKRO_MODIFIERS];
+
+  int n = 2;
+  for(int usage = 0; usage < 0xE0; usage++) {
+    if(!(k[usage / 8] & (1 << usage % 8))) continue;
+    if(n == 8) {
+      std::fill(ret.begin() + 2, ret.end(), 0x01);
+      break;
+    }
+    ret[n++] = usage;
+  }
 
-template <typename T, typename stream>
-T read_trivial(stream& s) {
-  T ret;
-  s.read(reinterpret_cast<char*>(&ret), sizeof(T));
   return ret;
 }
 
-template <typename T, typename stream>
-void write_trivial(stream& s, const T& t) {
-  s.write(reinterpret_cast<const char*>(&t), sizeof(T));
+// Mouse report as written to the gadget, see harness_usb for the descriptor:
+// report id, buttons, x, y (int16 little endian), wheel, pan (int8). With
+// MOUSE_ABSOLUTE x and y are a position in 0..32767, with MOUSE_RELATIVE
+// they're a delta. Its own type rather than a typedef, keyboard_t is eight
+// bytes too.
+struct mouse_t: std::array<uint8_t, 8> {};
+
+enum : uint8_t {
+  MOUSE_ABSOLUTE = 1,
+  MOUSE_RELATIVE = 2,
+};
+
+struct mouse_fields {
+  uint8_t id = MOUSE_ABSOLUTE;
+  uint8_t buttons = 0;
+  int16_t x = 0;
+  int16_t y = 0;
+  int8_t wheel = 0;
+  int8_t pan = 0;
+};
+
+inline mouse_t pack_mouse(const mouse_fields& f) {
+  mouse_t ret {};
+  ret[0] = f.id;
+  ret[1] = f.buttons;
+  std::memcpy(&ret[2], &f.x, 2);
+  std::memcpy(&ret[4], &f.y, 2);
+  ret[6] = uint8_t(f.wheel);
+  ret[7] = uint8_t(f.pan);
+  return ret;
+}
+
+inline mouse_fields unpack_mouse(const mouse_t& m) {
+  mouse_fields ret { .id = m[0], .buttons = m[1], .wheel = int8_t(m[6]), .pan = int8_t(m[7]) };
+  std::memcpy(&ret.x, &m[2], 2);
+  std::memcpy(&ret.y, &m[4], 2);
+  return ret;
+}
+
+struct hello_t {
+  uint8_t version = PROTOCOL_VERSION;
+  uint32_t caps = CAP_NONE;
+};
+
+// ask the other side to dump its statistics
+struct stats_request_t {};
+
+struct stamp_t {
+  uint32_t host;
+};
+
+struct echo_t {
+  uint32_t host;   // stamp that came with the reports
+  uint32_t rx;     // pi received the frame
+  uint32_t hid;    // last report of the frame written to the gadget
+  uint32_t tx;     // echo sent
+};
+
+struct macro_begin_t {
+  uint8_t id;
+};
+
+struct at_t {
+  uint32_t offset; // us from the start of the macro
+};
+
+struct macro_end_t {
+  uint8_t id;
+  uint32_t delay;  // us between receiving this and the macro's start
+};
+
+enum : uint8_t {
+  MACRO_PLAYED,    // every report went out
+  MACRO_CANCELLED, // redefined or restarted while playing, what it held was let go
+  MACRO_ABORTED,   // the recording was broken off and nothing played, or the
+                   // target stopped taking reports after the first `reports`
+};
+
+// timing error is how late each report was handed to the gadget, in us, time
+// spent waiting for the target to take reports included
+struct macro_done_t {
+  uint8_t id;
+  uint32_t reports;
+  uint32_t duration; // us from start to the last report
+  uint32_t late_p50;
+  uint32_t late_p99;
+  uint32_t late_max;
+  uint8_t status = MACRO_PLAYED;
+  uint32_t dropped = 0; // steps beyond what the pi holds
+};
+
+// how often the pi gets to write a mouse report, i.e. the target's poll interval
+struct drain_t {
+  uint32_t mouse; // us
+};
+
+// monotonic microseconds, wrapping, compare with int32_t(a - b)
+inline uint32_t stamp_now() {
+  auto t = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(t).count();
+}
+
+template <typename... Ts> struct overloaded: Ts... { using Ts::operator()...; };
+template <typename... Ts> overloaded(Ts...) -> overloaded<Ts...>;
+
+constexpr uint16_t crc16(std::span<const uint8_t> data, uint16_t crc = 0xFFFF) {
+  constexpr auto table = []() {
+    std::array<uint16_t, 256> ret {};
+    for(int i = 0; i < 256; i++) {
+      uint16_t c = i << 8;
+      for(int j = 0; j < 8; j++)
+        c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+      ret[i] = c;
+    }
+    return ret;
+  }();
+
+  for(auto b: data)
+    crc = (crc << 8) ^ table[(crc >> 8) ^ b];
+  return crc;
+}
+
+// CRC-8 (poly 0x07) of a frame's seq and len
+constexpr uint8_t header_check(uint8_t seq, uint8_t len) {
+  uint8_t crc = 0;
+  for(uint8_t b: { seq, len }) {
+    crc ^= b;
+    for(int i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? uint8_t(crc << 1) ^ 0x07 : uint8_t(crc << 1);
+  }
+  return crc;
+}
+
+constexpr uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+constexpr int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+// Builds one frame at a time. add() returns false once a record no longer
+// fits, the caller should then send what it has and start over.
+struct FrameWriter {
+  bool add(const hello_t& h) {
+    return record(CMD_HELLO, [&]() {
+      put(h.version);
+      put_varint(h.caps);
+    });
+  }
+
+  bool add(const stats_request_t&) {
+    return record(CMD_STATS, []() {});
+  }
+
+  bool add(const stamp_t& s) {
+    return record(CMD_STAMP, [&]() { put_varint(s.host); });
+  }
+
+  bool add(const echo_t& e) {
+    return record(CMD_ECHO, [&]() {
+      put_varint(e.host);
+      put_varint(e.rx);
+      put_varint(e.hid);
+      put_varint(e.tx);
+    });
+  }
+
+  bool add(const macro_begin_t& m) {
+    return record(CMD_MACRO_BEGIN, [&]() { put(m.id); });
+  }
+
+  bool add(const at_t& a) {
+    return record(CMD_AT, [&]() { put_varint(a.offset); });
+  }
+
+  bool add(const macro_end_t& m) {
+    return record(CMD_MACRO_END, [&]() {
+      put(m.id);
+      put_varint(m.delay);
+    });
+  }
+
+  bool add(const macro_done_t& d) {
+    return record(CMD_MACRO_DONE, [&]() {
+      put(d.id);
+      put_varint(d.reports);
+      put_varint(d.duration);
+      put_varint(d.late_p50);
+      put_varint(d.late_p99);
+      put_varint(d.late_max);
+      put(d.status);
+      put_varint(d.dropped);
+    });
+  }
+
+  bool add(const drain_t& d) {
+    return record(CMD_DRAIN, [&]() { put_varint(d.mouse); });
+  }
+
+  // 6KRO boot report, sent as modifiers, key count and the keys
+  bool add(const keyboard_t& k) {
+    return record(CMD_KEYBOARD, [&]() {
+      uint8_t n = 0;
+      for(int i = 2; i < 8; i++) n += k[i] != 0;
+
+      put(k[0]);
+      put(n);
+      for(int i = 2; i < 8; i++)
+        if(k[i]) put(k[i]);
+    });
+  }
+
+  // modifiers, bitmap length and the bitmap of the other keys up to its last
+  // non-zero byte
+  bool add(const keyboard_nkro_t& k) {
+    return record(CMD_KEYBOARD_NKRO, [&]() {
+      uint8_t n = NKRO_MODIFIERS;
+      while(n && !k[n - 1]) n--;
+
+      put(k[NKRO_MODIFIERS]);
+      put(n);
+      for(int i = 0; i < n; i++) put(k[i]);
+    });
+  }
+
+  // report id, buttons, x/y as zigzag (deltas to the last absolute
+  // position), wheel, pan
+  bool add(const mouse_t& m) {
+    return record(CMD_MOUSE, [&]() {
+      auto f = unpack_mouse(m);
+      bool absolute = f.id == MOUSE_ABSOLUTE;
+
+      put(f.id);
+      put(f.buttons);
+      put_varint(zigzag(f.x - (absolute ? last_x : 0)));
+      put_varint(zigzag(f.y - (absolute ? last_y : 0)));
+      put_varint(zigzag(f.wheel));
+      put_varint(zigzag(f.pan));
+
+      if(absolute) {
+        last_x = f.x;
+        last_y = f.y;
+      }
+    });
+  }
+
+  bool empty() const { return len == FRAME_HEADER; }
+
+  // Seal the current frame and return it. The view stays valid until the next
+  // call to add().
+  std::span<const uint8_t> finish() {
+    size_t payload = len - FRAME_HEADER;
+    buf[0] = SYNC0;
+    buf[1] = SYNC1;
+    buf[2] = seq++;
+    buf[3] = payload;
+    buf[4] = header_check(buf[2], buf[3]);
+
+    uint16_t crc = crc16({buf.data() + 2, payload + FRAME_HEADER - 2});
+    buf[len++] = crc & 0xFF;
+    buf[len++] = crc >> 8;
+
+    size_t total = std::exchange(len, FRAME_HEADER);
+    last_x = last_y = 0;
+    return {buf.data(), total};
+  }
+
+protected:
+  std::array<uint8_t, MAX_FRAME> buf;
+  size_t len = FRAME_HEADER;
+  uint8_t seq = 0;
+  int32_t last_x = 0, last_y = 0;
+  bool overflow = false;
+
+  bool record(uint8_t type, auto&& body) {
+    size_t start = len;
+    int32_t x = last_x, y = last_y;
+
+    overflow = false;
+    put(type);
+    body();
+
+    if(overflow) {
+      len = start;
+      last_x = x;
+      last_y = y;
+      return false;
+    }
+
+    return true;
+  }
+
+  void put(uint8_t b) {
+    if(len >= FRAME_HEADER + MAX_PAYLOAD) overflow = true;
+    else buf[len++] = b;
+  }
+
+  void put_varint(uint32_t v) {
+    while(v >= 0x80) {
+      put(uint8_t(v) | 0x80);
+      v >>= 7;
+    }
+    put(uint8_t(v));
+  }
+};
+
+// Decodes the records of one frame payload, calling f with a hello_t,
+// stats_request_t, stamp_t, echo_t, macro record, drain_t, keyboard_t,
+// keyboard_nkro_t or mouse_t for each. Returns
+// false if the payload is malformed, records before the bad one have already
+// been delivered.
+template <typename F>
+bool decode_records(std::span<const uint8_t> payload, F&& f) {
+  size_t pos = 0;
+  bool ok = true;
+
+  auto get = [&]() -> uint8_t {
+    if(pos >= payload.size()) { ok = false; return 0; }
+    return payload[pos++];
+  };
+
+  auto get_varint = [&]() -> uint32_t {
+    uint32_t ret = 0;
+    for(int shift = 0; shift < 35 && ok; shift += 7) {
+      uint8_t b = get();
+      ret |= uint32_t(b & 0x7F) << shift;
+      if(!(b & 0x80)) return ret;
+    }
+    ok = false;
+    return 0;
+  };
+
+  int32_t last_x = 0, last_y = 0;
+
+  while(ok && pos < payload.size()) {
+    switch(get()) {
+      case CMD_HELLO: {
+        hello_t h;
+        h.version = get();
+        h.caps = get_varint();
+        if(ok) f(h);
+        break;
+      }
+
+      case CMD_STATS:
+        f(stats_request_t{});
+        break;
+
+      case CMD_STAMP: {
+        stamp_t st { get_varint() };
+        if(ok) f(st);
+        break;
+      }
+
+      case CMD_ECHO: {
+        echo_t e;
+        e.host = get_varint();
+        e.rx = get_varint();
+        e.hid = get_varint();
+        e.tx = get_varint();
+        if(ok) f(e);
+        break;
+      }
+
+      case CMD_MACRO_BEGIN: {
+        macro_begin_t m { get() };
+        if(ok) f(m);
+        break;
+      }
+
+      case CMD_AT: {
+        at_t a { get_varint() };
+        if(ok) f(a);
+        break;
+      }
+
+      case CMD_MACRO_END: {
+        macro_end_t m;
+        m.id = get();
+        m.delay = get_varint();
+        if(ok) f(m);
+        break;
+      }
+
+      case CMD_MACRO_DONE: {
+        macro_done_t d;
+        d.id = get();
+        d.reports = get_varint();
+        d.duration = get_varint();
+        d.late_p50 = get_varint();
+        d.late_p99 = get_varint();
+        d.late_max = get_varint();
+        d.status = get();
+        d.dropped = get_varint();
+        if(ok) f(d);
+        break;
+      }
+
+      case CMD_KEYBOARD: {
+        keyboard_t k {};
+        k[0] = get();
+        uint8_t n = get();
+        if(n > 6) ok = false;
+        for(int i = 0; i < n && ok; i++)
+          k[2 + i] = get();
+        if(ok) f(k);
+        break;
+      }
+
+      case CMD_KEYBOARD_NKRO: {
+        keyboard_nkro_t k {};
+        k[NKRO_MODIFIERS] = get();
+        uint8_t n = get();
+        if(n > NKRO_MODIFIERS) ok = false;
+        for(int i = 0; i < n && ok; i++)
+          k[i] = get();
+        if(ok) f(k);
+        break;
+      }
+
+      case CMD_MOUSE: {
+        mouse_fields m;
+        m.id = get();
+        m.buttons = get();
+        int32_t x = unzigzag(get_varint()), y = unzigzag(get_varint());
+        m.wheel = int8_t(unzigzag(get_varint()));
+        m.pan = int8_t(unzigzag(get_varint()));
+
+        if(m.id == MOUSE_ABSOLUTE) {
+          x = last_x += x;
+          y = last_y += y;
+        } else if(m.id != MOUSE_RELATIVE) {
+          ok = false;
+        }
+
+        m.x = int16_t(x);
+        m.y = int16_t(y);
+        if(ok) f(pack_mouse(m));
+        break;
+      }
+
+      case CMD_DRAIN: {
+        drain_t d { get_varint() };
+        if(ok) f(d);
+        break;
+      }
+
+      default:
+        ok = false;
+    }
+  }
+
+  return ok;
 }
+
+// Finds frames in a byte stream. parse() consumes everything up to the last
+// complete frame (or garbage that can't start one), the caller keeps the rest
+// and passes it in again with more data appended.
+struct FrameParser {
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t crc_errors = 0;
+    uint64_t header_errors = 0; // bad check byte, e.g. a corrupted length
+    uint64_t skipped_bytes = 0;
+    uint64_t lost_frames = 0;
+    uint64_t bad_records = 0;
+  } stats;
+
+  // calls f(seq, payload) for every valid frame
+  template <typename F>
+  size_t parse(std::span<const uint8_t> data, F&& f) {
+    size_t pos = 0;
+
+    while(pos < data.size()) {
+      if(data[pos] != SYNC0 || (pos + 1 < data.size() && data[pos + 1] != SYNC1)) {
+        pos++;
+        stats.skipped_bytes++;
+        continue;
+      }
+
+      if(data.size() - pos < FRAME_HEADER) break;
+
+      if(data[pos + 4] != header_check(data[pos + 2], data[pos + 3])) {
+        pos++;
+        stats.header_errors++;
+        stats.skipped_bytes++;
+        continue;
+      }
+
+      size_t payload = data[pos + 3];
+      size_t total = FRAME_HEADER + payload + FRAME_TRAILER;
+      if(data.size() - pos < total) break;
+
+      uint16_t crc = crc16(data.subspan(pos + 2, payload + FRAME_HEADER - 2));
+      uint16_t got = data[pos + total - 2] | (data[pos + total - 1] << 8);
+      if(crc != got) {
+        pos++;
+        stats.crc_errors++;
+        stats.skipped_bytes++;
+        continue;
+      }
+
+      uint8_t seq = data[pos + 2];
+      if(have_seq && seq != uint8_t(last_seq + 1))
+        stats.lost_frames += uint8_t(seq - last_seq - 1);
+      have_seq = true;
+      last_seq = seq;
+
+      stats.frames++;
+      f(seq, data.subspan(pos + FRAME_HEADER, payload));
+      pos += total;
+    }
+
+    return pos;
+  }
+
+  template <typename F>
+  size_t parse_records(std::span<const uint8_t> data, F&& f) {
+    return parse(data, [&](uint8_t, std::span<const uint8_t> payload) {
+      if(!decode_records(payload, f)) stats.bad_records++;
+    });
+  }
+
+protected:
+  bool have_seq = false;
+  uint8_t last_seq = 0;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+// Log-linear latency histogram: each power of two is split into four buckets,
+// so percentiles are accurate to within 25% from nanoseconds up to minutes.
+// Recording is a couple of relaxed atomic adds and safe from any thread.
+struct LatencyHistogram {
+  struct Summary {
+    uint64_t count = 0;
+    std::chrono::nanoseconds mean {};
+    std::chrono::nanoseconds p50 {};
+    std::chrono::nanoseconds p99 {};
+    std::chrono::nanoseconds max {};
+  };
+
+  void record(std::chrono::nanoseconds d) {
+    uint64_t v = d.count() > 0 ? d.count() : 0;
+
+    buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(v, std::memory_order_relaxed);
+
+    uint64_t m = max.load(std::memory_order_relaxed);
+    while(v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed));
+  }
+
+  Summary summary() const {
+    Summary ret;
+    ret.count = count.load(std::memory_order_relaxed);
+    if(!ret.count) return ret;
+
+    ret.mean = std::chrono::nanoseconds(total.load(std::memory_order_relaxed) / ret.count);
+    ret.max = std::chrono::nanoseconds(max.load(std::memory_order_relaxed));
+    ret.p50 = percentile(ret.count, 0.50);
+    ret.p99 = percentile(ret.count, 0.99);
+    return ret;
+  }
+
+  void reset() {
+    for(auto& b: buckets) b.store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+  }
+
+protected:
+  static constexpr int SUB_BITS = 2;
+  static constexpr int SUB = 1 << SUB_BITS;
+
+  std::array<std::atomic<uint64_t>, 64 * SUB> buckets {};
+  std::atomic<uint64_t> count = 0;
+  std::atomic<uint64_t> total = 0;
+  std::atomic<uint64_t> max = 0;
+
+  static size_t bucket(uint64_t v) {
+    if(v < SUB) return v;
+    int msb = std::bit_width(v) - 1;
+    return (msb - SUB_BITS + 1) * SUB + ((v >> (msb - SUB_BITS)) & (SUB - 1));
+  }
+
+  // upper bound of the values that land in bucket i
+  static uint64_t bucket_limit(size_t i) {
+    if(i < SUB) return i;
+    int msb = i / SUB + SUB_BITS - 1;
+    uint64_t base = (uint64_t(SUB) | (i % SUB)) << (msb - SUB_BITS);
+    return base + (uint64_t(1) << (msb - SUB_BITS)) - 1;
+  }
+
+  std::chrono::nanoseconds percentile(uint64_t n, double p) const {
+    uint64_t target = n * p, seen = 0;
+    for(size_t i = 0; i < buckets.size(); i++) {
+      seen += buckets[i].load(std::memory_order_relaxed);
+      if(seen > target)
+        return std::chrono::nanoseconds(std::min(bucket_limit(i), max.load(std::memory_order_relaxed)));
+    }
+    return std::chrono::nanoseconds(max.load(std::memory_order_relaxed));
+  }
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "msg.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+// Receive buffer for the serial stream. Reads land at the tail, the parser
+// eats from the head, and the (at most one frame long) leftover is moved back
+// to the front only once the tail runs out of room.
+template <size_t N>
+struct StreamBuffer {
+  static_assert(N >= MAX_FRAME * 2);
+
+  std::span<uint8_t> writable() {
+    if(N - tail < MAX_FRAME) {
+      std::memmove(buf.data(), buf.data() + head, tail - head);
+      tail -= head;
+      head = 0;
+    }
+
+    return {buf.data() + tail, N - tail};
+  }
+
+  std::span<const uint8_t> readable() const { return {buf.data() + head, tail - head}; }
+
+  void commit(size_t n) { tail += n; }
+  void consume(size_t n) { head += n; }
+  void clear() { head = tail = 0; }
+
+protected:
+  std::array<uint8_t, N> buf;
+  size_t head = 0;
+  size_t tail = 0;
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <common/err.h>
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <termios.h>
+#include <unistd.h>
+
+// The byte stream between host and pi. The frames in msg.h don't care what
+// carries them: the pi's UART, the USB gadget's ACM serial function (far
+// faster, but gone whenever the cable is), or a TCP or unix socket, e.g. to
+// run and load test host and server on one box. A link is given as
+//
+//   /dev/serial0 or serial:/dev/serial0   a UART, at the configured baud rate
+//   acm:/dev/ttyGS0                       USB ACM, the baud rate is ignored
+//   tcp:host:port                         the host connects, the pi listens
+//   unix:/path                            the host connects, the pi listens
+//
+// and a comma separated list of them, fastest first, is tried in order: the
+// host opens the first that works and fails over to the next when it breaks.
+struct Transport {
+  struct Spec {
+    enum Kind { SERIAL, ACM, TCP, UNIX } kind = SERIAL;
+    std::string path; // device or socket file, or the host to connect to
+    std::string port; // TCP only
+
+    static ErrorOr<Spec> parse(std::string_view s) {
+      auto prefixed = [&](std::string_view prefix) {
+        if(!s.starts_with(prefix)) return false;
+        s.remove_prefix(prefix.size());
+        return true;
+      };
+
+      Spec ret;
+      if(prefixed("serial:")) ret.kind = SERIAL;
+      else if(prefixed("acm:")) ret.kind = ACM;
+      else if(prefixed("unix:")) ret.kind = UNIX;
+      else if(prefixed("tcp:")) {
+        auto colon = s.rfind(':');
+        if(colon == s.npos) return Error::format("Expected tcp:host:port, got tcp:{}", s);
+        ret.kind = TCP;
+        ret.port = s.substr(colon + 1);
+        s = s.substr(0, colon);
+
+        uint16_t n;
+        auto [end, ec] = std::from_chars(ret.port.data(), ret.port.data() + ret.port.size(), n);
+        if(ec != std::errc() || end != ret.port.data() + ret.port.size())
+          return Error::format("Invalid port '{}'", ret.port);
+      }
+
+      ret.path = s;
+      if(ret.kind != TCP && ret.path.empty()) return Error("Empty link path");
+      return ret;
+    }
+
+    static ErrorOr<std::vector<Spec>> parse_list(std::string_view s) {
+      std::vector<Spec> ret;
+      while(true) {
+        auto comma = s.find(',');
+        ret.push_back(TRY(parse(s.substr(0, comma))));
+        if(comma == s.npos) return ret;
+        s.remove_prefix(comma + 1);
+      }
+    }
+
+    bool is_socket() const { return kind == TCP || kind == UNIX; }
+
+    std::string name() const {
+      switch(kind) {
+      case SERIAL: return path;
+      case ACM: return "acm:" + path;
+      case TCP: return fmt::format("tcp:{}:{}", path, port);
+      case UNIX: return "unix:" + path;
+      }
+      return path;
+    }
+  };
+
+  using Socket = asio::generic::stream_protocol::socket;
+  using Acceptor = asio::basic_socket_acceptor<asio::generic::stream_protocol>;
+  using executor_type = decltype(std::declval<asio::serial_port&>().get_executor());
+
+  static constexpr uint32_t default_baud = 115200;
+
+  Transport(asio::io_service& service, std::vector<Spec> specs, uint32_t baud = default_baud)
+    : service(service), specs(std::move(specs)), baud(baud), port(std::in_place_type<asio::serial_port>, service) {}
+
+  // An already open serial device, e.g. a pty master.
+  Transport(asio::io_service& service, int fd)
+    : service(service), specs({ Spec{ .path = "fd" } }), port(std::in_place_type<asio::serial_port>, service, fd) {}
+
+  Transport(const Transport&) = delete;
+
+  // Host side: open the first link in the list that works.
+  ErrorOr<void> connect() {
+    std::lock_guard lock(mutex);
+    return open_from(0);
+  }
+
+  // Host side: the current link broke, move to the next one that opens,
+  // wrapping around to the fast ones in case they came back.
+  ErrorOr<void> failover() {
+    std::lock_guard lock(mutex);
+    close_port();
+    auto ret = open_from((current + 1) % specs.size());
+    if(!ret.is_error()) fmt::print("Link failed over to {}\n", spec().name());
+    return ret;
+  }
+
+  // Pi side: open the device, or wait for a host to connect to the socket.
+  // done runs once there's something to read from.
+  void accept(std::function<void(const asio::error_code&)> done) {
+    auto& s = specs[current];
+    if(!s.is_socket()) {
+      asio::post(service, [done, ec = open(s)]() { done(ec); });
+      return;
+    }
+
+    if(!acceptor) {
+      try {
+        acceptor.emplace(service);
+        auto ep = endpoints(s, true).at(0);
+        acceptor->open(ep.protocol());
+        if(s.kind == Spec::TCP) acceptor->set_option(asio::socket_base::reuse_address(true));
+        else ::unlink(s.path.c_str());
+        acceptor->bind(ep);
+        acceptor->listen(1);
+      } catch(const asio::system_error& e) {
+        acceptor.reset();
+        asio::post(service, [done, ec = e.code()]() { done(ec); });
+        return;
+      }
+    }
+
+    port.emplace<Socket>(service);
+    acceptor->async_accept(std::get<Socket>(port), [this, done](const asio::error_code& ec) {
+      if(!ec) set_socket_options();
+      done(ec);
+    });
+  }
+
+  // the link in use
+  const Spec& spec() const { return specs[current]; }
+
+  bool is_open() const {
+    return std::visit([](auto& p) { return p.is_open(); }, port);
+  }
+
+  void close() {
+    std::lock_guard lock(mutex);
+    close_port();
+  }
+
+  // Blocking write from the host's own thread. A link that breaks is left
+  // for the reader to fail over, what didn't go out is lost.
+  bool write(const char* s, size_t len) {
+    std::lock_guard lock(mutex);
+    asio::error_code ec;
+    std::visit([&](auto& p) { asio::write(p, asio::buffer(s, len), ec); }, port);
+    if(!ec) return true;
+
+    if(!write_errors++) fmt::print("Write to {} failed: {}\n", spec().name(), ec.message());
+    return false;
+  }
+
+  // Block until everything written has left, only serial ports keep a queue
+  // worth waiting for.
+  void drain() {
+    if(std::holds_alternative<asio::serial_port>(port)) tcdrain(native_handle());
+  }
+
+  template <typename Buffers, typename Handler>
+  void async_read_some(const Buffers& buffers, Handler&& handler) {
+    std::visit([&](auto& p) { p.async_read_some(buffers, std::forward<Handler>(handler)); }, port);
+  }
+
+  template <typename Buffers, typename Handler>
+  void async_write_some(const Buffers& buffers, Handler&& handler) {
+    std::visit([&](auto& p) { p.async_write_some(buffers, std::forward<Handler>(handler)); }, port);
+  }
+
+  executor_type get_executor() { return service.get_executor(); }
+
+  void cancel() {
+    std::visit([](auto& p) {
+      asio::error_code ignored;
+      p.cancel(ignored);
+    }, port);
+  }
+
+  int native_handle() {
+    return std::visit([](auto& p) { return int(p.native_handle()); }, port);
+  }
+
+  uint64_t get_write_errors() const { return write_errors; }
+
+protected:
+  asio::io_service& service;
+  std::vector<Spec> specs;
+  size_t current = 0;
+  uint32_t baud = default_baud;
+
+  // writes come from the host's main thread, failover from the reader's
+  std::mutex mutex;
+  std::variant<asio::serial_port, Socket> port;
+  std::optional<Acceptor> acceptor;
+  uint64_t write_errors = 0;
+
+  ErrorOr<void> open_from(size_t first) {
+    std::string tried;
+    for(size_t i = 0; i < specs.size(); i++) {
+      size_t at = (first + i) % specs.size();
+      auto ec = open(specs[at]);
+      if(!ec) {
+        current = at;
+        return {};
+      }
+      tried += fmt::format("\n  {}: {}", specs[at].name(), ec.message());
+    }
+    return Error::format("No link could be opened:{}", tried);
+  }
+
+  asio::error_code open(const Spec& s) {
+    try {
+      if(!s.is_socket()) {
+        auto& p = port.emplace<asio::serial_port>(service, s.path);
+        if(s.kind == Spec::SERIAL) p.set_option(asio::serial_port_base::baud_rate(baud));
+        return {};
+      }
+
+      auto& p = port.emplace<Socket>(service);
+      asio::error_code ec = asio::error::host_not_found;
+      for(auto& ep: endpoints(s, false)) {
+        p.close(ec);
+        p.open(ep.protocol());
+        if(!p.connect(ep, ec)) break;
+      }
+      if(ec) throw asio::system_error(ec);
+
+      set_socket_options();
+      return {};
+    } catch(const asio::system_error& e) {
+      close_port();
+      return e.code();
+    }
+  }
+
+  std::vector<asio::generic::stream_protocol::endpoint> endpoints(const Spec& s, bool listen) {
+    if(s.kind == Spec::UNIX) return { asio::local::stream_protocol::endpoint(s.path) };
+
+    std::vector<asio::generic::stream_protocol::endpoint> ret;
+    if(listen && s.path.empty()) {
+      ret.push_back(asio::ip::tcp::endpoint(asio::ip::tcp::v4(), uint16_t(std::atoi(s.port.c_str()))));
+      return ret;
+    }
+
+    asio::ip::tcp::resolver resolver(service);
+    for(auto& r: resolver.resolve(s.path.empty() ? "localhost" : s.path, s.port))
+      ret.push_back(r.endpoint());
+    return ret;
+  }
+
+  // input is a stream of small frames, don't let Nagle sit on them
+  void set_socket_options() {
+    if(specs[current].kind != Spec::TCP) return;
+    asio::error_code ignored;
+    std::get<Socket>(port).set_option(asio::ip::tcp::no_delay(true), ignored);
+  }
+
+  void close_port() {
+    std::visit([](auto& p) {
+      asio::error_code ignored;
+      p.close(ignored);
+    }, port);
+  }
+};
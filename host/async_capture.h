@@ -1,14 +1,25 @@
 #pragma once
 
 #include "capture.h"
+#include "file_source.h"
+#include "metrics.h"
+#include "screen_wait.h"
+#include "tiles.h"
+#include "triple_buffer.h"
 
 #include <asm-generic/errno-base.h>
 #include <common/err.h>
 #include <fmt/core.h>
 #include <optional>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
 #include <thread>
 
+#include <poll.h>
+
 template <typename T, int N>
 struct const_set: std::array<T, N> {
   constexpr bool count(const T& v) const {
@@ -18,36 +29,116 @@ struct const_set: std::array<T, N> {
   }
 };
 
+struct CapturePool;
+
 struct AsyncCapture {
   using BufferHandle = Capture::BufferHandle;
 
+  using my_clock = std::chrono::steady_clock;
+
+  // The buffer is shared by every sink the frame went to and goes back to the
+  // driver once all of them have let go of it.
+  struct Frame {
+    std::shared_ptr<BufferHandle> buf;
+    tiles::Hashes tiles; // compare with a tiles::DirtyTracker to see what changed
+    my_clock::time_point time; // when it was dequeued
+    uint32_t seq = 0;
+  };
+
+  // One consumer of captured frames. Every frame is published to every sink,
+  // each through its own mailbox, so a slow consumer only drops its own
+  // frames and never holds up the capture thread.
+  struct Sink {
+    // Newest frame, or nullptr if there is nothing new. The frame stays valid
+    // until the next call, reset buf as soon as possible to hand the buffer
+    // back to the driver.
+    Frame* pop() {
+      notified.store(false, std::memory_order_release);
+      return mailbox.consume();
+    }
+
+    // Called from the capture thread when a frame is published. Only called
+    // again once the consumer has popped, so a slow consumer isn't flooded.
+    // f returns false if the consumer couldn't be told (e.g. a full event
+    // queue), it's called again with the next frame then.
+    void on_frame(std::function<bool()> f) {
+      notify = std::move(f);
+    }
+
+    // frames that were replaced by a newer one before being popped
+    uint64_t dropped() const {
+      return drops.load(std::memory_order_relaxed);
+    }
+
+  protected:
+    friend struct AsyncCapture;
+
+    TripleBuffer<Frame> mailbox;
+    std::function<bool()> notify;
+    std::atomic<bool> notified = false;
+    std::atomic<uint64_t> drops = 0;
+  };
+
+  static constexpr uint32_t default_buffer_count = 4;
+
   AsyncCapture(AsyncCapture&& o):
     device((o.join(), o.device)), // make sure we join before we do anything else
-    cap(std::exchange(o.cap, std::nullopt)) {}
+    buffer_count(o.buffer_count),
+    memory(o.memory),
+    request(o.request),
+    metrics(o.metrics),
+    cap(std::move(o.cap)),
+    sinks(std::move(o.sinks)),
+    waits(std::move(o.waits)) {}
 
-  static ErrorOr<AsyncCapture> open(const char* device) {
-    AsyncCapture ret(device);
+  // device is a V4L2 device or a raw recording to replay.
+  static ErrorOr<AsyncCapture> open(const char* device,
+                                    uint32_t buffer_count = default_buffer_count,
+                                    Capture::Memory memory = Capture::Memory::MMAP,
+                                    const Capture::Request& request = {}) {
+    AsyncCapture ret(device, buffer_count, memory, request);
     TRY(ret.init());
     return std::move(ret);
   }
 
-  std::optional<BufferHandle> pop_frame() {
-    if(have_frame.load(std::memory_order_acquire)) {
-      std::optional<BufferHandle> ret(std::move(frame));
-      frame.reset();
+  // The display's sink, always there.
+  Frame* pop_frame() { return sinks[0]->pop(); }
+  void on_frame(std::function<bool()> f) { sinks[0]->on_frame(std::move(f)); }
+
+  // Another consumer, e.g. a recorder. Add sinks before start(); each one
+  // can pin up to two more buffers, so ask for more with --buffers.
+  Sink& add_sink() {
+    return *sinks.emplace_back(std::make_unique<Sink>());
+  }
 
-      have_frame.store(0, std::memory_order_release);
+  // frames that were captured but replaced by a newer one before the
+  // display popped them
+  uint64_t dropped_frames() const {
+    return skipped.load(std::memory_order_relaxed) + sinks[0]->dropped();
+  }
 
-      return ret;
-    }
+  // frames the driver dropped before we ever saw them, from the gaps in its
+  // sequence numbers
+  uint64_t lost_frames() const {
+    return lost.load(std::memory_order_relaxed);
+  }
 
-    return std::nullopt;
+  // Block until the screen shows what the next step needs, instead of
+  // sleeping for long enough. From any thread but the capture thread.
+  ErrorOr<ScreenWait::Result> wait_for(const ScreenWait::Condition& c, my_clock::duration timeout) {
+    return waits->wait(c, timeout);
   }
 
-  Capture* operator->() {
-    return &cap.value();
+  // Time the capture thread's stages and count frames into m. Set before
+  // start().
+  void set_metrics(Metrics* m) { metrics = m; }
+
+  CaptureSource* operator->() {
+    return cap.get();
   }
 
+  // Capture on a thread of our own. Use CapturePool::add() instead to share
+  // threads with other devices.
   void start() {
     running = true;
     thread = std::jthread([this](){ this->run(); });
@@ -64,61 +155,181 @@ struct AsyncCapture {
   }
 
   ~AsyncCapture() {
-    stop();
+    join();
   }
 
 protected:
+  friend struct CapturePool;
+
+  // upper bound on how long stop() takes to be noticed
+  static constexpr int poll_timeout_ms = 100;
+
   const char* device;
+  uint32_t buffer_count;
+  Capture::Memory memory;
+  Capture::Request request;
+  Metrics* metrics = nullptr;
+
+  // shared with every BufferHandle that's still out, see recover()
+  std::shared_ptr<CaptureSource> cap;
 
-  std::optional<Capture> cap;
+  std::vector<std::unique_ptr<Sink>> sinks;
+  std::unique_ptr<ScreenWait> waits = std::make_unique<ScreenWait>();
+  std::atomic<uint64_t> skipped = 0; // replaced before being published at all
+  std::atomic<uint64_t> lost = 0;
+  std::optional<uint32_t> last_sequence;
 
-  std::atomic<bool> have_frame = false;
-  std::optional<BufferHandle> frame;
+  // newest frame drained from the driver, owned by the capture thread
+  std::shared_ptr<BufferHandle> latest;
+  my_clock::time_point latest_time;
+  tiles::Hashes hashes;
+  tiles::Hashes previous; // the frame before, what waits look for changes from
+  uint32_t seq = 0;
 
-  bool running = false;
+  std::atomic<bool> running = false;
   std::jthread thread;
 
-  AsyncCapture(const char* device): device(device) {}
+  AsyncCapture(const char* device, uint32_t buffer_count, Capture::Memory memory, const Capture::Request& request)
+    : device(device), buffer_count(buffer_count), memory(memory), request(request) {
+    add_sink();
+  }
 
   ErrorOr<void> init() {
-    cap.emplace(TRY(Capture::open(device)));
-    TRY(cap->start(4));
+    if(FileSource::is_recording(device)) {
+      cap = TRY(FileSource::open(device, request, buffer_count));
+      return {};
+    }
+
+    auto c = std::make_unique<Capture>(TRY(Capture::open(device, request)));
+    TRY(c->start(buffer_count, memory));
+    cap = std::move(c);
     return {};
   }
 
+  // Wait for the driver to have something for us, then drain every ready
+  // buffer. Only the newest one is kept, the rest are requeued immediately.
+  ErrorOr<bool> drain() {
+    pollfd pfd = { .fd = cap->get_fd(), .events = POLLIN };
+    auto start = my_clock::now();
+    int rc = poll(&pfd, 1, poll_timeout_ms);
+    if(rc < 0 && errno != EINTR)
+      return Error(errno, "Failed to poll capture device");
+    if(rc <= 0) return false;
+
+    if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+      return Error(ENODEV, "Capture device stopped streaming");
+
+    if(metrics) metrics->record(Metrics::WAIT, my_clock::now() - start);
+    return read_ready();
+  }
+
+  // Dequeue everything the driver has without waiting.
+  ErrorOr<bool> read_ready() {
+    bool got = false;
+    while(true) {
+      auto start = my_clock::now();
+      auto maybe_frame = TRY(cap->read_frame());
+      if(!maybe_frame) break;
+
+      if(latest) {
+        skipped.fetch_add(1, std::memory_order_relaxed);
+        if(metrics) metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      latest.reset();
+      latest = std::make_shared<BufferHandle>(std::move(*maybe_frame));
+      latest->owner = cap;
+      latest_time = my_clock::now();
+      seq++;
+      got = true;
+
+      // a sequence going backwards is the device restarting, not a gap
+      int32_t gap = last_sequence ? int32_t(latest->sequence - *last_sequence) - 1 : 0;
+      last_sequence = latest->sequence;
+      if(gap > 0) lost.fetch_add(gap, std::memory_order_relaxed);
+
+      if(metrics) {
+        metrics->record(Metrics::CAPTURE, latest_time - latest->timestamp);
+        metrics->record(Metrics::DEQUEUE, latest_time - start);
+        metrics->captured.fetch_add(1, std::memory_order_relaxed);
+        if(gap > 0) metrics->lost.fetch_add(gap, std::memory_order_relaxed);
+      }
+    }
+
+    return got;
+  }
+
+  void publish() {
+    {
+      Metrics::Timer t(metrics, Metrics::HASH);
+      std::swap(hashes, previous);
+      hashes.update(latest->view());
+    }
+    waits->check(latest->view(), latest_time, hashes, previous);
+
+    for(auto& sink: sinks) {
+      auto& back = sink->mailbox.back();
+      back.buf = latest;
+      back.tiles = hashes;
+      back.time = latest_time;
+      back.seq = seq;
+
+      if(sink->mailbox.publish()) {
+        sink->drops.fetch_add(1, std::memory_order_relaxed);
+        if(metrics && sink == sinks[0]) metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      sink->mailbox.back().buf.reset();
+
+      if(sink->notify && !sink->notified.exchange(true, std::memory_order_acq_rel) && !sink->notify())
+        sink->notified.store(false, std::memory_order_release);
+    }
+
+    latest.reset();
+  }
+
+  // hand back every buffer we can before the device goes away
+  void release_buffers() {
+    latest.reset();
+    for(auto& sink: sinks) {
+      sink->mailbox.back().buf.reset();
+      sink->mailbox.retract();
+      sink->mailbox.back().buf.reset();
+    }
+  }
+
   void run() {
     while(running) {
       auto err = [this]() -> ErrorOr<void> {
         if(!cap) TRY(init());
 
         while(running) {
-          if(!have_frame.load(std::memory_order_acquire)) {
-            auto maybe_frame = TRY(cap->read_frame());
-            if(maybe_frame.has_value()) {
-              frame.emplace(std::move(*maybe_frame));
-              have_frame.store(1, std::memory_order_release);
-            }
-          }
+          if(TRY(drain()))
+            publish();
         }
 
         return {};
       }();
 
       if(err.is_error()) {
-        static constexpr const_set<int, 4> allowed_errors = { ENODEV, ENOENT, EACCES, EBADF };
-        if(allowed_errors.count(err.error().code)) {
-          fmt::print("Capture card connection lost, attempting reconnect: {}\n", err.error().what());
-
-          frame.reset();
-          cap.reset();
-          have_frame.store(0);
-
-          std::this_thread::sleep_for(std::chrono::seconds(1));
-        } else {
-          fmt::print("In capture thread: {}\n", err.error().what());
-          std::terminate();
-        }
+        recover(err.error());
+        std::this_thread::sleep_for(std::chrono::seconds(1));
       }
     }
   }
+
+  // Drop the device after an error so it can be reopened later. Errors that
+  // don't look like the card going away are fatal. Frames still held by a
+  // sink keep the old source mapped until they're let go of, so reopening
+  // can see EBUSY until then.
+  void recover(const Error& err) {
+    static constexpr const_set<int, 5> allowed_errors = { ENODEV, ENOENT, EACCES, EBADF, EBUSY };
+    if(!allowed_errors.count(err.code)) {
+      fmt::print("In capture thread: {}\n", err.what());
+      std::terminate();
+    }
+
+    fmt::print("Capture card connection lost, attempting reconnect: {}\n", err.what());
+    release_buffers();
+    cap.reset();
+    last_sequence.reset();
+  }
 };
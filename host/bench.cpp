@@ -0,0 +1,619 @@
+// Benchmarks for the hot paths: input state and batching, the wire protocol,
+// frame copy, conversion, hashing and matching, the capture handoff, and end
+// to end runs against a pi server over a pty pair and a unix socket, and
+// against the vivid virtual capture driver when it's loaded (modprobe vivid).
+//
+// Every result is one JSON object per line on stdout, so runs can be kept and
+// compared across commits:
+//
+//   harness_bench > before.jsonl
+//   harness_bench --filter convert
+//
+// Inputs come from a fixed seed. A microbenchmark's batch size is doubled
+// until one batch takes min_batch, and it reports the median and fastest of
+// --repeat batches.
+#include "async_capture.h"
+#include "convert.h"
+#include "keys.h"
+#include "link.h"
+#include "options.h"
+#include "screen_wait.h"
+#include "tiles.h"
+#include "triple_buffer.h"
+
+#include <common/msg.h>
+#include <common/stats.h>
+#include <common/transport.h>
+#include <pi/server.h>
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+using my_clock = std::chrono::steady_clock;
+
+static constexpr auto min_batch = std::chrono::milliseconds(20);
+
+// keep the compiler from dropping work whose result isn't used
+inline void escape(const void* p) {
+  asm volatile("" : : "g"(p) : "memory");
+}
+
+// One line of output. Keys and strings are ours, nothing needs escaping.
+struct Json {
+  std::string out = "{";
+
+  Json& field(std::string_view key, std::string_view v) {
+    return raw(key, fmt::format("\"{}\"", v));
+  }
+
+  Json& field(std::string_view key, const char* v) { return field(key, std::string_view(v)); }
+  Json& field(std::string_view key, const std::string& v) { return field(key, std::string_view(v)); }
+  Json& field(std::string_view key, bool v) { return raw(key, v ? "true" : "false"); }
+
+  Json& field(std::string_view key, auto v) {
+    return raw(key, fmt::format("{}", v));
+  }
+
+  void print() {
+    fmt::print("{}}}\n", out);
+    std::fflush(stdout);
+  }
+
+protected:
+  Json& raw(std::string_view key, std::string_view v) {
+    if(out.size() > 1) out += ',';
+    out += fmt::format("\"{}\":{}", key, v);
+    return *this;
+  }
+};
+
+struct Bench {
+  std::string_view filter;
+  int repeat = 5;
+
+  bool wanted(std::string_view name) const {
+    return filter.empty() || name.find(filter) != name.npos;
+  }
+
+  // Time f() per call. bytes is what one call processes, for a throughput.
+  template <typename F>
+  void measure(std::string_view name, F&& f, double bytes = 0) {
+    if(!wanted(name)) return;
+
+    auto run = [&](uint64_t n) {
+      auto start = my_clock::now();
+      for(uint64_t i = 0; i < n; i++) f();
+      return my_clock::now() - start;
+    };
+
+    uint64_t batch = 1;
+    while(run(batch) < min_batch) batch *= 2;
+
+    std::vector<double> ns;
+    for(int i = 0; i < repeat; i++)
+      ns.push_back(std::chrono::duration<double, std::nano>(run(batch)).count() / batch);
+    std::sort(ns.begin(), ns.end());
+
+    Json j;
+    j.field("name", name).field("ops", batch * repeat).field("ns_per_op", ns[ns.size() / 2]).field("min_ns_per_op", ns[0]);
+    if(bytes) j.field("mb_per_s", bytes / ns[ns.size() / 2] * 1e3);
+    j.print();
+  }
+};
+
+static void latency_fields(Json& j, const LatencyHistogram& h) {
+  auto s = h.summary();
+  auto us = [](auto d) { return std::chrono::duration<double, std::micro>(d).count(); };
+  j.field("samples", s.count).field("p50_us", us(s.p50)).field("p99_us", us(s.p99)).field("max_us", us(s.max));
+}
+
+// Stands in for the serial port, counts what would have been sent.
+struct NullStream {
+  size_t bytes = 0;
+  void write(const char*, size_t n) { bytes += n; }
+  void flush() {}
+};
+
+static void bench_keys(Bench& b) {
+  std::mt19937 rng(1);
+  std::vector<SDL_Event> keys(1024), motion(1024);
+
+  for(size_t i = 0; i < keys.size(); i++) {
+    keys[i] = {};
+    keys[i].type = i % 2 ? SDL_KEYUP : SDL_KEYDOWN;
+    keys[i].key.keysym.scancode = SDL_Scancode(SDL_SCANCODE_A + rng() % 26);
+
+    motion[i] = {};
+    motion[i].type = SDL_MOUSEMOTION;
+    motion[i].motion.x = rng() % 1920;
+    motion[i].motion.y = rng() % 1080;
+  }
+
+  keys::KeyState state;
+  size_t i = 0;
+
+  b.measure("keys.consume_event/key", [&]() { state.consume_event(keys[i++ % keys.size()], 1920, 1080); });
+  b.measure("keys.consume_event/motion", [&]() { state.consume_event(motion[i++ % motion.size()], 1920, 1080); });
+
+  // an event of each kind and the frame it ends up in
+  for(bool nkro: { false, true }) {
+    NullStream out;
+    state.nkro = nkro;
+    state.stamp = true;
+    b.measure(nkro ? "keys.dump/nkro" : "keys.dump/boot", [&]() {
+      state.consume_event(keys[i % keys.size()], 1920, 1080);
+      state.consume_event(motion[i++ % motion.size()], 1920, 1080);
+      state.dump(out, true);
+    });
+  }
+}
+
+static void bench_msg(Bench& b) {
+  std::mt19937 rng(2);
+  FrameWriter writer;
+
+  // a busy frame: stamp, keyboard and a few mouse reports
+  auto fill = [&]() {
+    writer.add(stamp_t{ uint32_t(rng()) });
+    writer.add(keyboard_t{ 0x02, 0, 0x04, 0x05 });
+    for(int i = 0; i < 4; i++)
+      writer.add(pack_mouse({ .x = int16_t(rng() % 32768), .y = int16_t(rng() % 32768), .wheel = int8_t(rng() % 3 - 1) }));
+  };
+
+  fill();
+  double frame_bytes = writer.finish().size();
+
+  b.measure("msg.encode", [&]() {
+    fill();
+    escape(writer.finish().data());
+  }, frame_bytes);
+
+  std::vector<uint8_t> stream;
+  for(int i = 0; i < 256; i++) {
+    fill();
+    auto bytes = writer.finish();
+    stream.insert(stream.end(), bytes.begin(), bytes.end());
+  }
+
+  FrameParser parser;
+  uint64_t sum = 0;
+  b.measure("msg.decode", [&]() {
+    parser.parse_records(stream, overloaded {
+        [&](const mouse_t& m) { sum += m[2]; },
+        [&](const keyboard_t& k) { sum += k[0]; },
+        [](const auto&) {},
+      });
+    escape(&sum);
+  }, double(stream.size()));
+}
+
+static void bench_frames(Bench& b) {
+  std::mt19937 rng(3);
+  static constexpr int sizes[][2] = { { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 } };
+
+  std::vector<const convert::Kernels*> kernels = { &convert::scalar::kernels };
+  if(&convert::best() != &convert::scalar::kernels) kernels.push_back(&convert::best());
+
+  for(auto [w, h]: sizes) {
+    std::vector<std::byte> src(size_t(w) * h * 3), dst(size_t(w) * h * 4);
+    for(auto& v: src) v = std::byte(rng());
+
+    auto dims = fmt::format("{}x{}", w, h);
+
+    // what a texture upload of an NV12 frame costs at best
+    size_t nv12 = size_t(w) * h * 3 / 2;
+    b.measure(fmt::format("frame.copy/nv12/{}", dims), [&]() {
+      std::memcpy(dst.data(), src.data(), nv12);
+      escape(dst.data());
+    }, double(nv12));
+
+    for(auto* k: kernels) {
+      auto yuyv = FrameView::packed(V4L2_PIX_FMT_YUYV, src, w, h, w * 2);
+      b.measure(fmt::format("frame.convert/yuyv/{}/{}", k->name, dims), [&]() {
+        convert::convert(yuyv, V4L2_PIX_FMT_NV12, dst.data(), w, h, *k);
+        escape(dst.data());
+      }, w * h * 2.0);
+
+      auto rgb = FrameView::packed(V4L2_PIX_FMT_RGB24, src, w, h, w * 3);
+      b.measure(fmt::format("frame.convert/rgb24/{}/{}", k->name, dims), [&]() {
+        convert::convert(rgb, V4L2_PIX_FMT_XBGR32, dst.data(), w * 4, h, *k);
+        escape(dst.data());
+      }, w * h * 3.0);
+    }
+
+    tiles::Hashes hashes;
+    auto yuyv = FrameView::packed(V4L2_PIX_FMT_YUYV, src, w, h, w * 2);
+    b.measure(fmt::format("frame.hash/yuyv/{}", dims), [&]() {
+      hashes.update(yuyv);
+      escape(hashes.hash.data());
+    }, w * h * 2.0);
+
+    // a wait for the whole screen that matches, so no row is skipped
+    auto nv12_view = FrameView::nv12(src, w, h, w);
+    auto reference = match::Template::grab(nv12_view, { 0, 0, w, h }).release_value();
+    std::vector<std::pair<const char*, match::SadRow>> sads = { { "scalar", match::scalar::sad_row } };
+    if(match::best() != match::scalar::sad_row) sads.push_back({ "simd", match::best() });
+
+    for(auto [name, f]: sads) {
+      b.measure(fmt::format("frame.match/nv12/{}/{}", name, dims), [&]() {
+        auto d = match::difference(nv12_view, 0, 0, reference, 0, f);
+        escape(&d);
+      }, double(w) * h);
+    }
+  }
+}
+
+// The capture thread's side of handing a frame to a sink, and how long the
+// sink takes to see it, without a device in the way. Like a real capture the
+// next frame only comes once the last one was picked up.
+static void bench_handoff(Bench& b) {
+  static constexpr char name[] = "capture.handoff";
+  static constexpr uint32_t frames = 20000;
+  if(!b.wanted(name)) return;
+
+  TripleBuffer<AsyncCapture::Frame> mailbox;
+  LatencyHistogram latency;
+  std::atomic<bool> done = false;
+  std::atomic<uint32_t> seen = 0;
+  uint64_t drops = 0;
+
+  std::vector<std::byte> image(1920 * 1080 * 2);
+  tiles::Hashes hashes;
+  hashes.update(FrameView::packed(V4L2_PIX_FMT_YUYV, image, 1920, 1080, 1920 * 2));
+
+  // a buffer with a real control block, so handing it over costs what it does
+  auto buf = std::shared_ptr<Capture::BufferHandle>(static_cast<Capture::BufferHandle*>(nullptr), [](auto*) {});
+
+  std::jthread consumer([&]() {
+    while(!done.load(std::memory_order_acquire)) {
+      if(auto* f = mailbox.consume()) {
+        latency.record(my_clock::now() - f->time);
+        f->buf.reset();
+        seen.store(f->seq + 1, std::memory_order_release);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  my_clock::duration took {};
+  for(uint32_t seq = 0; seq < frames; seq++) {
+    auto start = my_clock::now();
+    auto& back = mailbox.back();
+    back.buf = buf;
+    back.tiles = hashes;
+    back.time = start;
+    back.seq = seq;
+    drops += mailbox.publish();
+    mailbox.back().buf.reset();
+    took += my_clock::now() - start;
+
+    while(seen.load(std::memory_order_acquire) <= seq)
+      std::this_thread::yield();
+  }
+
+  done = true;
+  consumer.join();
+
+  Json j;
+  j.field("name", name).field("ops", frames)
+   .field("ns_per_op", std::chrono::duration<double, std::nano>(took).count() / frames)
+   .field("dropped", drops);
+  latency_fields(j, latency);
+  j.print();
+}
+
+// A pi server in a child process, with /dev/null for its HID gadgets.
+static ErrorOr<pid_t> spawn_server(std::vector<Transport::Spec> links) {
+  pid_t pid = fork();
+  if(pid < 0) return Error(errno, "fork failed");
+  if(pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+
+    asio::io_service service;
+    Server server(service, links, Transport::default_baud, "/dev/null", "/dev/null", "/dev/null");
+    server.start();
+    service.run();
+    _exit(0);
+  }
+  return pid;
+}
+
+// Measures input latency from the server's echoes (both sides share the
+// clock) and how fast records get through, written the way the viewer
+// writes them, through a LinkWriter.
+static ErrorOr<void> bench_link(std::string_view name, asio::io_service& service, Transport& stream) {
+  int fd = stream.native_handle();
+  FrameWriter frame;
+
+  auto link = TRY(handshake(service, stream, frame, std::chrono::seconds(2)));
+  if(!(link.caps & CAP_TELEMETRY)) return Error("The server doesn't echo");
+
+  LatencyHistogram latency, hid;
+  std::atomic<uint64_t> echoes = 0;
+  std::atomic<bool> done = false;
+
+  std::jthread reader([&]() {
+    FrameParser parser;
+    StreamBuffer<4096> rx;
+
+    while(!done) {
+      pollfd pfd = { .fd = fd, .events = POLLIN };
+      if(poll(&pfd, 1, 50) <= 0) continue;
+
+      auto buf = rx.writable();
+      ssize_t n = ::read(fd, buf.data(), buf.size());
+      if(n <= 0) continue;
+
+      uint32_t now = stamp_now();
+      rx.commit(n);
+      rx.consume(parser.parse_records(rx.readable(), overloaded {
+          [&](const echo_t& e) {
+            latency.record(std::chrono::microseconds(int32_t(now - e.host)));
+            hid.record(std::chrono::microseconds(int32_t(e.hid - e.rx)));
+            echoes++;
+          },
+          [](const auto&) {},
+        }));
+    }
+  });
+
+  LinkWriter writer(service, stream);
+  auto work = asio::make_work_guard(service);
+  service.restart();
+  std::jthread io([&]() { service.run(); });
+
+  auto send = [&]() {
+    auto bytes = frame.finish();
+    writer.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    writer.flush();
+    return bytes.size();
+  };
+
+  auto wait_for = [&](uint64_t n) {
+    auto deadline = my_clock::now() + std::chrono::seconds(5);
+    while(echoes < n && my_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    return echoes >= n;
+  };
+
+  // paced like a person typing fast, one stamped report per frame
+  static constexpr int paced = 2000;
+  auto next = my_clock::now();
+  for(int i = 0; i < paced; i++) {
+    frame.add(stamp_t{ stamp_now() });
+    frame.add(keyboard_t{});
+    send();
+
+    next += std::chrono::milliseconds(1);
+    std::this_thread::sleep_until(next);
+  }
+  wait_for(paced);
+
+  Json lat;
+  lat.field("name", fmt::format("{}.latency", name)).field("sent", paced).field("echoed", echoes.load());
+  latency_fields(lat, latency);
+  lat.field("hid_p50_us", std::chrono::duration<double, std::micro>(hid.summary().p50).count());
+  lat.print();
+
+  // as fast as the link takes full frames of relative motion, until the
+  // stamp behind them comes back
+  uint64_t bytes = 0, reports = 0;
+  auto start = my_clock::now();
+  while(my_clock::now() - start < std::chrono::seconds(1)) {
+    while(frame.add(pack_mouse({ .id = MOUSE_RELATIVE, .x = 1, .y = -1 }))) reports++;
+    bytes += send();
+  }
+
+  uint64_t before = echoes;
+  frame.add(stamp_t{ stamp_now() });
+  bytes += send();
+  bool through = wait_for(before + 1);
+  double secs = std::chrono::duration<double>(my_clock::now() - start).count();
+
+  done = true;
+  work.reset();
+  io.join();
+
+  auto ws = writer.get_stats();
+  Json tp;
+  tp.field("name", fmt::format("{}.throughput", name)).field("complete", through).field("bytes", bytes)
+    .field("mb_per_s", bytes / secs / 1e6).field("reports_per_s", reports / secs)
+    .field("frames", ws.frames).field("writes", ws.writes);
+  tp.print();
+  return {};
+}
+
+// The server on the slave end of a pty, as close to the UART as it gets here.
+static ErrorOr<void> bench_pty(Bench& b) {
+  if(!b.wanted("link.pty")) return {};
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+    return Error(errno, "Failed to open a pty");
+  std::string slave = ptsname(master);
+
+  // raw before the server opens it, so nothing echoes back
+  int slave_fd = open(slave.c_str(), O_RDWR | O_NOCTTY);
+  if(slave_fd < 0) return Error::format(errno, "Failed to open {}", slave);
+  termios tio;
+  tcgetattr(slave_fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave_fd, TCSANOW, &tio);
+
+  auto spawned = spawn_server({ Transport::Spec{ .path = slave } });
+  close(slave_fd);
+  if(spawned.is_error()) return spawned.error();
+  pid_t pid = spawned.release_value();
+
+  auto ret = [&]() -> ErrorOr<void> {
+    asio::io_service service;
+    Transport stream(service, master);
+    return bench_link("link.pty", service, stream);
+  }();
+
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  return ret;
+}
+
+// The server listening on a unix socket, the way host and server are load
+// tested together on one box.
+static ErrorOr<void> bench_unix(Bench& b) {
+  if(!b.wanted("link.unix")) return {};
+
+  Transport::Spec spec { .kind = Transport::Spec::UNIX, .path = fmt::format("/tmp/harness_bench.{}.sock", getpid()) };
+  auto pid = TRY(spawn_server({ spec }));
+
+  auto ret = [&]() -> ErrorOr<void> {
+    asio::io_service service;
+    Transport stream(service, { spec });
+
+    // give the child a moment to listen
+    auto deadline = my_clock::now() + std::chrono::seconds(2);
+    while(true) {
+      auto res = stream.connect();
+      if(!res.is_error()) break;
+      if(my_clock::now() > deadline) return res.error();
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    return bench_link("link.unix", service, stream);
+  }();
+
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  unlink(spec.path.c_str());
+  return ret;
+}
+
+static std::optional<std::string> find_vivid() {
+  for(int i = 0; i < 64; i++) {
+    auto path = fmt::format("/dev/video{}", i);
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) continue;
+
+    v4l2_capability caps {};
+    bool ok = ioctl(fd, VIDIOC_QUERYCAP, &caps) == 0
+      && std::string_view(reinterpret_cast<const char*>(caps.driver)) == "vivid"
+      && (caps.device_caps & V4L2_CAP_VIDEO_CAPTURE);
+    close(fd);
+
+    if(ok) return path;
+  }
+  return std::nullopt;
+}
+
+// Real capture through the driver, at whatever vivid can do at 1080p.
+static ErrorOr<void> bench_vivid(Bench& b) {
+  static constexpr char name[] = "capture.vivid";
+  if(!b.wanted(name)) return {};
+
+  auto device = find_vivid();
+  if(!device) {
+    fmt::print(stderr, "No vivid device, modprobe vivid to run {}\n", name);
+    Json().field("name", name).field("skipped", true).print();
+    return {};
+  }
+
+  auto cap = TRY(AsyncCapture::open(device->c_str(), 4, Capture::Memory::MMAP, { 1920, 1080, 60 }));
+  auto& mode = cap->get_mode();
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool ready = false;
+  cap.on_frame([&]() {
+    std::lock_guard lock(mutex);
+    ready = true;
+    cv.notify_one();
+    return true;
+  });
+
+  LatencyHistogram latency;
+  uint64_t frames = 0;
+
+  cap.start();
+  auto start = my_clock::now(), end = start + std::chrono::seconds(3);
+  while(my_clock::now() < end) {
+    {
+      std::unique_lock lock(mutex);
+      cv.wait_until(lock, end, [&]() { return ready; });
+      ready = false;
+    }
+
+    if(auto* f = cap.pop_frame()) {
+      latency.record(my_clock::now() - f->time);
+      f->buf.reset();
+      frames++;
+    }
+  }
+  cap.join();
+
+  double secs = std::chrono::duration<double>(my_clock::now() - start).count();
+
+  Json j;
+  j.field("name", name).field("device", *device).field("format", fourcc_str(mode.fourcc))
+   .field("width", mode.width).field("height", mode.height)
+   .field("fps", frames / secs).field("dropped", cap.dropped_frames());
+  latency_fields(j, latency);
+  j.print();
+  return {};
+}
+
+ErrorOr<void> go(int argc, char** argv) {
+  Bench b;
+
+  for(int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if(arg == "--filter" && i + 1 < argc) b.filter = argv[++i];
+    else if(arg == "--repeat" && i + 1 < argc) b.repeat = std::max(1, TRY(parse_number<int>(argv[++i])));
+    else return Error::format("USAGE: {} [--filter <substring>] [--repeat <n>]", argv[0]);
+  }
+
+  Json().field("name", "meta").field("convert_kernels", convert::best().name)
+        .field("threads", std::thread::hardware_concurrency()).field("repeat", b.repeat).print();
+
+  // the child servers are forked before any of our threads exist
+  TRY(bench_pty(b));
+  TRY(bench_unix(b));
+
+  bench_keys(b);
+  bench_msg(b);
+  bench_frames(b);
+  bench_handoff(b);
+  TRY(bench_vivid(b));
+  return {};
+}
+
+int main(int argc, char** argv) {
+  auto ret = go(argc, argv);
+
+  if(ret.is_error()) {
+    fmt::print(stderr, "{}\n", ret.error().what());
+    return 1;
+  }
+
+  return 0;
+}
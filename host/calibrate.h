@@ -0,0 +1,119 @@
+#pragma once
+
+#include "tiles.h"
+
+#include <common/msg.h>
+#include <common/stats.h>
+
+#include <fmt/core.h>
+
+#include <chrono>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+// Input to photon latency. Every so often a key that makes a known change on
+// the target's screen is tapped through the pi (caps lock with an on screen
+// indicator, or a test pattern app that flips colour on a key), and the
+// frames are watched for the change. Input to capture is measured to the
+// driver's timestamp of the first frame that shows it, input to photon to
+// that frame's present here. Nothing else may change on screen, or in the
+// region being watched, while it runs.
+struct Calibration {
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr auto timeout = std::chrono::seconds(2);
+  static constexpr auto period = std::chrono::milliseconds(500);
+  static constexpr size_t report_every = 20;
+
+  LatencyHistogram to_capture;
+  LatencyHistogram to_photon;
+  uint64_t timeouts = 0;
+
+  // usage is the HID usage of the key to tap. region is in pixels, empty
+  // watches the whole frame.
+  Calibration(uint8_t usage, Rect region = {}) : usage(usage), region(region), next_tap(my_clock::now() + period) {}
+
+  // Press and release of the key if a tap is due, to send right away.
+  std::optional<std::pair<keyboard_nkro_t, keyboard_nkro_t>> due() {
+    if(sent) {
+      if(my_clock::now() - *sent < timeout) return std::nullopt;
+
+      // the change never showed up, or was missed
+      timeouts++;
+      fmt::print("Calibration: no change within {}s of the input\n", timeout.count());
+      finish();
+      return std::nullopt;
+    }
+
+    if(my_clock::now() < next_tap || baseline.empty()) return std::nullopt;
+
+    keyboard_nkro_t press {};
+    press[usage / 8] |= 1 << usage % 8;
+    return std::pair(press, keyboard_nkro_t {});
+  }
+
+  // The tap went out over serial just now.
+  void tapped() { sent = my_clock::now(); }
+
+  // Every frame the viewer pops, with the driver's capture time. A changed
+  // frame captured after the tap is the tap showing up.
+  void on_frame(const tiles::Hashes& h, my_clock::time_point captured) {
+    if(sent && !detected && captured > *sent && changed(h)) {
+      to_capture.record(captured - *sent);
+      detected = true;
+    }
+    if(!sent) baseline = watched(h);
+  }
+
+  // The viewer presented, if the change was in that frame it's on screen now.
+  void on_present() {
+    if(!detected) return;
+    to_photon.record(my_clock::now() - *sent);
+    finish();
+
+    if(to_photon.summary().count % report_every == 0)
+      fmt::print("Calibration: {}\n", summary());
+  }
+
+  std::string summary() const {
+    auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    auto c = to_capture.summary(), p = to_photon.summary();
+    return fmt::format("input to capture p50 {:.1f}ms p99 {:.1f}ms, to photon p50 {:.1f}ms p99 {:.1f}ms, "
+                       "{} samples, {} timeouts", ms(c.p50), ms(c.p99), ms(p.p50), ms(p.p99), p.count, timeouts);
+  }
+
+protected:
+  uint8_t usage;
+  Rect region;
+
+  std::optional<my_clock::time_point> sent;
+  bool detected = false;
+  my_clock::time_point next_tap;
+  std::vector<uint64_t> baseline; // hashes of the watched tiles before the tap
+
+  // taps aren't locked to the frame rate, so they land all over the frame
+  std::minstd_rand rng { 1 };
+
+  void finish() {
+    sent.reset();
+    detected = false;
+    baseline.clear();
+
+    std::uniform_int_distribution<int> jitter(0, 50);
+    next_tap = my_clock::now() + period + std::chrono::milliseconds(jitter(rng));
+  }
+
+  std::vector<uint64_t> watched(const tiles::Hashes& h) const {
+    std::vector<uint64_t> ret;
+    int x1 = region.w ? region.x + region.w : h.width, y1 = region.h ? region.y + region.h : h.height;
+
+    for(int r = region.y / tiles::tile_h; r < h.rows && r * tiles::tile_h < y1; r++)
+      for(int c = region.x / tiles::tile_w; c < h.cols && c * tiles::tile_w < x1; c++)
+        ret.push_back(h.hash[size_t(r) * h.cols + c]);
+    return ret;
+  }
+
+  bool changed(const tiles::Hashes& h) const { return watched(h) != baseline; }
+};
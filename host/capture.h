@@ -1,12 +1,19 @@
 #pragma once
 
+#include "convert.h"
+#include "frame.h"
+
 #include <common/err.h>
 #include <stdexcept>
 #include <system_error>
 #include <cstdint>
+#include <memory>
 #include <utility>
 #include <vector>
+#include <optional>
 #include <span>
+#include <chrono>
+#include <cstdlib>
 #include <fmt/core.h>
 
 #include <fcntl.h>
@@ -27,151 +34,461 @@ static ErrorOr<int> do_ioctl(int fd, unsigned request, auto&& args) {
   return rc;
 }
 
-struct MMapSpan: std::span<std::byte> {
+// Memory backing one capture buffer, either mmap'd from the driver or
+// allocated by us and handed to the driver as a user pointer.
+struct BufferSpan: std::span<std::byte> {
   using Base = std::span<std::byte>;
-  using Base::Base;
 
-  ~MMapSpan() {
-    if(!empty()) munmap(data(), size());
+  BufferSpan(std::byte* data, size_t size, bool mapped)
+    : Base(data, size), mapped(mapped) {}
+  BufferSpan(const BufferSpan& o) = delete;
+  BufferSpan(BufferSpan&& o)
+    : Base(std::exchange(static_cast<Base&>(o), Base())), mapped(o.mapped) {}
+
+  ~BufferSpan() {
+    if(empty()) return;
+    if(mapped) munmap(data(), size());
+    else free(data());
   }
+
+protected:
+  bool mapped;
+};
+
+// Where AsyncCapture gets its frames: a V4L2 device (Capture below) or a raw
+// recording being replayed (FileSource in file_source.h). get_fd() becomes
+// readable when read_frame() may have something, so sources can share a
+// poll or epoll set. Frames are handed out as BufferHandles that point into
+// the source's own memory and go back to it when destroyed.
+struct CaptureSource {
+  // A format the source can deliver. interval is the time per frame in
+  // seconds, {0, 0} if the driver doesn't say.
+  struct Mode {
+    uint32_t fourcc = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    v4l2_fract interval = {0, 0};
+
+    double fps() const { return interval.numerator ? double(interval.denominator) / interval.numerator : 0; }
+  };
+
+  // What the user asked for, zero means whatever the device is set to now.
+  struct Request {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t fps = 0;
+
+    // how a recording is replayed: as it was recorded, as fast as frames
+    // are taken, or at fps
+    enum class Pace { RECORDED, FAST, FIXED } pace = Pace::RECORDED;
+  };
+
+  struct BufferHandle {
+    CaptureSource* parent;
+    int index;
+    std::span<std::byte> data;
+
+    // when the frame was captured, on steady_clock, and the source's count
+    // of frames; a gap in sequence is frames the source dropped
+    std::chrono::steady_clock::time_point timestamp;
+    uint32_t sequence = 0;
+
+    // Keeps the source, and its mapped buffers, alive for as long as the
+    // frame is held, even if its owner drops it after the device went away.
+    // Released after the destructor hands the buffer back.
+    std::shared_ptr<CaptureSource> owner;
+
+    BufferHandle(CaptureSource* parent, int index, std::span<std::byte> data,
+                 std::chrono::steady_clock::time_point timestamp = {}, uint32_t sequence = 0)
+      : parent(parent), index(index), data(data), timestamp(timestamp), sequence(sequence) {}
+    BufferHandle(const BufferHandle& o) = delete;
+    BufferHandle(BufferHandle&& o)
+      : parent(o.parent), index(std::exchange(o.index, -1)), data(o.data), timestamp(o.timestamp),
+        sequence(o.sequence), owner(std::move(o.owner)) {}
+
+    ~BufferHandle() {
+      if(index >= 0) parent->release(index);
+    }
+
+    FrameView view() const {
+      uint32_t format = parent->get_format();
+      if(format == V4L2_PIX_FMT_NV12)
+        return FrameView::nv12(data, parent->get_width(), parent->get_height(), parent->get_stride());
+      return FrameView::packed(format, data, parent->get_width(), parent->get_height(), parent->get_stride());
+    }
+  };
+
+  virtual ~CaptureSource() = default;
+
+  virtual ErrorOr<std::optional<BufferHandle>> read_frame() = 0;
+
+  virtual int get_fd() const = 0;
+  virtual uint32_t get_width() const = 0;
+  virtual uint32_t get_height() const = 0;
+  virtual uint32_t get_format() const = 0;
+  virtual uint32_t get_stride() const = 0;
+  virtual const Mode& get_mode() const = 0;
+
+protected:
+  // buffer index is free to be filled again
+  virtual void release(int index) = 0;
 };
 
-struct Capture {
+struct Capture: CaptureSource {
   static ErrorOr<Capture> open(const char* path) {
+    return open(path, Request{});
+  }
+
+  static ErrorOr<Capture> open(const char* path, const Request& req) {
     Capture ret;
-    ret.fd = ::open(path, O_RDWR, 0);
+    ret.fd = ::open(path, O_RDWR | O_NONBLOCK, 0);
     if(ret.fd < 0)
       return Error(errno, "Failed to open capture device");
 
     v4l2_capability caps;
     TRY(do_ioctl(ret.fd, VIDIOC_QUERYCAP, caps));
 
-    int mask = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
-    if((caps.capabilities & mask) != mask)
-      return Error("Capture does not support video capture and streaming.");
+    uint32_t device_caps = caps.capabilities & V4L2_CAP_DEVICE_CAPS ? caps.device_caps : caps.capabilities;
+    if(!(device_caps & V4L2_CAP_STREAMING))
+      return Error("Capture does not support streaming.");
 
+    if(device_caps & V4L2_CAP_VIDEO_CAPTURE)
+      ret.buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    else if(device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
+      ret.buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    else
+      return Error("Capture does not support video capture.");
+
+    ret.fmt.type = ret.buf_type;
     TRY(do_ioctl(ret.fd, VIDIOC_G_FMT, ret.fmt));
-    TRY(ret.set_resolution(ret.get_width(), ret.get_height()));
+    TRY(ret.set_resolution(req.width ? req.width : ret.get_width(),
+                           req.height ? req.height : ret.get_height(), req.fps));
 
     return ret;
   }
 
-  ErrorOr<Capture&> set_resolution(int width, int height) {
-    fmt = {
-      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-      .fmt = {
-        .pix = {
-          .width = 2560,
-          .height = 1440,
-          .pixelformat = V4L2_PIX_FMT_NV12,
-          .field = V4L2_FIELD_ANY
+  // Every format and frame interval the device offers at width x height.
+  // Drivers with stepwise or continuous sizes report the size as requested
+  // if it is in range, and their shortest interval.
+  std::vector<Mode> modes(uint32_t width, uint32_t height) {
+    std::vector<Mode> ret;
+
+    v4l2_fmtdesc desc = { .type = buf_type };
+    for(desc.index = 0; !do_ioctl(fd, VIDIOC_ENUM_FMT, desc).is_error(); desc.index++) {
+      v4l2_frmsizeenum size = { .pixel_format = desc.pixelformat };
+      bool size_ok = false, enumerated = false;
+
+      for(size.index = 0; !do_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, size).is_error(); size.index++) {
+        enumerated = true;
+
+        if(size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+          size_ok |= size.discrete.width == width && size.discrete.height == height;
+        } else {
+          auto& sw = size.stepwise;
+          size_ok |= width >= sw.min_width && width <= sw.max_width &&
+                     height >= sw.min_height && height <= sw.max_height &&
+                     (width - sw.min_width) % std::max(sw.step_width, 1u) == 0 &&
+                     (height - sw.min_height) % std::max(sw.step_height, 1u) == 0;
+          break;
         }
       }
-    };
 
-    TRY(do_ioctl(fd, VIDIOC_S_FMT, fmt));
-    return *this;
+      // not every driver enumerates sizes, assume it can do what we ask
+      if(!size_ok && enumerated) continue;
+
+      Mode mode = { desc.pixelformat, width, height };
+      v4l2_frmivalenum ival = { .pixel_format = desc.pixelformat, .width = width, .height = height };
+      bool any = false;
+
+      for(ival.index = 0; !do_ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, ival).is_error(); ival.index++) {
+        any = true;
+        if(ival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+          mode.interval = ival.discrete;
+          ret.push_back(mode);
+        } else {
+          mode.interval = ival.stepwise.min;
+          ret.push_back(mode);
+          break;
+        }
+      }
+
+      if(!any) ret.push_back(mode);
+    }
+
+    return ret;
   }
 
-  ErrorOr<Capture&> start(uint32_t buffer_count) {
-    v4l2_requestbuffers req_buf = {
-      .count = buffer_count,
-      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-      .memory = V4L2_MEMORY_MMAP
+  // Pick the mode with the lowest latency: the shortest frame interval that
+  // is at least as fast as asked for, then the cheapest format to display.
+  static std::optional<Mode> best_mode(std::span<const Mode> modes, uint32_t fps) {
+    auto seconds = [](const Mode& m) {
+      return m.interval.denominator ? double(m.interval.numerator) / m.interval.denominator : 1e9;
     };
 
-    TRY(do_ioctl(fd, VIDIOC_REQBUFS, req_buf));
+    std::optional<Mode> ret;
+    for(auto& m: modes) {
+      if(convert::cost(m.fourcc) < 0) continue;
 
-    if(req_buf.count < 2)
-      return Error("Not enough buffers provided");
+      auto better = [&]() {
+        if(!ret) return true;
+
+        bool fast_enough = !fps || m.fps() >= fps, ret_fast_enough = !fps || ret->fps() >= fps;
+        if(fast_enough != ret_fast_enough) return fast_enough;
 
-    buffers.reserve(req_buf.count);
-    for(uint32_t i = 0; i < req_buf.count; i++) {
-      v4l2_buffer buf = {
-        .index = i,
-        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-        .memory = V4L2_MEMORY_MMAP,
+        if(seconds(m) != seconds(*ret)) return seconds(m) < seconds(*ret);
+        return convert::cost(m.fourcc) < convert::cost(ret->fourcc);
       };
 
-      TRY(do_ioctl(fd, VIDIOC_QUERYBUF, buf));
+      if(better()) ret = m;
+    }
 
-      void* mem = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
-      if(mem == MAP_FAILED)
-        return Error(errno, "Failed to mmap buffer");
+    return ret;
+  }
 
-      buffers.emplace_back(static_cast<std::byte*>(mem), buf.length);
-      TRY(queue_buffer(i));
+  ErrorOr<Capture&> set_resolution(uint32_t width, uint32_t height, uint32_t fps = 0) {
+    auto mode = best_mode(modes(width, height), fps);
+    if(!mode)
+      return Error::format("No supported capture format at {}x{}", width, height);
+
+    fmt = { .type = buf_type };
+    if(is_mplane()) {
+      fmt.fmt.pix_mp.width = mode->width;
+      fmt.fmt.pix_mp.height = mode->height;
+      fmt.fmt.pix_mp.pixelformat = mode->fourcc;
+      fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+      fmt.fmt.pix_mp.num_planes = 1;
+    } else {
+      fmt.fmt.pix.width = mode->width;
+      fmt.fmt.pix.height = mode->height;
+      fmt.fmt.pix.pixelformat = mode->fourcc;
+      fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    }
+
+    TRY(do_ioctl(fd, VIDIOC_S_FMT, fmt));
+
+    // the driver is free to hand back something else
+    if(convert::cost(get_format()) < 0)
+      return Error::format("Capture format {} is not supported", fourcc_str(get_format()));
+    if(is_mplane() && fmt.fmt.pix_mp.num_planes != 1)
+      return Error::format("Capture format {} has {} planes, only one is supported",
+                           fourcc_str(get_format()), fmt.fmt.pix_mp.num_planes);
+
+    // not all devices let us choose the frame rate, HDMI bridges follow the source
+    v4l2_streamparm parm = { .type = buf_type };
+    if(mode->interval.denominator) {
+      parm.parm.capture.timeperframe = mode->interval;
+      IGNORE(do_ioctl(fd, VIDIOC_S_PARM, parm));
     }
 
-    TRY(do_ioctl(fd, VIDIOC_STREAMON, V4L2_BUF_TYPE_VIDEO_CAPTURE));
+    current = { get_format(), get_width(), get_height() };
+    if(!do_ioctl(fd, VIDIOC_G_PARM, parm).is_error() && (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+      current.interval = parm.parm.capture.timeperframe;
+    else
+      current.interval = mode->interval;
+
+    return *this;
+  }
+
+  enum class Memory {
+    MMAP,    // driver allocated buffers, mapped into our address space
+    USERPTR, // page aligned buffers we allocate, filled in place by the driver
+  };
+
+  // USERPTR falls back to MMAP if the driver doesn't support it, whether it
+  // says so at REQBUFS or only turns our memory down at the first QBUF (as
+  // contiguous DMA drivers do).
+  ErrorOr<Capture&> start(uint32_t buffer_count, Memory mem = Memory::MMAP) {
+    bool started = false;
+    if(mem == Memory::USERPTR) {
+      uint32_t count = buffer_count;
+      auto res = request_buffers(count, Memory::USERPTR);
+      if(!res.is_error()) res = queue_buffers(count);
+      if(res.is_error()) free_buffers();
+      else started = true;
+    }
+
+    if(!started) {
+      TRY(request_buffers(buffer_count, Memory::MMAP));
+      TRY(queue_buffers(buffer_count));
+    }
+
+    TRY(do_ioctl(fd, VIDIOC_STREAMON, buf_type));
 
     return *this;
   }
 
   ErrorOr<void> queue_buffer(uint32_t i) {
-    v4l2_buffer buf = {
-      .index = i,
-      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-      .memory = V4L2_MEMORY_MMAP
-    };
+    v4l2_plane plane;
+    auto buf = describe(i, plane);
+
+    if(memory == V4L2_MEMORY_USERPTR) {
+      auto ptr = reinterpret_cast<unsigned long>(buffers[i].data());
+      if(is_mplane()) {
+        plane.m.userptr = ptr;
+        plane.length = buffers[i].size();
+      } else {
+        buf.m.userptr = ptr;
+        buf.length = buffers[i].size();
+      }
+    }
 
     TRY(do_ioctl(fd, VIDIOC_QBUF, buf));
     return {};
   }
 
-  struct BufferHandle {
-    Capture* parent;
-    int index;
-    std::span<std::byte> data;
+  // Export an MMAP buffer as a DMABUF fd for consumers that can import it
+  // (EGL, DRM planes, encoders). The caller owns the returned fd.
+  ErrorOr<int> export_buffer(uint32_t i) {
+    if(memory != V4L2_MEMORY_MMAP)
+      return Error("Only MMAP buffers can be exported");
 
-    BufferHandle(Capture* parent, int index, std::span<std::byte> data)
-      : parent(parent), index(index), data(data) {}
-    BufferHandle(const BufferHandle& o) = delete;
-    BufferHandle(BufferHandle&& o)
-      : parent(o.parent), index(std::exchange(o.index, -1)), data(o.data) {}
+    v4l2_exportbuffer exp = {
+      .type = buf_type,
+      .index = i,
+      .flags = O_RDONLY | O_CLOEXEC,
+    };
 
-    ~BufferHandle() {
-      if(index >= 0) IGNORE(parent->queue_buffer(index));
-    }
-  };
+    TRY(do_ioctl(fd, VIDIOC_EXPBUF, exp));
+    return exp.fd;
+  }
 
-  ErrorOr<std::optional<BufferHandle>> read_frame() {
-    v4l2_buffer buf = {
-      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-      .memory = V4L2_MEMORY_MMAP,
-    };
+  ErrorOr<std::optional<BufferHandle>> read_frame() override {
+    v4l2_plane plane;
+    auto buf = describe(0, plane);
 
     if(TRY(do_ioctl(fd, VIDIOC_DQBUF, buf)))
       return std::nullopt;
 
+    uint32_t used = is_mplane() ? plane.bytesused : buf.bytesused;
+
     if(buf.index < 0 || buf.index >= buffers.size())
       return Error::format("Dequeue'd buffer index out of range, {} not in [0, {})", buf.index, buffers.size());
 
-    return BufferHandle(this, buf.index, buffers[buf.index].subspan(0, buf.bytesused));
+    // Almost every driver stamps frames on CLOCK_MONOTONIC, which is
+    // steady_clock. The few that don't get the time we dequeued them.
+    auto timestamp = std::chrono::steady_clock::now();
+    if((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+       (buf.timestamp.tv_sec || buf.timestamp.tv_usec)) {
+      timestamp = std::chrono::steady_clock::time_point(std::chrono::seconds(buf.timestamp.tv_sec) +
+                                                        std::chrono::microseconds(buf.timestamp.tv_usec));
+    }
+
+    return BufferHandle(this, buf.index, buffers[buf.index].subspan(0, used), timestamp, buf.sequence);
   }
 
   ErrorOr<void> stop() {
-    TRY(do_ioctl(fd, VIDIOC_STREAMOFF, V4L2_BUF_TYPE_VIDEO_CAPTURE));
+    TRY(do_ioctl(fd, VIDIOC_STREAMOFF, buf_type));
     return {};
   }
 
   // TODO: cropping? VIDIOC_CROPCAP, VIDIOC_S_CROP
 
   Capture(const Capture& o) = delete;
-  Capture(Capture&& o): path(o.path), fd(std::exchange(o.fd, 0)), fmt(o.fmt), buffers(std::move(o.buffers)) {}
+  Capture(Capture&& o)
+    : path(o.path), fd(std::exchange(o.fd, 0)), buf_type(o.buf_type), fmt(o.fmt), current(o.current),
+      memory(o.memory), buffers(std::move(o.buffers)) {}
   ~Capture() {
     IGNORE(stop());
     close(fd);
   }
 
-  uint32_t get_width() const { return fmt.fmt.pix.width; }
-  uint32_t get_height() const { return fmt.fmt.pix.height; }
+  int get_fd() const override { return fd; }
+  uint32_t get_width() const override { return is_mplane() ? fmt.fmt.pix_mp.width : fmt.fmt.pix.width; }
+  uint32_t get_height() const override { return is_mplane() ? fmt.fmt.pix_mp.height : fmt.fmt.pix.height; }
+  uint32_t get_format() const override { return is_mplane() ? fmt.fmt.pix_mp.pixelformat : fmt.fmt.pix.pixelformat; }
+  uint32_t get_stride() const override {
+    uint32_t bpl = is_mplane() ? fmt.fmt.pix_mp.plane_fmt[0].bytesperline : fmt.fmt.pix.bytesperline;
+    return bpl ? bpl : get_width() * convert::bytes_per_pixel(get_format());
+  }
+  uint32_t get_size_image() const {
+    return is_mplane() ? fmt.fmt.pix_mp.plane_fmt[0].sizeimage : fmt.fmt.pix.sizeimage;
+  }
+  const Mode& get_mode() const override { return current; }
+  bool is_userptr() const { return memory == V4L2_MEMORY_USERPTR; }
+  bool is_mplane() const { return buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE; }
 
 protected:
   Capture() {}
 
   const char* path;
   int fd = 0;
+  v4l2_buf_type buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   v4l2_format fmt = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
-  std::vector<MMapSpan> buffers;
+  Mode current;
+  v4l2_memory memory = V4L2_MEMORY_MMAP;
+  std::vector<BufferSpan> buffers;
+
+  void release(int index) override {
+    IGNORE(queue_buffer(index));
+  }
+
+  // allocate or map count buffers and hand them all to the driver
+  ErrorOr<void> queue_buffers(uint32_t count) {
+    buffers.reserve(count);
+    for(uint32_t i = 0; i < count; i++) {
+      if(memory == V4L2_MEMORY_MMAP) {
+        v4l2_plane plane;
+        auto buf = describe(i, plane);
+
+        TRY(do_ioctl(fd, VIDIOC_QUERYBUF, buf));
+
+        size_t length = is_mplane() ? plane.length : buf.length;
+        off_t offset = is_mplane() ? plane.m.mem_offset : buf.m.offset;
+
+        void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+        if(ptr == MAP_FAILED)
+          return Error(errno, "Failed to mmap buffer");
+
+        buffers.emplace_back(static_cast<std::byte*>(ptr), length, true);
+      } else {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t length = (get_size_image() + page - 1) / page * page;
+
+        void* ptr = aligned_alloc(page, length);
+        if(!ptr)
+          return Error(ENOMEM, "Failed to allocate capture buffer");
+
+        buffers.emplace_back(static_cast<std::byte*>(ptr), length, false);
+      }
+
+      TRY(queue_buffer(i));
+    }
+    return {};
+  }
+
+  // give every buffer back, so the queue can be set up again
+  void free_buffers() {
+    v4l2_requestbuffers req_buf = { .count = 0, .type = buf_type, .memory = memory };
+    IGNORE(do_ioctl(fd, VIDIOC_REQBUFS, req_buf));
+    buffers.clear();
+  }
+
+  ErrorOr<void> request_buffers(uint32_t& count, Memory mem) {
+    v4l2_requestbuffers req_buf = {
+      .count = count,
+      .type = buf_type,
+      .memory = mem == Memory::USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP
+    };
+
+    TRY(do_ioctl(fd, VIDIOC_REQBUFS, req_buf));
+
+    if(req_buf.count < 2)
+      return Error("Not enough buffers provided");
+
+    count = req_buf.count;
+    memory = static_cast<v4l2_memory>(req_buf.memory);
+    return {};
+  }
+
+  // v4l2_buffer for our queue, multi-planar queues get their one plane
+  // described in plane
+  v4l2_buffer describe(uint32_t index, v4l2_plane& plane) const {
+    v4l2_buffer buf = { .index = index, .type = buf_type, .memory = memory };
+    plane = {};
+    if(is_mplane()) {
+      buf.m.planes = &plane;
+      buf.length = 1;
+    }
+    return buf;
+  }
 };
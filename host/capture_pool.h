@@ -0,0 +1,171 @@
+#pragma once
+
+#include "async_capture.h"
+
+#include <common/err.h>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Runs the capture side of many AsyncCaptures on a few shared threads instead
+// of one each. Every device's fd sits in one epoll set in one-shot mode, so a
+// device is only ever drained and hashed by one worker at a time while the
+// others serve the rest. Idle devices cost nothing and the thread count stays
+// fixed however many devices there are.
+struct CapturePool {
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr auto retry_interval = std::chrono::seconds(1);
+
+  static size_t default_threads() {
+    return std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+  }
+
+  explicit CapturePool(size_t thread_count = default_threads()) : thread_count(thread_count) {}
+  CapturePool(const CapturePool&) = delete;
+  ~CapturePool() { stop(); }
+
+  // Add captures before start(), instead of calling their own start(). They
+  // have to outlive the pool.
+  void add(AsyncCapture& cap) {
+    entries.push_back(std::make_unique<Entry>(cap));
+  }
+
+  ErrorOr<void> start() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0) return Error(errno, "Failed to create epoll set");
+
+    // level triggered and never read, so it wakes every worker once set
+    stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(stopfd < 0) return Error(errno, "Failed to create eventfd");
+
+    epoll_event ev = { .events = EPOLLIN, .data = { .ptr = nullptr } };
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, stopfd, &ev) < 0)
+      return Error(errno, "Failed to watch eventfd");
+
+    for(auto& e: entries) {
+      if(e->cap.cap) watch(*e, EPOLL_CTL_ADD);
+      else retry_later(*e);
+    }
+
+    running = true;
+    for(size_t i = 0; i < thread_count; i++)
+      threads.emplace_back([this]() { work(); });
+    return {};
+  }
+
+  void stop() {
+    if(threads.empty()) return;
+
+    running = false;
+    uint64_t one = 1;
+    IGNORE(write(stopfd, &one, sizeof(one)));
+    threads.clear();
+
+    close(stopfd);
+    close(epfd);
+  }
+
+protected:
+  struct Entry {
+    AsyncCapture& cap;
+    my_clock::time_point retry_at;
+
+    Entry(AsyncCapture& cap) : cap(cap) {}
+  };
+
+  size_t thread_count;
+  int epfd = -1;
+  int stopfd = -1;
+  std::atomic<bool> running = false;
+  std::vector<std::unique_ptr<Entry>> entries;
+  std::vector<std::jthread> threads;
+
+  // devices that went away, waiting to be reopened
+  std::mutex mutex;
+  std::vector<Entry*> lost;
+
+  void work() {
+    auto timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(retry_interval).count();
+
+    while(running) {
+      epoll_event ev;
+      int n = epoll_wait(epfd, &ev, 1, timeout_ms);
+      if(n < 0 && errno != EINTR) {
+        fmt::print("In capture pool: {}\n", Error(errno, "epoll_wait failed").what());
+        std::terminate();
+      }
+
+      if(n > 0 && ev.data.ptr)
+        service(*static_cast<Entry*>(ev.data.ptr), ev.events);
+
+      reopen_due();
+    }
+  }
+
+  void service(Entry& e, uint32_t events) {
+    auto err = [&]() -> ErrorOr<void> {
+      if(events & (EPOLLERR | EPOLLHUP))
+        return Error(ENODEV, "Capture device stopped streaming");
+
+      if(TRY(e.cap.read_ready()))
+        e.cap.publish();
+      return {};
+    }();
+
+    if(err.is_error()) {
+      // drop it from the set before the fd is closed under it
+      epoll_ctl(epfd, EPOLL_CTL_DEL, e.cap->get_fd(), nullptr);
+      e.cap.recover(err.error());
+      retry_later(e);
+      return;
+    }
+
+    watch(e, EPOLL_CTL_MOD);
+  }
+
+  // (re)arm the one-shot watch on the device
+  void watch(Entry& e, int op) {
+    epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data = { .ptr = &e } };
+    if(epoll_ctl(epfd, op, e.cap->get_fd(), &ev) < 0) {
+      e.cap.recover(Error(errno, "Failed to watch capture device"));
+      retry_later(e);
+    }
+  }
+
+  void retry_later(Entry& e) {
+    std::lock_guard lock(mutex);
+    e.retry_at = my_clock::now() + retry_interval;
+    lost.push_back(&e);
+  }
+
+  void reopen_due() {
+    Entry* e = nullptr;
+    {
+      std::lock_guard lock(mutex);
+      auto now = my_clock::now();
+      auto it = std::find_if(lost.begin(), lost.end(), [&](Entry* e) { return e->retry_at <= now; });
+      if(it == lost.end()) return;
+
+      e = *it;
+      lost.erase(it);
+    }
+
+    if(auto res = e->cap.init(); res.is_error()) {
+      e->cap.recover(res.error());
+      retry_later(*e);
+      return;
+    }
+    watch(*e, EPOLL_CTL_ADD);
+  }
+};
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "frame.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include <linux/videodev2.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_AVX2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERT_NEON 1
+#endif
+
+// Pixel format conversion for capture formats the renderer can't take as they
+// are. Packed 4:2:2 YUV becomes NV12 (chroma averaged over each pair of rows)
+// and 24 bit RGB becomes XBGR32 (B, G, R, X in memory), both written straight
+// into a locked texture.
+// Every kernel has a scalar reference version; the vector versions produce
+// bit identical output.
+namespace convert {
+
+// bytes per pixel in the first plane
+inline int bytes_per_pixel(uint32_t fourcc) {
+  switch(fourcc) {
+  case V4L2_PIX_FMT_NV12: return 1;
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY: return 2;
+  case V4L2_PIX_FMT_RGB24:
+  case V4L2_PIX_FMT_BGR24: return 3;
+  case V4L2_PIX_FMT_XRGB32:
+  case V4L2_PIX_FMT_XBGR32: return 4;
+  default: return 0;
+  }
+}
+
+// What frames of fourcc are converted to, 0 if they can't be displayed.
+inline uint32_t target(uint32_t fourcc) {
+  switch(fourcc) {
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY: return V4L2_PIX_FMT_NV12;
+  case V4L2_PIX_FMT_RGB24:
+  case V4L2_PIX_FMT_BGR24: return V4L2_PIX_FMT_XBGR32;
+  default: return 0;
+  }
+}
+
+// Relative cost of getting a frame on screen, lower is better, -1 if the
+// format isn't supported at all (compressed formats, for now).
+inline int cost(uint32_t fourcc) {
+  switch(fourcc) {
+  case V4L2_PIX_FMT_NV12: return 0;
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY: return 1;
+  case V4L2_PIX_FMT_RGB24:
+  case V4L2_PIX_FMT_BGR24: return 2;
+  default: return -1;
+  }
+}
+
+// Two rows of packed 4:2:2 to two rows of luma and one of interleaved chroma.
+using PackedRows = void(*)(const uint8_t* r0, const uint8_t* r1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width);
+// One row of 24 bit RGB to XBGR32.
+using RgbRow = void(*)(const uint8_t* src, uint8_t* dst, int width);
+
+struct Kernels {
+  const char* name;
+  PackedRows yuyv;
+  PackedRows uyvy;
+  RgbRow rgb24;
+  RgbRow bgr24;
+};
+
+namespace scalar {
+
+// UYVY has luma in the odd bytes, YUYV in the even ones
+template <bool uyvy>
+void packed_rows(const uint8_t* r0, const uint8_t* r1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width, int x = 0) {
+  constexpr int Y = uyvy, C = !uyvy;
+
+  for(; x + 1 < width; x += 2) {
+    const uint8_t* a = r0 + x * 2;
+    const uint8_t* b = r1 + x * 2;
+
+    y0[x] = a[Y];
+    y0[x + 1] = a[Y + 2];
+    y1[x] = b[Y];
+    y1[x + 1] = b[Y + 2];
+    uv[x] = (a[C] + b[C] + 1) >> 1;
+    uv[x + 1] = (a[C + 2] + b[C + 2] + 1) >> 1;
+  }
+
+  // an odd last column, e.g. a clipped frame, still has its whole macropixel
+  if(x < width) {
+    const uint8_t* a = r0 + x * 2;
+    const uint8_t* b = r1 + x * 2;
+
+    y0[x] = a[Y];
+    y1[x] = b[Y];
+    uv[x] = (a[C] + b[C] + 1) >> 1;
+    uv[x + 1] = (a[C + 2] + b[C + 2] + 1) >> 1;
+  }
+}
+
+template <bool bgr>
+void rgb_row(const uint8_t* src, uint8_t* dst, int width, int x = 0) {
+  for(; x < width; x++) {
+    const uint8_t* p = src + x * 3;
+    dst[x * 4 + 0] = p[bgr ? 0 : 2];
+    dst[x * 4 + 1] = p[1];
+    dst[x * 4 + 2] = p[bgr ? 2 : 0];
+    dst[x * 4 + 3] = 0xff;
+  }
+}
+
+inline const Kernels kernels = {
+  "scalar",
+  [](auto... a) { packed_rows<false>(a...); },
+  [](auto... a) { packed_rows<true>(a...); },
+  [](auto... a) { rgb_row<false>(a...); },
+  [](auto... a) { rgb_row<true>(a...); },
+};
+
+}
+
+#ifdef CONVERT_AVX2
+namespace avx2 {
+
+// Split 32 pixels into luma and chroma bytes. packus works per 128 bit lane,
+// so the quadwords need putting back in order afterwards.
+template <bool uyvy>
+__attribute__((target("avx2")))
+inline void split(const uint8_t* src, __m256i& y, __m256i& c) {
+  const __m256i low = _mm256_set1_epi16(0x00ff);
+
+  __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+  __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+  __m256i lo = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+  __m256i hi = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+  y = _mm256_permute4x64_epi64(uyvy ? hi : lo, 0xd8);
+  c = _mm256_permute4x64_epi64(uyvy ? lo : hi, 0xd8);
+}
+
+template <bool uyvy>
+__attribute__((target("avx2")))
+void packed_rows(const uint8_t* r0, const uint8_t* r1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width) {
+  int x = 0;
+  for(; x + 32 <= width; x += 32) {
+    __m256i ya, ca, yb, cb;
+    split<uyvy>(r0 + x * 2, ya, ca);
+    split<uyvy>(r1 + x * 2, yb, cb);
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(y0 + x), ya);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(y1 + x), yb);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(uv + x), _mm256_avg_epu8(ca, cb));
+  }
+
+  scalar::packed_rows<uyvy>(r0, r1, y0, y1, uv, width, x);
+}
+
+template <bool bgr>
+__attribute__((target("avx2")))
+void rgb_row(const uint8_t* src, uint8_t* dst, int width) {
+  // four pixels per 128 bit lane, the fourth byte of each comes out zero
+  constexpr char z = char(0x80);
+  const __m256i shuffle = bgr
+    ? _mm256_setr_epi8(0, 1, 2, z, 3, 4, 5, z, 6, 7, 8, z, 9, 10, 11, z,
+                       0, 1, 2, z, 3, 4, 5, z, 6, 7, 8, z, 9, 10, 11, z)
+    : _mm256_setr_epi8(2, 1, 0, z, 5, 4, 3, z, 8, 7, 6, z, 11, 10, 9, z,
+                       2, 1, 0, z, 5, 4, 3, z, 8, 7, 6, z, 11, 10, 9, z);
+  const __m256i alpha = _mm256_set1_epi32(int(0xff000000));
+
+  // each 16 byte load covers four pixels plus four bytes we don't use, so
+  // stop early enough not to read past the end of the row
+  int x = 0;
+  for(; x + 10 <= width; x += 8) {
+    const uint8_t* p = src + x * 3;
+    __m256i v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+
+    v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4), v);
+  }
+
+  scalar::rgb_row<bgr>(src, dst, width, x);
+}
+
+inline const Kernels kernels = {
+  "avx2",
+  packed_rows<false>,
+  packed_rows<true>,
+  rgb_row<false>,
+  rgb_row<true>,
+};
+
+}
+#endif
+
+#ifdef CONVERT_NEON
+namespace neon {
+
+template <bool uyvy>
+void packed_rows(const uint8_t* r0, const uint8_t* r1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width) {
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    uint8x16x2_t a = vld2q_u8(r0 + x * 2);
+    uint8x16x2_t b = vld2q_u8(r1 + x * 2);
+
+    vst1q_u8(y0 + x, a.val[uyvy]);
+    vst1q_u8(y1 + x, b.val[uyvy]);
+    vst1q_u8(uv + x, vrhaddq_u8(a.val[!uyvy], b.val[!uyvy]));
+  }
+
+  scalar::packed_rows<uyvy>(r0, r1, y0, y1, uv, width, x);
+}
+
+template <bool bgr>
+void rgb_row(const uint8_t* src, uint8_t* dst, int width) {
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    uint8x16x3_t p = vld3q_u8(src + x * 3);
+    uint8x16x4_t out = {{ p.val[bgr ? 0 : 2], p.val[1], p.val[bgr ? 2 : 0], vdupq_n_u8(0xff) }};
+    vst4q_u8(dst + x * 4, out);
+  }
+
+  scalar::rgb_row<bgr>(src, dst, width, x);
+}
+
+inline const Kernels kernels = {
+  "neon",
+  packed_rows<false>,
+  packed_rows<true>,
+  rgb_row<false>,
+  rgb_row<true>,
+};
+
+}
+#endif
+
+// fastest kernels this CPU supports
+inline const Kernels& best() {
+#if defined(CONVERT_AVX2)
+  static const Kernels& ret = __builtin_cpu_supports("avx2") ? avx2::kernels : scalar::kernels;
+  return ret;
+#elif defined(CONVERT_NEON)
+  return neon::kernels;
+#else
+  return scalar::kernels;
+#endif
+}
+
+// Convert src into dst laid out as dst_format (as returned by target()) with
+// rows pitch bytes apart. NV12 chroma starts right after dst_height luma rows,
+// the height of the buffer, which src may be clipped to less than.
+inline bool convert(const FrameView& src, uint32_t dst_format, std::byte* dst, int pitch, int dst_height,
+                    const Kernels& k = best()) {
+  auto row = [&](int y) { return reinterpret_cast<const uint8_t*>(src.planes[0].data) + size_t(src.planes[0].stride) * y; };
+  auto out = [&](int y) { return reinterpret_cast<uint8_t*>(dst) + size_t(pitch) * y; };
+
+  int w = src.width, h = src.height;
+
+  if(dst_format == V4L2_PIX_FMT_NV12 && (src.format == V4L2_PIX_FMT_YUYV || src.format == V4L2_PIX_FMT_UYVY)) {
+    auto f = src.format == V4L2_PIX_FMT_YUYV ? k.yuyv : k.uyvy;
+
+    // an odd last row pairs up with itself
+    for(int y = 0; y < h; y += 2) {
+      int y1 = std::min(y + 1, h - 1);
+      f(row(y), row(y1), out(y), out(y1), out(dst_height + y / 2), w);
+    }
+    return true;
+  }
+
+  if(dst_format == V4L2_PIX_FMT_XBGR32 && (src.format == V4L2_PIX_FMT_RGB24 || src.format == V4L2_PIX_FMT_BGR24)) {
+    auto f = src.format == V4L2_PIX_FMT_RGB24 ? k.rgb24 : k.bgr24;
+
+    for(int y = 0; y < h; y++)
+      f(row(y), out(y), w);
+    return true;
+  }
+
+  return false;
+}
+
+}
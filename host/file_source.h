@@ -0,0 +1,261 @@
+#pragma once
+
+#include "capture.h"
+#include "tile_codec.h"
+
+#include <common/err.h>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// Replays a raw recording (harness --record-raw) as if it came from a capture
+// card, so the viewer can be load tested and profiled without the card or
+// the source. The file is mapped once and frames are handed out straight from
+// the mapping. Like a V4L2 queue, at most buffer_count frames are out at a
+// time; a frame that comes due while they all are is skipped. get_fd() is a
+// timerfd armed for the next frame, so a replay runs on AsyncCapture's own
+// thread or in a CapturePool like any device. The recording loops.
+struct FileSource: CaptureSource {
+  using my_clock = std::chrono::steady_clock;
+
+  // frames in flight are tracked in a bitmask
+  static constexpr uint32_t max_buffers = 32;
+
+  // Regular files are recordings, devices are character special files.
+  static bool is_recording(const char* path) {
+    struct stat st;
+    return ::stat(path, &st) == 0 && S_ISREG(st.st_mode);
+  }
+
+  static ErrorOr<std::unique_ptr<FileSource>> open(const char* path, const Request& request, uint32_t buffer_count) {
+    std::unique_ptr<FileSource> ret(new FileSource());
+    ret->pace = request.pace;
+    ret->buffer_count = std::clamp<uint32_t>(buffer_count, 1, max_buffers);
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return Error::format(errno, "Failed to open {}", path);
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+      close(fd);
+      return Error::format(errno, "Failed to stat {}", path);
+    }
+
+    // private and writable, so a consumer scribbling on a frame never
+    // reaches the file
+    void* p = st.st_size ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(p == MAP_FAILED) return Error::format(errno, "Failed to map {}", path);
+
+    ret->map = { static_cast<std::byte*>(p), size_t(st.st_size) };
+    TRY(ret->index(path));
+
+    // a timerfd is CLOCK_MONOTONIC, like steady_clock
+    ret->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(ret->timer < 0) return Error(errno, "Failed to create timerfd");
+
+    // the average frame interval of the recording, or what was asked for
+    auto& f = ret->frames;
+    int64_t gaps = f.size() - 1;
+    if(request.pace == Request::Pace::FIXED && request.fps) {
+      ret->interval = std::chrono::duration_cast<my_clock::duration>(std::chrono::seconds(1)) / request.fps;
+      ret->mode.interval = { 1, request.fps };
+    } else if(gaps && f.back().time > f.front().time) {
+      ret->interval = (f.back().time - f.front().time) / gaps;
+      if(request.pace == Request::Pace::RECORDED)
+        ret->mode.interval = { uint32_t(std::chrono::nanoseconds(ret->interval).count()), 1'000'000'000 };
+    } else {
+      ret->interval = std::chrono::milliseconds(16);
+    }
+
+    ret->base = my_clock::now();
+    ret->arm(ret->base);
+    return ret;
+  }
+
+  FileSource(const FileSource&) = delete;
+
+  ~FileSource() {
+    if(timer >= 0) close(timer);
+    if(map.data()) munmap(map.data(), map.size());
+  }
+
+  ErrorOr<std::optional<BufferHandle>> read_frame() override {
+    uint64_t expirations;
+    if(::read(timer, &expirations, sizeof(expirations)) < 0) {
+      if(errno == EAGAIN || errno == EINTR) return std::nullopt;
+      return Error(errno, "Failed to read timerfd");
+    }
+
+    // as fast as possible: one frame per wakeup, the next once a buffer
+    // comes back
+    if(pace == Request::Pace::FAST) {
+      int slot = take_slot();
+      if(slot < 0) return std::nullopt;
+
+      auto p = advance();
+      p.due = my_clock::now();
+      return handle(slot, p);
+    }
+
+    // the newest frame that's due, anything older is skipped
+    auto now = my_clock::now();
+    std::optional<Pick> due;
+    while(due_time(next) <= now) {
+      if(due) skipped++;
+      due = advance();
+    }
+    arm(due_time(next));
+
+    if(!due) return std::nullopt;
+
+    int slot = take_slot();
+    if(slot < 0) {
+      skipped++;
+      return std::nullopt;
+    }
+    return handle(slot, *due);
+  }
+
+  int get_fd() const override { return timer; }
+  uint32_t get_width() const override { return mode.width; }
+  uint32_t get_height() const override { return mode.height; }
+  uint32_t get_format() const override { return mode.fourcc; }
+  uint32_t get_stride() const override { return stride; }
+  const Mode& get_mode() const override { return mode; }
+
+  // frames that came due while every buffer was out, or were overtaken
+  uint64_t get_skipped() const { return skipped; }
+
+protected:
+  struct Entry {
+    my_clock::duration time; // since the start of the recording
+    std::span<std::byte> data;
+  };
+
+  std::span<std::byte> map;
+  std::vector<Entry> frames;
+  Mode mode;
+  uint32_t stride = 0;
+
+  Request::Pace pace = Request::Pace::RECORDED;
+  uint32_t buffer_count = 4;
+  my_clock::duration interval {};
+
+  int timer = -1;
+  my_clock::time_point base; // when frame 0 of the current loop is due
+  size_t next = 0;
+  uint64_t skipped = 0;
+  uint32_t sequence = 0; // frames moved past, skipped ones included
+  std::atomic<uint32_t> in_flight = 0;
+
+  // a frame moved past, when it was due and its number
+  struct Pick {
+    size_t index;
+    my_clock::time_point due;
+    uint32_t sequence;
+  };
+
+  FileSource() {}
+
+  // Find every raw frame. Frames in a format other than the first one's are
+  // left out, a source has one format.
+  ErrorOr<void> index(const char* path) {
+    std::optional<codec::Format> format;
+    bool first = true;
+
+    for(size_t pos = 0; pos + sizeof(codec::ChunkHeader) <= map.size();) {
+      codec::ChunkHeader h;
+      std::memcpy(&h, map.data() + pos, sizeof(h));
+      pos += sizeof(h);
+      if(h.type == codec::TRAILER || pos + h.size > map.size()) break;
+
+      if(h.type == codec::FORMAT && h.size >= sizeof(codec::Format)) {
+        codec::Format f;
+        std::memcpy(&f, map.data() + pos, sizeof(f));
+        format = f;
+      } else if(h.type == codec::RAW_FRAME && format && h.size >= sizeof(codec::RawFrameHeader)) {
+        codec::RawFrameHeader rh;
+        std::memcpy(&rh, map.data() + pos, sizeof(rh));
+
+        size_t size = codec::raw_size(format->fourcc, format->height, rh.stride);
+        if(first) {
+          mode = { format->fourcc, format->width, format->height };
+          stride = rh.stride;
+          first = false;
+        }
+
+        bool same = format->fourcc == mode.fourcc && format->width == mode.width &&
+                    format->height == mode.height && rh.stride == stride;
+        if(same && sizeof(rh) + size <= h.size)
+          frames.push_back({ std::chrono::nanoseconds(h.time), map.subspan(pos + sizeof(rh), size) });
+      }
+
+      pos += h.size;
+    }
+
+    if(frames.empty())
+      return Error::format("No raw frames in {}, record with --record-raw", path);
+    if(convert::cost(mode.fourcc) < 0)
+      return Error::format("Recorded format {} is not supported", fourcc_str(mode.fourcc));
+    return {};
+  }
+
+  my_clock::time_point due_time(size_t i) const {
+    if(pace == Request::Pace::RECORDED) return base + (frames[i].time - frames[0].time);
+    return base + interval * i;
+  }
+
+  // Move on to the next frame, starting the next loop a frame after the end
+  // of this one.
+  Pick advance() {
+    Pick ret = { next, due_time(next), sequence++ };
+    if(++next == frames.size()) {
+      base = ret.due + interval;
+      next = 0;
+    }
+    return ret;
+  }
+
+  int take_slot() {
+    uint32_t used = in_flight.load(std::memory_order_acquire);
+    while(true) {
+      int slot = std::countr_one(used);
+      if(slot >= int(buffer_count)) return -1;
+      if(in_flight.compare_exchange_weak(used, used | 1u << slot, std::memory_order_acq_rel)) return slot;
+    }
+  }
+
+  BufferHandle handle(int slot, const Pick& p) {
+    return BufferHandle(this, slot, frames[p.index].data, p.due, p.sequence);
+  }
+
+  void arm(my_clock::time_point when) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    itimerspec spec {};
+    spec.it_value = { time_t(ns / 1'000'000'000), long(ns % 1'000'000'000) };
+
+    // zero would disarm it, anything in the past fires right away
+    if(spec.it_value.tv_sec <= 0 && spec.it_value.tv_nsec <= 0) spec.it_value.tv_nsec = 1;
+    timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+  }
+
+  // Called from whichever thread lets go of the frame last.
+  void release(int slot) override {
+    in_flight.fetch_and(~(1u << slot), std::memory_order_acq_rel);
+    if(pace == Request::Pace::FAST) arm(my_clock::now());
+  }
+};
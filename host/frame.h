@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include <linux/videodev2.h>
+
+// Non-owning description of a captured image, enough to upload it without
+// assuming the driver's stride matches anybody else's.
+struct FrameView {
+  struct Plane {
+    const std::byte* data = nullptr;
+    int stride = 0;
+  };
+
+  uint32_t format = 0; // V4L2 fourcc
+  int width = 0;
+  int height = 0;
+  std::array<Plane, 2> planes {};
+
+  // NV12 in a single buffer, chroma plane directly after luma
+  static FrameView nv12(std::span<const std::byte> data, int width, int height, int stride) {
+    FrameView ret { .format = V4L2_PIX_FMT_NV12, .width = width, .height = height };
+    ret.planes[0] = { data.data(), stride };
+    ret.planes[1] = { data.data() + size_t(stride) * height, stride };
+    return ret;
+  }
+
+  // single plane packed formats (YUYV, RGB24, ...)
+  static FrameView packed(uint32_t format, std::span<const std::byte> data, int width, int height, int stride) {
+    FrameView ret { .format = format, .width = width, .height = height };
+    ret.planes[0] = { data.data(), stride };
+    return ret;
+  }
+};
+
+struct Rect {
+  int x = 0;
+  int y = 0;
+  int w = 0;
+  int h = 0;
+};
+
+inline std::string fourcc_str(uint32_t fourcc) {
+  return { char(fourcc), char(fourcc >> 8), char(fourcc >> 16), char(fourcc >> 24) };
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "window.h"
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Text drawn over the video, e.g. the pipeline metrics. SDL has no text of its
+// own, so lines are drawn from a built in 5x7 font as runs of filled rects,
+// upper case only. The rects are only rebuilt when the text changes.
+struct Hud {
+  static constexpr int scale = 2;
+  static constexpr int glyph_w = 5, glyph_h = 7;
+  static constexpr int advance = (glyph_w + 1) * scale;
+  static constexpr int line_h = (glyph_h + 3) * scale;
+  static constexpr int margin = 4 * scale;
+
+  bool visible = false;
+
+  void set_lines(std::vector<std::string> lines) {
+    if(lines == text) return;
+    text = std::move(lines);
+    layout();
+  }
+
+  void draw(Window& win) const {
+    if(!visible || text.empty()) return;
+    win.fill_rects(std::span(&background, 1), { 0, 0, 0, 160 });
+    win.fill_rects(pixels, { 255, 255, 255, 255 });
+  }
+
+protected:
+  static constexpr std::string_view charset = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:/%-()";
+
+  // one byte per row, the low five bits are the pixels left to right
+  static constexpr std::array<std::array<uint8_t, glyph_h>, charset.size()> font = {{
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // space
+    { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E }, // 0
+    { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E },
+    { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F },
+    { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E },
+    { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 },
+    { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E },
+    { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E },
+    { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+    { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E },
+    { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C }, // 9
+    { 0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11 }, // A
+    { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E },
+    { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E },
+    { 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C },
+    { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F },
+    { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 },
+    { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F },
+    { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },
+    { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E },
+    { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C },
+    { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F },
+    { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 },
+    { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },
+    { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },
+    { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 },
+    { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D },
+    { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 },
+    { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E },
+    { 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 },
+    { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A },
+    { 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 },
+    { 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 },
+    { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F }, // Z
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C }, // .
+    { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 }, // :
+    { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, // /
+    { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, // %
+    { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 }, // -
+    { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, // (
+    { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, // )
+  }};
+
+  std::vector<std::string> text;
+  std::vector<SDL_Rect> pixels;
+  SDL_Rect background {};
+
+  // Every horizontal run of lit pixels becomes one rect.
+  void layout() {
+    pixels.clear();
+    size_t longest = 0;
+
+    for(size_t line = 0; line < text.size(); line++) {
+      longest = std::max(longest, text[line].size());
+
+      for(size_t col = 0; col < text[line].size(); col++) {
+        auto i = charset.find(char(std::toupper(uint8_t(text[line][col]))));
+        if(i == charset.npos || i == 0) continue;
+
+        int x0 = margin + int(col) * advance, y0 = margin + int(line) * line_h;
+        for(int row = 0; row < glyph_h; row++) {
+          uint8_t bits = font[i][row];
+          for(int x = 0; x < glyph_w;) {
+            if(!(bits & (0x10 >> x))) {
+              x++;
+              continue;
+            }
+
+            int start = x;
+            while(x < glyph_w && bits & (0x10 >> x)) x++;
+            pixels.push_back({ x0 + start * scale, y0 + row * scale, (x - start) * scale, scale });
+          }
+        }
+      }
+    }
+
+    background = { 0, 0, 2 * margin + int(longest) * advance, 2 * margin + int(text.size()) * line_h - 3 * scale };
+  }
+};
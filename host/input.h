@@ -0,0 +1,62 @@
+#pragma once
+
+#include "keys.h"
+
+#include <SDL2/SDL.h>
+
+#include <functional>
+
+// The input fast path. SDL calls an event watch as each event is queued, from
+// SDL_PumpEvents on the main thread, instead of once the loop gets round to
+// draining the queue after its upload, render and present. Key and button
+// edges go to the link from the watch right away, motion is only taken in:
+// the loop's keys.dump() still sends it on the coalescing window. The loop
+// pumps between the slow parts of a frame, so an edge waits for at most one
+// of them instead of all.
+struct InputWatch {
+  InputWatch(keys::KeyState& keys) : keys(keys) { SDL_AddEventWatch(&on_event, this); }
+  InputWatch(const InputWatch&) = delete;
+  ~InputWatch() { SDL_DelEventWatch(&on_event, this); }
+
+  // Whether an event is input for the target, e.g. not while the overview is
+  // up or for the loop's own hotkeys. Everything is if unset.
+  std::function<bool(const SDL_Event&)> accept;
+
+  // sends what's ready without waiting, typically keys.try_dump(writer)
+  std::function<void()> send;
+
+  // what absolute motion is scaled against, the video's size on screen
+  void resize(int w, int h) {
+    width = w;
+    height = h;
+  }
+
+protected:
+  keys::KeyState& keys;
+  int width = 1, height = 1;
+
+  static bool is_input(const SDL_Event& e) {
+    switch(e.type) {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+    case SDL_MOUSEMOTION:
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+    case SDL_MOUSEWHEEL:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Also called for SDL_PushEvent from other threads, e.g. the capture's
+  // frame events, but input only ever comes from the main thread's pump.
+  static int SDLCALL on_event(void* self, SDL_Event* e) {
+    auto& w = *static_cast<InputWatch*>(self);
+    if(!is_input(*e) || (w.accept && !w.accept(*e))) return 0;
+
+    w.keys.consume_event(*e, w.width, w.height);
+    if(w.send && (w.keys.keyboard_ready() || w.keys.have_mouse_button)) w.send();
+    return 0;
+  }
+};
@@ -5,9 +5,12 @@
 #include <SDL2/SDL.h>
 #include <asio.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <bitset>
-#include <set>
 #include <chrono>
+#include <functional>
+#include <span>
 
 namespace keys {
   struct kbd_button {
@@ -39,18 +42,14 @@ namespace keys {
 
   struct KeyState {
     using my_clock = std::chrono::high_resolution_clock;
-    static constexpr my_clock::duration frame_time = std::chrono::milliseconds(8);
+    // bounds of the mouse coalescing window, and where it starts until the
+    // pi has measured the target's poll interval
+    static constexpr my_clock::duration min_mouse_interval = std::chrono::milliseconds(1);
+    static constexpr my_clock::duration max_mouse_interval = std::chrono::milliseconds(16);
+    static constexpr my_clock::duration default_mouse_interval = std::chrono::milliseconds(8);
 
-    enum : int {
-      LCTRL = 0,
-      LSHIFT,
-      LALT,
-      LGUI,
-      RCTRL,
-      RSHIFT,
-      RALT,
-      RGUI,
-    };
+    // SDL scancodes are USB keyboard usages, the last one being right gui
+    static constexpr int max_usage = SDL_SCANCODE_RGUI;
 
     enum : int {
       MLEFT = 0,
@@ -58,39 +57,56 @@ namespace keys {
       MMIDDLE,
     };
 
-    std::bitset<8> mod {};
-    std::set<SDL_Scancode> keys;
+    // pressed keys by usage, modifiers included
+    std::bitset<256> keys {};
 
     struct MouseState {
-      int x = 0;
+      int x = 0;  // absolute, 0..32767
       int y = 0;
+      int dx = 0; // relative motion and scrolling not sent yet
+      int dy = 0;
       int sx = 0;
       int sy = 0;
       std::bitset<8> buttons {};
     } mouse;
 
+    // send motion as deltas instead of positions, for targets that want a
+    // real mouse (games, pointer acceleration)
+    bool relative = false;
+
+    // how often the target takes a mouse report, as measured by the pi (us)
+    std::atomic<uint32_t> mouse_drain = 0;
+
+    // bytes per second the link carries, to keep motion from queueing in it
+    uint32_t link_rate = 115200 / 10;
+
+    FrameWriter frame;
+
+    // prefix each batch with a send time so the pi echoes it back
+    bool stamp = false;
+
+    // send the whole key bitmap to the pi's NKRO keyboard instead of boot
+    // reports, needs CAP_NKRO
+    bool nkro = false;
+
+    // sees every frame written to the pi, e.g. to record it
+    std::function<void(std::span<const uint8_t>)> on_send;
+
     bool have_keyboard = 0;
     bool have_mouse_button = 0;
     bool have_mouse_motion = 0;
 
+    // what the frame being built carries, put back as pending if the stream
+    // won't take it
+    bool unsent_keyboard = false;
+    bool unsent_mouse_button = false;
+
     my_clock::time_point last_mouse;
+    size_t last_frame_bytes = 0;
 
     void consume(SDL_Scancode code, bool press) {
-      switch(code) {
-        case SDL_SCANCODE_LCTRL: mod[LCTRL] = press; break;
-        case SDL_SCANCODE_LSHIFT: mod[LSHIFT] = press; break;
-        case SDL_SCANCODE_LALT: mod[LALT] = press; break;
-        case SDL_SCANCODE_LGUI: mod[LGUI] = press; break;
-        case SDL_SCANCODE_RCTRL: mod[RCTRL] = press; break;
-        case SDL_SCANCODE_RSHIFT: mod[RSHIFT] = press; break;
-        case SDL_SCANCODE_RALT: mod[LGUI] = press; break;
-        case SDL_SCANCODE_RGUI: mod[RGUI] = press; break;
-
-        default:
-          if(press) keys.insert(code);
-          else keys.erase(code);
-      }
-
+      if(code < 0 || code > max_usage) return;
+      keys[code] = press;
       have_keyboard = true;
     }
 
@@ -111,6 +127,12 @@ namespace keys {
       have_mouse_button = true;
     }
 
+    void consume_mouse_relative(int dx, int dy) {
+      mouse.dx += dx;
+      mouse.dy += dy;
+      have_mouse_motion = true;
+    }
+
     void consume_mouse_wheel(int sx, int sy) {
       mouse.sx += sx;
       mouse.sy += sy;
@@ -118,8 +140,7 @@ namespace keys {
     }
 
     KeyState& reset(auto& stream) {
-      keys.clear();
-      mod = {};
+      keys.reset();
       mouse = {};
 
       dump(stream, true);
@@ -127,46 +148,56 @@ namespace keys {
       return *this;
     }
 
-    keyboard_t get_keyboard_buffer() {
-      keyboard_t ret;
-      ret[0] = mod.to_ulong();
-      ret[1] = 0;
-
-      if(keys.size() > 6) {
-        // phantom condition, idk if this is needed
-        for(int i = 2; i < 8; i++)
-          ret[i] = 1;
-      } else {
-        int idx = 2;
-        for(auto& sm: keys)
-          ret[idx++] = sm;
-        for(; idx < 6; idx++)
-          ret[idx] = 0;
-      }
+    keyboard_nkro_t get_nkro_buffer() {
+      keyboard_nkro_t ret {};
+      for(int usage = 0; usage <= max_usage; usage++)
+        if(keys[usage]) ret[usage / 8] |= 1 << usage % 8;
 
       have_keyboard = false;
       return ret;
     }
 
-    mouse_t get_mouse_buffer() {
-      mouse_t ret;
-
-      // FIXME: this potentially clips off some of dx, dy, or sy but resets to zero anyways
-      // should probably just split it into multiple commands
-      ret[0] = mouse.buttons.to_ulong();
-      *reinterpret_cast<int16_t*>(&ret[1]) = (int16_t)mouse.x;
-      *reinterpret_cast<int16_t*>(&ret[3]) = (int16_t)mouse.y;
-      ret[5] = (char)mouse.sy;
+    keyboard_t get_keyboard_buffer() {
+      return boot_report(get_nkro_buffer());
+    }
 
-      // FIXME: no horizontal scroll for now
-      // ret[6] = (char)mouse.sx;
+    // One report's worth of mouse state. Motion and scrolling that don't fit
+    // are left for the next one, see mouse_backlog().
+    mouse_t get_mouse_buffer() {
+      auto take = [](int& v, int limit) {
+        int ret = std::clamp(v, -limit, limit);
+        v -= ret;
+        return ret;
+      };
+
+      mouse_fields f {
+        .id = relative ? MOUSE_RELATIVE : MOUSE_ABSOLUTE,
+        .buttons = uint8_t(mouse.buttons.to_ulong()),
+        .x = int16_t(relative ? take(mouse.dx, 32767) : mouse.x),
+        .y = int16_t(relative ? take(mouse.dy, 32767) : mouse.y),
+        .wheel = int8_t(take(mouse.sy, 127)),
+        .pan = int8_t(take(mouse.sx, 127)),
+      };
+
+      have_mouse_button = false;
+      have_mouse_motion = mouse_backlog();
+      last_mouse = my_clock::now();
 
-      mouse.sx = mouse.sy = 0;
+      return pack_mouse(f);
+    }
 
-      have_mouse_button = have_mouse_motion = false;
-      last_mouse = my_clock::now();
+    bool mouse_backlog() const {
+      return mouse.dx || mouse.dy || mouse.sx || mouse.sy;
+    }
 
-      return ret;
+    // Coalescing window for mouse motion: as often as the target polls, since
+    // anything faster only gets merged on the pi, but no more often than the
+    // link can carry the frames.
+    my_clock::duration mouse_interval() const {
+      auto drain = mouse_drain ? my_clock::duration(std::chrono::microseconds(mouse_drain.load()))
+                               : default_mouse_interval;
+      auto link = my_clock::duration(std::chrono::microseconds(last_frame_bytes * 1'000'000 / link_rate));
+      return std::clamp(std::max(drain, link), min_mouse_interval, max_mouse_interval);
     }
 
     bool keyboard_ready() {
@@ -174,7 +205,17 @@ namespace keys {
     }
 
     bool mouse_ready() {
-      return have_mouse_button || (have_mouse_motion && my_clock::now() - last_mouse > frame_time);
+      return have_mouse_button || (have_mouse_motion && my_clock::now() - last_mouse >= mouse_interval());
+    }
+
+    // How long the event loop may sleep before coalesced mouse motion is due
+    int timeout_ms(int idle_ms = 1000) {
+      // edges the link didn't take are retried right away
+      if(have_keyboard || have_mouse_button) return 1;
+      if(!have_mouse_motion) return idle_ms;
+
+      auto left = mouse_interval() - (my_clock::now() - last_mouse);
+      return std::max<int>(0, std::chrono::ceil<std::chrono::milliseconds>(left).count());
     }
 
     void consume_event(const SDL_Event& event, int w, int h) {
@@ -183,7 +224,8 @@ namespace keys {
       }
 
       if(event.type == SDL_MOUSEMOTION) {
-        consume_mouse_motion(event.motion.x, event.motion.y, w, h);
+        if(relative) consume_mouse_relative(event.motion.xrel, event.motion.yrel);
+        else consume_mouse_motion(event.motion.x, event.motion.y, w, h);
       }
 
       else if(event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP) {
@@ -195,27 +237,77 @@ namespace keys {
       }
     }
 
-    void dump(auto& stream, bool force = false) {
-      int wrote = 0;
-
-      if(force || keyboard_ready()) {
-        auto buf = get_keyboard_buffer();
+    // Batch whatever is pending into one frame. Key and button changes a
+    // stream gives up on stay pending for the next dump, motion is shed.
+    void dump(auto& stream, bool force = false) { batch(stream, force, true); }
+
+    // For the event watch, on the main thread: never waits for room in the
+    // stream, what doesn't fit is left for the loop's next dump().
+    void try_dump(auto& stream) { batch(stream, false, false); }
+  protected:
+    void batch(auto& stream, bool force, bool wait) {
+      // while the link is behind, motion keeps merging here instead of
+      // queueing behind it, button changes go regardless
+      bool send_keyboard = force || keyboard_ready();
+      bool send_mouse = force || have_mouse_button || (mouse_ready() && !saturated(stream));
+
+      if(stamp && (send_keyboard || send_mouse))
+        frame.add(stamp_t{ stamp_now() });
+
+      if(send_keyboard) {
+        unsent_keyboard = true;
+        if(nkro) frame.add(get_nkro_buffer());
+        else frame.add(get_keyboard_buffer());
+      }
 
-        write_trivial<int>(stream, CMD_KEYBOARD);
-        write_trivial(stream, buf);
-        wrote++;
+      // a fast flick can be more than one report holds, the rest goes out
+      // right behind it rather than a window later
+      if(send_mouse) {
+        unsent_mouse_button = unsent_mouse_button || have_mouse_button || force;
+        add(stream, get_mouse_buffer(), wait);
+        while(mouse_backlog())
+          add(stream, get_mouse_buffer(), wait);
       }
 
-      if(force || mouse_ready()) {
-        auto buf = get_mouse_buffer();
+      if(!frame.empty()) send(stream, wait);
+    }
+
+    static bool saturated(const auto& stream) {
+      if constexpr(requires { stream.saturated(); }) return stream.saturated();
+      else return false;
+    }
+
+    void add(auto& stream, const auto& record, bool wait) {
+      if(frame.add(record)) return;
+      send(stream, wait);
+      frame.add(record);
+    }
+
+    void send(auto& stream, bool wait) {
+      auto bytes = frame.finish();
+      bool sent = write(stream, bytes, wait);
+      stream.flush();
 
-        write_trivial<int>(stream, CMD_MOUSE);
-        write_trivial(stream, buf);
-        wrote++;
+      if(sent) {
+        last_frame_bytes = bytes.size();
+        if(on_send) on_send(bytes);
+      } else {
+        // the state goes out whole with the next dump instead
+        have_keyboard = have_keyboard || unsent_keyboard;
+        have_mouse_button = have_mouse_button || unsent_mouse_button;
       }
+      unsent_keyboard = unsent_mouse_button = false;
+    }
 
-      if(wrote)
-        stream.flush();
+    // Streams that can give a frame up (LinkWriter) say so.
+    static bool write(auto& stream, std::span<const uint8_t> bytes, bool wait) {
+      auto s = reinterpret_cast<const char*>(bytes.data());
+      if constexpr(requires { stream.try_write(s, bytes.size()); })
+        return wait ? stream.write(s, bytes.size()) : stream.try_write(s, bytes.size());
+      else {
+        stream.write(s, bytes.size());
+        return true;
+      }
     }
   };
 }
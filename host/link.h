@@ -0,0 +1,380 @@
+#pragma once
+
+#include "metrics.h"
+#include "telemetry.h"
+
+#include <common/err.h>
+#include <common/msg.h>
+#include <common/stream_buffer.h>
+#include <common/transport.h>
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+static constexpr uint32_t host_caps = CAP_TELEMETRY | CAP_MACRO | CAP_NKRO;
+
+// Exchange versions and capabilities with the pi. If it doesn't answer in time
+// we carry on assuming the baseline protocol.
+inline ErrorOr<hello_t> handshake(asio::io_service& service, Transport& stream, FrameWriter& frame,
+                                  std::chrono::steady_clock::duration timeout) {
+  frame.add(hello_t{ .caps = host_caps });
+  auto bytes = frame.finish();
+  stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+
+  FrameParser parser;
+  StreamBuffer<MAX_FRAME * 2> rx;
+  std::optional<hello_t> reply;
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while(!reply && std::chrono::steady_clock::now() < deadline) {
+    size_t got = 0;
+    auto buf = rx.writable();
+    stream.async_read_some(asio::buffer(buf.data(), buf.size()),
+                           [&](const asio::error_code& ec, size_t n) { if(!ec) got = n; });
+
+    service.restart();
+    service.run_for(deadline - std::chrono::steady_clock::now());
+    if(!service.stopped()) {
+      stream.cancel();
+      service.run();
+    }
+
+    rx.commit(got);
+    rx.consume(parser.parse_records(rx.readable(), overloaded {
+        [&](const hello_t& h) { reply = h; },
+        [](const auto&) {},
+      }));
+  }
+
+  if(!reply) {
+    fmt::print("No handshake reply from the pi, assuming protocol version {}\n", PROTOCOL_VERSION);
+    return hello_t{};
+  }
+
+  if(reply->version != PROTOCOL_VERSION)
+    return Error::format("Protocol version mismatch, host {} pi {}", PROTOCOL_VERSION, reply->version);
+
+  return hello_t{ .caps = reply->caps & host_caps };
+}
+
+// Reads everything the pi sends back (echoes, macro results), on a thread of its own
+// or a shared one.
+// Writes go through a LinkWriter on the same service. When the link breaks
+// the reader fails over to the next one, and keeps trying every
+// retry_interval while none of them opens.
+struct LinkReader {
+  static constexpr auto retry_interval = std::chrono::seconds(1);
+
+  LinkReader(asio::io_service& service, Transport& stream, Telemetry& telemetry)
+    : service(service), stream(stream), telemetry(telemetry), retry(service) {}
+
+  LinkReader(const LinkReader&) = delete;
+
+  // the target's mouse poll interval, whenever the pi's measurement changes
+  std::function<void(const drain_t&)> on_drain;
+
+  // after failing over, on the reader's thread
+  std::function<void()> on_reconnect;
+
+  // a macro finished playing on the pi
+  std::function<void(const macro_done_t&)> on_macro_done;
+
+  ~LinkReader() { stop(); }
+
+  void start() {
+    read();
+    service.restart();
+    thread = std::jthread([this]() { service.run(); });
+  }
+
+  // Read on whichever thread runs the service, e.g. one shared by several links.
+  void listen() { read(); }
+
+  void stop() {
+    if(!thread.joinable()) return;
+
+    asio::post(service, [this]() {
+      stopping = true;
+      stream.cancel();
+      retry.cancel();
+    });
+    thread.join();
+  }
+
+protected:
+  asio::io_service& service;
+  Transport& stream;
+  Telemetry& telemetry;
+
+  StreamBuffer<4096> rx;
+  FrameParser parser;
+  asio::steady_timer retry;
+  bool stopping = false;
+  bool down = false; // said so already
+  std::jthread thread;
+
+  void read() {
+    auto buf = rx.writable();
+    stream.async_read_some(asio::buffer(buf.data(), buf.size()), [this](const asio::error_code& ec, size_t n) {
+      if(ec) {
+        if(ec == asio::error::operation_aborted || stopping) return;
+
+        fmt::print("Read from {} failed: {}\n", stream.spec().name(), ec.message());
+        failover();
+        return;
+      }
+
+      uint32_t now = stamp_now();
+
+      rx.commit(n);
+      rx.consume(parser.parse_records(rx.readable(), overloaded {
+          [&](const echo_t& e) { telemetry.on_echo(e, now); },
+          [&](const drain_t& d) { if(on_drain) on_drain(d); },
+          [&](const macro_done_t& d) {
+            if(d.status == MACRO_ABORTED && d.reports)
+              fmt::print("Macro {} was aborted after {} reports, the target stopped taking them\n", d.id, d.reports);
+            else if(d.status == MACRO_ABORTED)
+              fmt::print("Macro {} was aborted, the pi lost the end of its recording or the target took none of it\n", d.id);
+            else
+              fmt::print("Macro {} {} {} reports in {:.1f}ms, late p50 {}us p99 {}us max {}us\n", d.id,
+                         d.status == MACRO_CANCELLED ? "was cancelled after" : "played", d.reports,
+                         d.duration / 1e3, d.late_p50, d.late_p99, d.late_max);
+            if(d.dropped) fmt::print("Macro {} had {} steps more than the pi holds, dropped\n", d.id, d.dropped);
+            if(on_macro_done) on_macro_done(d);
+          },
+          [](const auto&) {},
+        }));
+
+      telemetry.maybe_report();
+      read();
+    });
+  }
+
+  void failover() {
+    // half a frame from the old link is no use on the new one, the parser
+    // keeps its sequence so whatever died with it shows up as lost
+    rx.clear();
+
+    if(auto res = stream.failover(); !res.is_error()) {
+      down = false;
+      if(on_reconnect) on_reconnect();
+      return read();
+    } else if(!std::exchange(down, true)) {
+      fmt::print("{}, retrying every {}s\n", res.error().what(), retry_interval.count());
+    }
+
+    retry.expires_after(retry_interval);
+    retry.async_wait([this](const asio::error_code& ec) {
+      if(!ec && !stopping) failover();
+    });
+  }
+};
+
+// Sends input to the pi without blocking the thread that makes it. Frames are
+// copied into a single producer, single consumer ring, and flush() has the
+// service thread send everything queued by then in one async_write, so frames
+// made while a write is in flight go out together in the next. Nothing queued
+// is ever dropped: after a failed write the ring goes back to the start of the
+// frame it cut off, and that goes out whole with the next flush(), or once the
+// reader has failed over (resume()). A full ring makes write() wait, for up to
+// max_wait, then it gives the frame up rather than hang on a dead link, and
+// try_write() doesn't wait at all. Either way the caller still has the frame:
+// KeyState keeps key and button changes pending and only sheds motion.
+// saturated() tells KeyState to hold mouse motion back, where it merges,
+// rather than queue it.
+struct LinkWriter {
+  static constexpr size_t capacity = 64 * 1024;
+  static constexpr size_t max_frames = 4096;
+  static constexpr auto max_wait = std::chrono::milliseconds(500);
+
+  struct Stats {
+    uint64_t frames = 0;   // flush() calls with something queued
+    uint64_t bytes = 0;
+    uint64_t writes = 0;   // async_writes, fewer than frames when coalescing
+    uint64_t full = 0;     // times write() waited for room
+    uint64_t dropped = 0;  // frames write() gave up on
+    uint64_t errors = 0;
+    size_t max_backlog = 0;
+  };
+
+  LinkWriter(asio::io_service& service, Transport& stream) : service(service), stream(stream) {}
+  LinkWriter(const LinkWriter&) = delete;
+
+  // which target this is, when there are several
+  std::string name;
+
+  // times each async_write, on the service thread, if set
+  Metrics* metrics = nullptr;
+
+  // Queue one whole frame. Producer side, one thread at a time. Returns
+  // false, with nothing of it queued, if there was no room for max_wait, or
+  // right away while the link is stuck from the last time.
+  bool write(const char* s, size_t len) {
+    if(queue(s, len, stuck ? std::chrono::milliseconds(0) : max_wait)) return true;
+
+    stats.dropped++;
+    if(!std::exchange(stuck, true))
+      fmt::print("{} isn't taking input, holding keys and buttons until it does\n", name.empty() ? "Link" : name + " link");
+    return false;
+  }
+
+  // Queue one whole frame if there's room for it now, e.g. from SDL's event
+  // watch, which mustn't wait.
+  bool try_write(const char* s, size_t len) { return queue(s, len, std::chrono::milliseconds(0)); }
+
+  void flush() {
+    size_t b = backlog();
+    if(!b) return;
+
+    stats.frames++;
+    stats.max_backlog = std::max(stats.max_backlog, b);
+    if(!kicked.exchange(true, std::memory_order_acq_rel)) asio::post(service, [this]() { send(); });
+  }
+
+  // Give what's left up to timeout to go out, before the service stops.
+  void finish(std::chrono::milliseconds timeout = std::chrono::milliseconds(500)) {
+    flush();
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while(backlog() && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  // The link is back, send what the failed write left. Service thread.
+  void resume() {
+    if(!kicked.exchange(true, std::memory_order_acq_rel)) send();
+  }
+
+  // Block until everything queued has left, e.g. before timing from it.
+  void drain() {
+    flush();
+    while(backlog()) std::this_thread::sleep_for(std::chrono::microseconds(100));
+    stream.drain();
+  }
+
+  // bytes queued or in flight
+  size_t backlog() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+  // bytes write() takes right now without waiting. Producer side.
+  size_t room() const {
+    if(frames_head.load(std::memory_order_relaxed) - frames_tail.load(std::memory_order_acquire) >= max_frames) return 0;
+    return capacity - backlog();
+  }
+
+  // the link hasn't taken what was sent before yet
+  bool saturated() const { return backlog() != 0; }
+
+  // Stats as of the last flush(), producer side.
+  Stats get_stats() const {
+    Stats ret = stats;
+    ret.writes = writes.load(std::memory_order_relaxed);
+    ret.errors = errors.load(std::memory_order_relaxed);
+    return ret;
+  }
+
+  void print() const {
+    auto s = get_stats();
+    fmt::print("{}{} frames in {} writes, {} bytes, max backlog {} bytes, {} waits for room, {} dropped, {} errors\n",
+               name.empty() ? "Link: " : name + " link: ", s.frames, s.writes, s.bytes, s.max_backlog, s.full,
+               s.dropped, s.errors);
+  }
+
+protected:
+  asio::io_service& service;
+  Transport& stream;
+
+  std::array<uint8_t, capacity> ring;
+  std::atomic<size_t> head = 0; // written by the producer
+  std::atomic<size_t> tail = 0; // sent, advanced by the service thread
+  std::atomic<bool> kicked = false; // a send() is queued or running
+
+  // where each queued frame ends, for going back to the start of a frame a
+  // failed write cut off
+  std::array<size_t, max_frames> frame_ends;
+  std::atomic<size_t> frames_head = 0; // written by the producer
+  std::atomic<size_t> frames_tail = 0; // frames sent whole, service thread
+
+  Stats stats;
+  bool stuck = false; // producer, write() gave up and doesn't wait again
+  std::atomic<uint64_t> writes = 0;
+  std::atomic<uint64_t> errors = 0;
+
+  bool queue(const char* s, size_t len, std::chrono::milliseconds wait) {
+    size_t h = head.load(std::memory_order_relaxed), f = frames_head.load(std::memory_order_relaxed);
+    auto has_room = [&]() {
+      return capacity - (h - tail.load(std::memory_order_acquire)) >= len &&
+             f - frames_tail.load(std::memory_order_acquire) < max_frames;
+    };
+
+    if(!has_room()) {
+      stats.full++;
+      auto deadline = std::chrono::steady_clock::now() + wait;
+      while(!has_room()) {
+        if(len > capacity || std::chrono::steady_clock::now() >= deadline) return false;
+        flush();
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+    stuck = false;
+
+    size_t at = h % capacity, first = std::min(len, capacity - at);
+    std::memcpy(ring.data() + at, s, first);
+    std::memcpy(ring.data(), s + first, len - first);
+
+    // the end is marked before the bytes are published, so send() always
+    // knows where the frames it's sending end
+    frame_ends[f % max_frames] = h + len;
+    frames_head.store(f + 1, std::memory_order_release);
+    head.store(h + len, std::memory_order_release);
+
+    stats.bytes += len;
+    return true;
+  }
+
+  // service thread
+  void send() {
+    size_t t = tail.load(std::memory_order_relaxed), h = head.load(std::memory_order_acquire);
+    if(h == t) {
+      kicked.store(false, std::memory_order_release);
+
+      // a flush() between the load and the store saw kicked still set
+      if(head.load(std::memory_order_acquire) != t && !kicked.exchange(true, std::memory_order_acq_rel)) send();
+      return;
+    }
+
+    size_t at = t % capacity, first = std::min(h - t, capacity - at);
+    std::array<asio::const_buffer, 2> bufs = {
+      asio::buffer(ring.data() + at, first),
+      asio::buffer(ring.data(), h - t - first),
+    };
+
+    auto start = Metrics::my_clock::now();
+    asio::async_write(stream, bufs, [this, t, start](const asio::error_code& ec, size_t n) {
+      // only whole frames count as sent, the one cut off goes again
+      size_t f = frames_tail.load(std::memory_order_relaxed), sent = t;
+      while(f != frames_head.load(std::memory_order_acquire) && frame_ends[f % max_frames] <= t + n)
+        sent = frame_ends[f++ % max_frames];
+      frames_tail.store(f, std::memory_order_release);
+      tail.store(sent, std::memory_order_release);
+      writes.fetch_add(1, std::memory_order_relaxed);
+      if(metrics) metrics->record(Metrics::SERIAL, Metrics::my_clock::now() - start);
+
+      if(!ec) return send();
+
+      // the rest waits for the link to come back
+      if(ec != asio::error::operation_aborted && !errors.fetch_add(1, std::memory_order_relaxed))
+        fmt::print("Write to {} failed: {}\n", stream.spec().name(), ec.message());
+      kicked.store(false, std::memory_order_release);
+    });
+  }
+};
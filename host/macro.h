@@ -0,0 +1,178 @@
+#pragma once
+
+#include "recorder.h"
+#include "tile_codec.h"
+
+#include <common/err.h>
+#include <common/msg.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <thread>
+#include <variant>
+#include <vector>
+
+// A timed sequence of reports for the pi to play back on its own clock (see
+// CAP_MACRO in common/msg.h), so the timing survives the serial link.
+struct Macro {
+  using Report = std::variant<keyboard_t, keyboard_nkro_t, mouse_t>;
+
+  struct Step {
+    std::chrono::microseconds offset;
+    Report report;
+  };
+
+  std::vector<Step> steps;
+
+  std::chrono::microseconds duration() const {
+    return steps.empty() ? std::chrono::microseconds(0) : steps.back().offset;
+  }
+
+  // offsets go to the pi as 32 bit microseconds, about 71 minutes
+  static constexpr std::chrono::microseconds max_duration { UINT32_MAX };
+
+  // The input of a recorded session, timed as it was sent. Only the INPUT
+  // chunks are read, frames are seeked past.
+  static ErrorOr<Macro> from_recording(const char* path) {
+    std::ifstream f(path, std::ios::binary);
+    if(!f) return Error::format(errno, "Failed to open {}", path);
+
+    Macro ret;
+    FrameParser parser;
+    std::optional<int64_t> first;
+    std::vector<uint8_t> data;
+
+    for(codec::ChunkHeader h; f.read(reinterpret_cast<char*>(&h), sizeof(h));) {
+      if(h.type == codec::TRAILER) break;
+      if(h.type != codec::INPUT) {
+        f.seekg(h.size, std::ios::cur);
+        continue;
+      }
+
+      data.resize(h.size);
+      if(!f.read(reinterpret_cast<char*>(data.data()), h.size)) break;
+
+      for(size_t i = 0; i + sizeof(Recorder::InputRecord) <= data.size();) {
+        Recorder::InputRecord r;
+        std::memcpy(&r, data.data() + i, sizeof(r));
+        i += sizeof(r);
+        if(i + r.len > data.size()) break;
+
+        int64_t time = r.time;
+        if(!first) first = time;
+        auto offset = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::nanoseconds(time - *first));
+        if(offset > max_duration)
+          return Error::format("Input in {} goes on for over {} minutes, too long to replay", path,
+                               std::chrono::duration_cast<std::chrono::minutes>(max_duration).count());
+
+        parser.parse_records(std::span(data.data() + i, r.len), overloaded {
+            [&](const keyboard_t& k) { ret.steps.push_back({ offset, k }); },
+            [&](const keyboard_nkro_t& k) { ret.steps.push_back({ offset, k }); },
+            [&](const mouse_t& m) { ret.steps.push_back({ offset, m }); },
+            [](const auto&) {},
+          });
+        i += r.len;
+      }
+    }
+
+    if(ret.steps.empty()) return Error::format("No input recorded in {}", path);
+    return ret;
+  }
+
+  // For a pi without CAP_NKRO.
+  void boot_only() {
+    for(auto& s: steps)
+      if(auto* k = std::get_if<keyboard_nkro_t>(&s.report)) s.report = boot_report(*k);
+  }
+
+  // Upload as macro id, to start delay after the pi has all of it. Blocks
+  // until all of it is queued on stream, see MacroUpload.
+  ErrorOr<void> send(auto& stream, FrameWriter& frame, uint8_t id, std::chrono::microseconds delay = {}) const;
+};
+
+// Writes a macro to a LinkWriter a few frames at a time, for a thread that
+// can't wait behind the link for all of it. Until it's done nothing else may
+// go to the stream, the pi would record it into the macro.
+struct MacroUpload {
+  // room left in the stream for others after each pump()
+  static constexpr size_t reserve = 4 * MAX_FRAME;
+  // a stream that takes none of it for this long is given up on
+  static constexpr auto stall_timeout = std::chrono::milliseconds(500);
+
+  using my_clock = std::chrono::steady_clock;
+
+  MacroUpload(Macro macro, uint8_t id, std::chrono::microseconds delay = {})
+    : macro(std::move(macro)), id(id), delay(delay) {}
+
+  // Queue what fits without waiting. True once the end is queued, an error
+  // if the stream stalled; the pi is then told to throw the macro away.
+  ErrorOr<bool> pump(auto& stream, FrameWriter& frame) {
+    auto put = [&](const auto& record) {
+      if(frame.add(record)) return;
+      flush(stream, frame);
+      frame.add(record);
+    };
+
+    size_t before = next;
+    if(!begun) {
+      put(macro_begin_t{ id });
+      begun = true;
+    }
+
+    auto& steps = macro.steps;
+    while(next < steps.size() && stream.room() >= reserve) {
+      if(steps[next].offset != at) {
+        at = steps[next].offset;
+        put(at_t{ uint32_t(at->count()) });
+      }
+      std::visit([&](const auto& r) { put(r); }, steps[next].report);
+      next++;
+    }
+
+    bool done = next == steps.size();
+    if(done) put(macro_end_t{ id, uint32_t(delay.count()) });
+
+    // the frame writer is shared, nothing of ours may be left in it
+    if(!frame.empty()) flush(stream, frame);
+    stream.flush();
+
+    auto now = my_clock::now();
+    if(done || next != before) {
+      progress = now;
+    } else if(now - progress > stall_timeout) {
+      // a begin inside the open recording breaks it, the end then throws
+      // it away, and on a pi that already gave up they're an empty macro
+      frame.add(macro_begin_t{ id });
+      frame.add(macro_end_t{ id, 0 });
+      flush(stream, frame);
+      stream.flush();
+      return Error::format("The link took none of macro {} for {}ms, gave up on it", id, stall_timeout.count());
+    }
+    return done;
+  }
+
+protected:
+  Macro macro;
+  uint8_t id;
+  std::chrono::microseconds delay;
+
+  size_t next = 0;
+  bool begun = false;
+  std::optional<std::chrono::microseconds> at;
+  my_clock::time_point progress = my_clock::now();
+
+  static void flush(auto& stream, FrameWriter& frame) {
+    auto bytes = frame.finish();
+    stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  }
+};
+
+inline ErrorOr<void> Macro::send(auto& stream, FrameWriter& frame, uint8_t id, std::chrono::microseconds delay) const {
+  MacroUpload upload(*this, id, delay);
+  while(!TRY(upload.pump(stream, frame)))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  return {};
+}
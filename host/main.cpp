@@ -1,24 +1,41 @@
 #include "window.h"
 #include "async_capture.h"
+#include "calibrate.h"
+#include "capture_pool.h"
+#include "hud.h"
+#include "input.h"
 #include "keys.h"
+#include "link.h"
+#include "macro.h"
+#include "metrics.h"
+#include "options.h"
+#include "overview.h"
+#include "paste.h"
+#include "recorder.h"
+#include "scale.h"
+#include "stream.h"
 #include <SDL2/SDL_events.h>
 #include <SDL2/SDL_mouse.h>
-#include <common/serial.h>
+#include <common/transport.h>
 
 #include <asio.hpp>
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <thread>
 #include <fmt/core.h>
 #include <bitset>
 
-ErrorOr<AsyncCapture> open_capture_with_timeout(const char* path, std::chrono::system_clock::duration timeout) {
+ErrorOr<AsyncCapture> open_capture_with_timeout(const char* path, uint32_t buffer_count,
+                                                Capture::Memory memory, const Capture::Request& mode,
+                                                std::chrono::system_clock::duration timeout) {
   std::optional<AsyncCapture> cap;
   std::optional<Error> last_err;
 
   auto start = std::chrono::system_clock::now();
   while(!cap && std::chrono::system_clock::now() - start < timeout) {
-    auto res = AsyncCapture::open(path);
+    auto res = AsyncCapture::open(path, buffer_count, memory, mode);
 
     if(res.is_error()) {
       fmt::print("Failed to open capture device: {}\n", res.error().what());
@@ -34,67 +51,723 @@ ErrorOr<AsyncCapture> open_capture_with_timeout(const char* path, std::chrono::s
   return std::move(cap.value());
 }
 
-ErrorOr<void> go(int argc, char** argv) {
-  if(argc < 3) return Error::format("USAGE: {} <v4l2 device> <serial device>", argv[0]);
-
-  keys::KeyState keys;
-  asio::io_service service;
-  serial_iostream stream(service, argv[2]);
-  stream.set_option(asio::serial_port_base::baud_rate(115200));
-
-  auto cap = TRY(open_capture_with_timeout(argv[1], std::chrono::seconds(30)));
+// The HUD and the --metrics export, shared by every target's Metrics, the
+// --calibrate run, and what right ctrl + v pastes the clipboard to.
+struct Instruments {
+  Hud hud;
+  std::optional<MetricsExport> out;
+  std::unique_ptr<Calibration> calibration;
+  std::function<void(std::string_view)> paste;
+  // uploads some more of a paste, true while it isn't all out
+  std::function<bool()> pump;
 
-  int w = cap->get_width(), h = cap->get_height();
-  fmt::print("{}x{}\n", w, h);
-
-  auto win = TRY(Window::create(w, h));
-  win.set_title("Harness");
+  static ErrorOr<Instruments> create(const Options& opts) {
+    Instruments ret;
+    ret.hud.visible = opts.hud;
+    if(opts.metrics_path) ret.out.emplace(TRY(MetricsExport::open(opts.metrics_path)));
+    if(opts.calibrate) ret.calibration = std::make_unique<Calibration>(*opts.calibrate, opts.calibrate_region);
+    return ret;
+  }
 
-  auto texture = TRY(win.create_texture(SDL_PIXELFORMAT_NV12, w, h));
-  texture.set_scale_mode(SDL_ScaleModeBest);
+  // Roll m over and export it once its interval is up. True if it did.
+  bool roll(Metrics& m) {
+    if(!m.roll()) return false;
+    if(out) out->write(m.json());
+    return true;
+  }
+};
 
-  cap.start();
+// Right ctrl + v pastes through the pi, the target mustn't see it and paste
+// its own clipboard too.
+bool is_paste(const SDL_Event& e) {
+  return e.type == SDL_KEYDOWN && (SDL_GetModState() & KMOD_RCTRL) && e.key.keysym.scancode == SDL_SCANCODE_V;
+}
 
+// Show frames and send input to out until the window is closed. update(texture)
+// runs whenever frame_event fires and says whether the texture changed.
+// Key and button edges go out from an InputWatch as they're pumped, the loop
+// sends coalesced motion. Rendering is timed into metrics, right ctrl + h
+// shows them, right ctrl + v types the clipboard on the target.
+ErrorOr<void> run_window(Window& win, Window::Texture& texture, int w, int h, Uint32 frame_event,
+                         keys::KeyState& keys, auto& out, Metrics& metrics, Instruments& inst, auto&& update) {
   bool running = true;
+  bool redraw = false;
 
   int scaled_w, scaled_h;
   std::tie(scaled_w, scaled_h) = win.get_dims();
+  win.set_grab(keys.relative);
+
+  // input is held back while a paste uploads, the pi would record it
+  bool uploading = false;
+
+  InputWatch input(keys);
+  input.resize(scaled_w, scaled_h);
+  input.send = [&]() { if(!uploading) keys.try_dump(out); };
+  if(inst.paste) input.accept = [](const SDL_Event& e) { return !is_paste(e); };
 
   while(running) {
-    auto start = SDL_GetPerformanceCounter();
+    bool new_frame = false;
 
-    auto [win_w, win_h] = win.get_dims();
+    win.wait_events(uploading ? 1 : keys.timeout_ms(), [&](const SDL_Event& e) {
+      if(e.type == SDL_QUIT) running = false;
 
-    if(auto frame = cap.pop_frame()) {
-      {
-        auto pixels = texture.guard();
-        std::copy(frame->data.begin(), frame->data.end(), pixels.data.begin());
-        frame.reset();
+      if(e.type == frame_event) {
+        new_frame = true;
+        return;
+      }
+
+      if(e.type == SDL_WINDOWEVENT)
+        redraw = true;
+
+      // ask the pi to dump its trace and counters
+      if(keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_F12}))
+        keys.frame.add(stats_request_t{});
+
+      // relative motion only makes sense with the pointer grabbed
+      if(keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_M})) {
+        keys.relative = !keys.relative;
+        win.set_grab(keys.relative);
+      }
+
+      if(keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_H})) {
+        inst.hud.visible = !inst.hud.visible;
+        redraw = true;
       }
 
+      if(inst.paste && keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_V}))
+        inst.paste(Window::get_clipboard());
+    });
+
+    if(new_frame && TRY(update(texture)))
+      redraw = true;
+    win.pump_events();
+    uploading = inst.pump && inst.pump();
+
+    if(inst.roll(metrics)) {
+      auto lines = metrics.lines();
+      if(inst.calibration) lines.push_back(inst.calibration->summary());
+      inst.hud.set_lines(std::move(lines));
+      if(inst.hud.visible) redraw = true;
+    }
+
+    if(redraw) {
+      auto [win_w, win_h] = win.get_dims();
       auto scale = std::min(double(win_w) / w, double(win_h) / h);
 
       scaled_w = w * scale;
       scaled_h = h * scale;
+      input.resize(scaled_w, scaled_h);
 
-      win.render_clear();
-      win.render_copy(texture, SDL_Rect{0, 0, scaled_w, scaled_h});
-      win.render_present();
+      {
+        Metrics::Timer t(&metrics, Metrics::RENDER);
+        win.render_clear();
+        win.render_copy(texture, SDL_Rect{0, 0, scaled_w, scaled_h});
+        inst.hud.draw(win);
+      }
+      // present can block for a refresh with vsync
+      win.pump_events();
+      {
+        Metrics::Timer t(&metrics, Metrics::PRESENT);
+        win.render_present();
+      }
+      metrics.frame_presented();
+      if(inst.calibration) inst.calibration->on_present();
+      redraw = false;
     }
 
-    win.process_events([&](const SDL_Event& e) {
-      if(e.type == SDL_QUIT) running = false;
-      keys.consume_event(e, scaled_w, scaled_h);
+    if(uploading) continue;
+
+    // the calibration tap goes out on its own, it has to be timed
+    if(auto tap = inst.calibration ? inst.calibration->due() : std::nullopt) {
+      keys.dump(out);
+      for(auto& k: { tap->first, tap->second }) {
+        if(keys.nkro) keys.frame.add(k);
+        else keys.frame.add(boot_report(k));
+      }
+      keys.dump(out);
+      inst.calibration->tapped();
+    }
+
+    keys.dump(out);
+  }
+
+  return {};
+}
+
+// A full event queue (the loop stuck in a long upload) fails the push, the
+// source then tries again with its next frame.
+Uint32 frame_event_for(auto& source) {
+  Uint32 frame_event = SDL_RegisterEvents(1);
+  source.on_frame([frame_event]() {
+    SDL_Event e {};
+    e.type = frame_event;
+    return SDL_PushEvent(&e) == 1;
+  });
+  return frame_event;
+}
+
+// Local viewer: the capture card and the pi are on this machine.
+ErrorOr<void> present(const Options& opts, AsyncCapture& cap, keys::KeyState& keys, LinkWriter& writer,
+                      Metrics& metrics, Instruments& inst) {
+  int w = cap->get_width(), h = cap->get_height();
+
+  auto win = TRY(Window::create(w, h, opts.vsync));
+  win.set_title("Harness");
+
+  auto texture = TRY(win.create_texture(cap->get_format(), w, h));
+  texture.set_scale_mode(SDL_ScaleModeBest);
+
+  // the capture thread wakes the event loop when a new frame is ready
+  Uint32 frame_event = frame_event_for(cap);
+  cap.start();
+
+  // only changed tiles are uploaded, and an unchanged frame isn't presented
+  tiles::DirtyTracker dirty;
+  return run_window(win, texture, w, h, frame_event, keys, writer, metrics, inst,
+                    [&](Window::Texture& texture) -> ErrorOr<bool> {
+    auto* frame = cap.pop_frame();
+    if(!frame || !frame->buf) return false;
+
+    metrics.record(Metrics::HANDOFF, Metrics::my_clock::now() - frame->time);
+    metrics.presented.fetch_add(1, std::memory_order_relaxed);
+    if(inst.calibration) inst.calibration->on_frame(frame->tiles, frame->buf->timestamp);
+
+    bool changed = dirty.update(frame->tiles);
+    if(changed) {
+      Metrics::Timer t(&metrics, Metrics::UPLOAD);
+      TRY(texture.upload(frame->buf->view(), dirty.rects()));
+      metrics.frame_uploaded(frame->buf->timestamp);
+    }
+
+    frame->buf.reset();
+    return changed;
+  });
+}
+
+// Headless: stream the capture to remote viewers and forward their input.
+ErrorOr<void> serve(const Options& opts, AsyncCapture& cap, keys::KeyState& keys, LinkWriter& writer,
+                    Metrics& metrics, Instruments& inst) {
+  asio::error_code ec;
+  auto address = asio::ip::make_address(opts.serve_address, ec);
+  if(ec) return Error::format("Bad address to serve on {}: {}", opts.serve_address, ec.message());
+
+  asio::io_service net;
+  StreamServer server(net, tcp::endpoint(address, opts.serve_port), cap);
+
+  // viewers' records go out in our own frames, stamped on our clock
+  server.on_input = [&](std::span<const uint8_t> payload) {
+    auto add = [&](const auto& r) {
+      if(!keys.frame.add(r)) {
+        keys.dump(writer);
+        keys.frame.add(r);
+      }
+    };
+
+    if(keys.stamp) add(stamp_t{ stamp_now() });
+    decode_records(payload, overloaded {
+        [&](const keyboard_t& k) { add(k); },
+        [&](const keyboard_nkro_t& k) {
+          if(keys.nkro) add(k);
+          else add(boot_report(k));
+        },
+        [&](const mouse_t& m) { add(m); },
+        [&](const stats_request_t& s) { add(s); },
+        [](const auto&) {},
+      });
+    keys.dump(writer);
+  };
+
+  asio::signal_set signals(net, SIGINT, SIGTERM);
+  signals.async_wait([&](const asio::error_code& ec, int) { if(!ec) net.stop(); });
+
+  // no window to drive the metrics, a timer rolls them over instead
+  asio::steady_timer tick(net);
+  std::function<void()> roll = [&]() {
+    tick.expires_after(Metrics::interval);
+    tick.async_wait([&](const asio::error_code& ec) {
+      if(ec) return;
+      inst.roll(metrics);
+      roll();
     });
+  };
+  roll();
+
+  server.start();
+  cap.start();
+
+  fmt::print("Serving on {}:{}\n", opts.serve_address, opts.serve_port);
+  if(!address.is_loopback())
+    fmt::print("Anyone who can reach {} can type on the target\n", opts.serve_address);
+  net.run();
+  return {};
+}
+
+// Thin client: show a remote harness --serve and send it our input.
+ErrorOr<void> view_remote(const Options& opts) {
+  std::string_view target = opts.connect;
+  auto colon = target.rfind(':');
+  if(colon == target.npos) return Error::format("Expected host:port, got {}", target);
+
+  asio::io_service service;
+  StreamClient client(service);
+  TRY(client.connect(std::string(target.substr(0, colon)), std::string(target.substr(colon + 1))));
+
+  Uint32 frame_event = frame_event_for(client);
+  client.start();
+
+  auto format = client.wait_format(std::chrono::seconds(10));
+  if(!format) return Error("Server didn't send a stream");
+
+  int w = format->width, h = format->height;
+  auto win = TRY(Window::create(w, h, opts.vsync));
+  win.set_title(fmt::format("Harness - {}", target));
+
+  auto texture = TRY(win.create_texture(format->fourcc, w, h));
+  texture.set_scale_mode(SDL_ScaleModeBest);
+
+  keys::KeyState keys;
+  keys.relative = opts.relative;
+  // the serving side turns these back into boot reports if its pi needs them
+  keys.nkro = opts.nkro;
+
+  Metrics metrics;
+  metrics.name = std::string(target);
+  auto inst = TRY(Instruments::create(opts));
+
+  return run_window(win, texture, w, h, frame_event, keys, client, metrics, inst,
+                    [&](Window::Texture& texture) -> ErrorOr<bool> {
+    if(!client.is_connected()) return Error("Connection to server lost");
+
+    std::optional<Error> err;
+    bool changed = client.take([&](const codec::Format& f, const FrameView& view, std::span<const Rect> rects) {
+      Metrics::Timer t(&metrics, Metrics::UPLOAD);
+      if(f != *format) err = Error("Remote capture format changed, reconnect to pick it up");
+      else if(auto res = texture.upload(view, rects); res.is_error()) err = res.error();
+    });
+
+    if(err) return *err;
+    if(changed) metrics.presented.fetch_add(1, std::memory_order_relaxed);
+    return changed;
+  });
+}
+
+// One capture card and pi of a multi-target session.
+struct Target {
+  std::string name;
+  Transport stream;
+  LinkWriter writer;
+  hello_t link;
+  Telemetry telemetry;
+  Metrics metrics;
+  std::optional<LinkReader> reader;
+  std::optional<AsyncCapture> cap;
+
+  // the overview's copy, only kept up to date while it's on screen
+  scale::Thumbnail thumb;
+  std::optional<Window::Texture> thumb_texture;
+
+  tiles::DirtyTracker dirty;
+  bool pending = false; // has a frame we haven't popped
+  std::atomic<uint32_t> mouse_drain = 0;
+  std::optional<paste::Paster> paster;
+  FrameWriter upload; // for the paster, keys.frame belongs to the focused target
+
+  Target(asio::io_service& service, const Options::Target& t, uint32_t baud)
+    : name(t.capture_device), stream(service, t.link, baud), writer(service, stream) {}
+};
+
+// Several targets in one window: an overview of thumbnails, or one of them at
+// full size with the keyboard and mouse going to it alone. Right ctrl + 1..9
+// focuses a target, right ctrl + 0 goes back to the overview, and clicking a
+// thumbnail focuses it. Captures share a CapturePool and links to the pis share
+// one reader thread, so adding a target doesn't add threads.
+ErrorOr<void> present_targets(const Options& opts) {
+  keys::KeyState keys;
+  keys.relative = opts.relative;
+  auto inst = TRY(Instruments::create(opts));
+  auto layout = TRY(paste::Layout::named(opts.layout));
+  asio::io_service service;
+  std::deque<Target> targets;
+
+  for(auto& t: opts.targets) {
+    auto& target = targets.emplace_back(service, t, opts.baud);
+    TRY(target.stream.connect());
+    target.telemetry.name = target.name;
+    target.metrics.name = target.name;
+    target.writer.name = target.name;
+    target.writer.metrics = &target.metrics;
+
+    target.link = TRY(handshake(service, target.stream, keys.frame, std::chrono::seconds(1)));
+    fmt::print("{}: {}, protocol version {}, capabilities {:#x}\n", target.name, target.stream.spec().name(),
+               target.link.version, target.link.caps);
+    target.paster.emplace(layout, target.link.caps);
+  }
+
+  for(auto& t: targets) {
+    t.cap.emplace(TRY(open_capture_with_timeout(t.name.c_str(), opts.buffer_count, opts.memory, opts.mode,
+                                                std::chrono::seconds(30))));
+
+    auto& mode = (*t.cap)->get_mode();
+    fmt::print("{}: {}x{} {} @ {:.2f} fps\n", t.name, mode.width, mode.height, fourcc_str(mode.fourcc), mode.fps());
+  }
+
+  Overview overview(targets.size());
+  int win_w = (*targets[0].cap)->get_width(), win_h = (*targets[0].cap)->get_height();
+
+  auto win = TRY(Window::create(win_w, win_h, opts.vsync));
+  win.set_title("Harness - overview");
+
+  Uint32 frame_event = SDL_RegisterEvents(1);
+  CapturePool pool;
+
+  auto size_thumb = [&](Target& t, uint32_t fourcc, int w, int h) -> ErrorOr<void> {
+    t.thumb.resize(fourcc, w, h, scale::factor_for(w, win_w / overview.cols));
+    t.thumb_texture.emplace(TRY(win.create_texture(fourcc, t.thumb.get_width(), t.thumb.get_height())));
+    t.thumb_texture->set_scale_mode(SDL_ScaleModeBest);
+    return {};
+  };
+
+  for(size_t i = 0; i < targets.size(); i++) {
+    auto& t = targets[i];
+    auto& cap = *t.cap;
+    TRY(size_thumb(t, cap->get_format(), cap->get_width(), cap->get_height()));
+
+    cap.on_frame([frame_event, i]() {
+      SDL_Event e {};
+      e.type = frame_event;
+      e.user.code = i;
+      return SDL_PushEvent(&e) == 1;
+    });
+    cap.set_metrics(&t.metrics);
+    pool.add(cap);
+
+    t.reader.emplace(service, t.stream, t.telemetry);
+    t.reader->on_drain = [&t](const drain_t& d) { t.mouse_drain = d.mouse; };
+    t.reader->on_reconnect = [&t]() { t.writer.resume(); };
+    t.reader->on_macro_done = [&t](const macro_done_t& d) { t.paster->on_done(d); };
+    t.reader->listen();
+  }
+
+  TRY(pool.start());
+
+  service.restart();
+  std::jthread links([&]() { service.run(); });
+
+  auto ret = [&]() -> ErrorOr<void> {
+    std::optional<size_t> focus;
+    std::optional<Window::Texture> full;
+    bool running = true;
+    bool redraw = true;
+    int scaled_w = 1, scaled_h = 1;
+
+    auto select = [&](std::optional<size_t> next) -> ErrorOr<void> {
+      // let go of everything held down on the target we're leaving
+      if(focus) keys.reset(targets[*focus].writer);
+
+      focus = next;
+      full.reset();
+
+      if(focus) {
+        auto& t = targets[*focus];
+        full.emplace(TRY(win.create_texture((*t.cap)->get_format(), (*t.cap)->get_width(), (*t.cap)->get_height())));
+        full->set_scale_mode(SDL_ScaleModeBest);
+        keys.stamp = t.link.caps & CAP_TELEMETRY;
+        keys.nkro = opts.nkro && t.link.caps & CAP_NKRO;
+        win.set_title(fmt::format("Harness - {}", t.name));
+      } else {
+        win.set_title("Harness - overview");
+      }
+      win.set_grab(focus && keys.relative);
+
+      // what's on screen now starts from scratch, and targets that were
+      // left alone need popping to be notified again
+      for(auto& t: targets) {
+        t.dirty.invalidate();
+        t.pending = true;
+      }
+      redraw = true;
+      return {};
+    };
+
+    // input goes to the focused target, less the hotkeys that switch and paste
+    auto is_switch = [](const SDL_Event& e) {
+      return e.type == SDL_KEYDOWN && (SDL_GetModState() & KMOD_RCTRL)
+        && e.key.keysym.scancode >= SDL_SCANCODE_1 && e.key.keysym.scancode <= SDL_SCANCODE_0;
+    };
+
+    InputWatch input(keys);
+    input.resize(scaled_w, scaled_h);
+    input.accept = [&](const SDL_Event& e) { return focus && !is_switch(e) && !is_paste(e); };
+    // input to a target is held back while a paste uploads to it, the pi
+    // would record it
+    auto holding = [&]() { return focus && targets[*focus].paster->uploading(); };
+    input.send = [&]() {
+      if(holding()) return;
+      keys.mouse_drain = targets[*focus].mouse_drain.load();
+      keys.try_dump(targets[*focus].writer);
+    };
+
+    inst.paste = [&](std::string_view text) {
+      if(!focus) return;
+      auto& t = targets[*focus];
+      if(auto res = t.paster->paste(text, t.mouse_drain); res.is_error())
+        fmt::print("{}: {}\n", t.name, res.error().what());
+    };
+
+    while(running) {
+      std::optional<std::optional<size_t>> switch_to;
+      bool uploading = std::any_of(targets.begin(), targets.end(), [](auto& t) { return t.paster->uploading(); });
+
+      win.wait_events(uploading ? 1 : focus ? keys.timeout_ms() : 1000, [&](const SDL_Event& e) {
+        if(e.type == SDL_QUIT) running = false;
+
+        if(e.type == frame_event) {
+          targets[e.user.code].pending = true;
+          return;
+        }
+
+        if(e.type == SDL_WINDOWEVENT)
+          redraw = true;
+
+        if(e.type == SDL_KEYDOWN && (SDL_GetModState() & KMOD_RCTRL)) {
+          auto code = e.key.keysym.scancode;
+          if(code == SDL_SCANCODE_0) {
+            switch_to = std::optional<size_t>();
+            return;
+          }
+          if(code >= SDL_SCANCODE_1 && code <= SDL_SCANCODE_9) {
+            if(size_t(code - SDL_SCANCODE_1) < targets.size()) switch_to = size_t(code - SDL_SCANCODE_1);
+            return;
+          }
+        }
+
+        if(keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_H})) {
+          inst.hud.visible = !inst.hud.visible;
+          redraw = true;
+        }
+
+        if(!focus) {
+          if(e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_LEFT) {
+            auto [w, h] = win.get_dims();
+            if(auto i = overview.hit(e.button.x, e.button.y, w, h)) switch_to = size_t(*i);
+          }
+          return;
+        }
+
+        // ask the pi to dump its trace and counters
+        if(keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_F12}))
+          keys.frame.add(stats_request_t{});
+
+        if(keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_M})) {
+          keys.relative = !keys.relative;
+          win.set_grab(keys.relative);
+        }
+
+        if(keys::OnPress(e, keys::kbd_button{SDL_SCANCODE_RCTRL}, keys::kbd_button{SDL_SCANCODE_V}))
+          inst.paste(Window::get_clipboard());
+      });
+
+      if(switch_to) TRY(select(*switch_to));
+
+      for(size_t i = 0; i < targets.size(); i++) {
+        auto& t = targets[i];
+
+        // targets that aren't on screen keep their newest frame in the mailbox
+        if(!t.pending || (focus && *focus != i)) continue;
+        t.pending = false;
+
+        auto* frame = t.cap->pop_frame();
+        if(!frame || !frame->buf) continue;
+
+        t.metrics.record(Metrics::HANDOFF, Metrics::my_clock::now() - frame->time);
+        t.metrics.presented.fetch_add(1, std::memory_order_relaxed);
+
+        if(t.dirty.update(frame->tiles)) {
+          Metrics::Timer timer(&t.metrics, Metrics::UPLOAD);
+          auto view = frame->buf->view();
+          auto rects = std::span<const Rect>(t.dirty.rects());
+
+          // a device that came back in another mode needs new textures, and
+          // all of the frame in them
+          if(focus) {
+            if(!full->fits(view)) {
+              full.emplace(TRY(win.create_texture(view.format, view.width, view.height)));
+              full->set_scale_mode(SDL_ScaleModeBest);
+              rects = {};
+            }
+            TRY(full->upload(view, rects));
+            t.metrics.frame_uploaded(frame->buf->timestamp);
+          } else {
+            if(!t.thumb.fits(view)) {
+              TRY(size_thumb(t, view.format, view.width, view.height));
+              rects = {};
+            }
+            auto& changed = t.thumb.update(view, rects);
+            TRY(t.thumb_texture->upload(t.thumb.view(), changed));
+          }
+          redraw = true;
+        }
+
+        frame->buf.reset();
+        win.pump_events();
+      }
+
+      // the HUD follows the focused target, the overview gets every
+      // target's headline
+      bool rolled = false;
+      for(auto& t: targets) rolled |= inst.roll(t.metrics);
+      if(rolled) {
+        std::vector<std::string> lines;
+        for(auto& t: targets) {
+          if(focus && &t != &targets[*focus]) continue;
+          auto l = t.metrics.lines();
+          if(focus) lines = std::move(l);
+          else lines.push_back(std::move(l[0]));
+        }
+        inst.hud.set_lines(std::move(lines));
+        if(inst.hud.visible) redraw = true;
+      }
+
+      if(redraw) {
+        // rendering is charged to the focused target, the overview's to none
+        Metrics* charge = focus ? &targets[*focus].metrics : nullptr;
+        auto [w, h] = win.get_dims();
+
+        std::optional<Metrics::Timer> timer;
+        timer.emplace(charge, Metrics::RENDER);
+        win.render_clear();
+
+        if(focus) {
+          auto scale = std::min(double(w) / full->get_width(), double(h) / full->get_height());
+
+          scaled_w = full->get_width() * scale;
+          scaled_h = full->get_height() * scale;
+          input.resize(scaled_w, scaled_h);
+          win.render_copy(*full, SDL_Rect{0, 0, scaled_w, scaled_h});
+        } else {
+          for(size_t i = 0; i < targets.size(); i++) {
+            auto& t = targets[i];
+            win.render_copy(*t.thumb_texture, overview.place(i, w, h, t.thumb.get_width(), t.thumb.get_height()));
+          }
+        }
+        inst.hud.draw(win);
+        win.pump_events();
+
+        timer.emplace(charge, Metrics::PRESENT);
+        win.render_present();
+        timer.reset();
+        if(charge) charge->frame_presented();
+        redraw = false;
+      }
+
+      for(auto& t: targets) t.paster->pump(t.writer, t.upload);
+
+      if(focus && !holding()) {
+        keys.mouse_drain = targets[*focus].mouse_drain.load();
+        keys.dump(targets[*focus].writer);
+      }
+    }
+
+    return {};
+  }();
+
+  pool.stop();
+  for(auto& t: targets) t.writer.finish();
+  service.stop();
+  links.join();
+
+  for(auto& t: targets) {
+    t.telemetry.print();
+    t.writer.print();
+  }
+
+  return ret;
+}
+
+ErrorOr<void> go(int argc, char** argv) {
+  auto opts = TRY(Options::parse(argc, argv));
+  if(opts.connect) return view_remote(opts);
+  if(opts.targets.size() > 1) return present_targets(opts);
+
+  keys::KeyState keys;
+  asio::io_service service;
+  Transport stream(service, opts.targets[0].link, opts.baud);
+  TRY(stream.connect());
+
+  auto link = TRY(handshake(service, stream, keys.frame, std::chrono::seconds(1)));
+  fmt::print("{}: protocol version {}, capabilities {:#x}\n", stream.spec().name(), link.version, link.caps);
+
+  Telemetry telemetry;
+  Metrics metrics;
+  auto inst = TRY(Instruments::create(opts));
+  paste::Paster paster(TRY(paste::Layout::named(opts.layout)), link.caps);
+  LinkWriter writer(service, stream);
+  writer.metrics = &metrics;
+  LinkReader reader(service, stream, telemetry);
+  keys.stamp = link.caps & CAP_TELEMETRY;
+  keys.relative = opts.relative;
+  keys.nkro = opts.nkro && link.caps & CAP_NKRO;
+  if(opts.nkro && !keys.nkro) fmt::print("The pi has no NKRO keyboard, using the boot keyboard\n");
+  reader.on_drain = [&](const drain_t& d) { keys.mouse_drain = d.mouse; };
+  reader.on_reconnect = [&]() { writer.resume(); };
+  reader.on_macro_done = [&](const macro_done_t& d) { paster.on_done(d); };
+  reader.start();
+
+  auto cap = TRY(open_capture_with_timeout(opts.targets[0].capture_device, opts.buffer_count, opts.memory, opts.mode,
+                                            std::chrono::seconds(30)));
+
+  auto& mode = cap->get_mode();
+  fmt::print("{}x{} {} @ {:.2f} fps\n", mode.width, mode.height, fourcc_str(mode.fourcc), mode.fps());
+  cap.set_metrics(&metrics);
+
+  std::optional<Recorder> recorder;
+  if(opts.record_path) {
+    recorder.emplace(cap.add_sink());
+    TRY(recorder->start(opts.record_path, opts.record_raw));
+    keys.on_send = [&](std::span<const uint8_t> bytes) { recorder->record_input(bytes); };
+  }
+
+  if(opts.replay_path) {
+    if(!(link.caps & CAP_MACRO)) return Error("The pi can't play macros, update harness_server");
+
+    auto macro = TRY(Macro::from_recording(opts.replay_path));
+    if(!(link.caps & CAP_NKRO)) macro.boot_only();
+    fmt::print("Replaying {} reports over {:.1f}s\n", macro.steps.size(), macro.duration().count() / 1e6);
+    TRY(macro.send(writer, keys.frame, 0));
+  }
+
+  inst.paste = [&](std::string_view text) {
+    if(auto res = paster.paste(text, keys.mouse_drain); res.is_error())
+      fmt::print("{}\n", res.error().what());
+  };
+  inst.pump = [&]() { return paster.pump(writer, keys.frame); };
+
+  if(opts.paste_path) {
+    std::ifstream f(opts.paste_path, std::ios::binary);
+    if(!f) return Error::format(errno, "Failed to open {}", opts.paste_path);
+    std::string text((std::istreambuf_iterator<char>(f)), {});
+    TRY(paster.paste(text, keys.mouse_drain));
+    while(paster.pump(writer, keys.frame))
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  auto ret = opts.serve_port ? serve(opts, cap, keys, writer, metrics, inst)
+                             : present(opts, cap, keys, writer, metrics, inst);
 
-    keys.dump(stream);
+  writer.finish();
+  reader.stop();
+  telemetry.print();
+  writer.print();
+  if(inst.calibration) fmt::print("Calibration: {}\n", inst.calibration->summary());
 
-    auto end = SDL_GetPerformanceCounter();
-    int elapsed_ms = (end - start) * 1000. / SDL_GetPerformanceFrequency();
-    SDL_Delay(std::max(0, int((1000. / 120) - elapsed_ms)));
+  if(recorder) {
+    recorder->stop();
+    auto s = recorder->get_stats();
+    fmt::print("Recorded {} frames ({} keyframes, {} dropped), {} inputs ({} dropped), {} MB\n",
+               s.frames, s.keyframes, s.dropped, s.inputs, s.inputs_dropped, s.bytes >> 20);
   }
 
-  return std::nullopt;
+  return ret;
 }
 
 int main(int argc, char** argv) {
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <common/err.h>
+#include <common/stats.h>
+
+#include <fmt/core.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Where a frame's time goes, stage by stage: from the driver's capture
+// timestamp to the capture thread dequeueing it, that thread waiting on the
+// device, dequeueing and hashing, the handoff to the viewer, its texture
+// upload, render copy and present, the whole way from capture to present,
+// and the link writes of the input that follows. Each stage is only ever
+// timed by the thread that runs it, so a sample is a steady_clock read (vDSO,
+// no syscall) and a few uncontended atomic adds. Once per interval the histograms are summarised and restarted;
+// the HUD shows that summary and --metrics exports it.
+struct Metrics {
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr my_clock::duration interval = std::chrono::seconds(1);
+
+  enum Stage { CAPTURE, WAIT, DEQUEUE, HASH, HANDOFF, UPLOAD, RENDER, PRESENT, GLASS, SERIAL, STAGE_COUNT };
+  static constexpr std::array<const char*, STAGE_COUNT> stage_names = {
+    "capture", "wait", "dqbuf", "hash", "handoff", "upload", "render", "present", "glass", "serial",
+  };
+
+  // Times the scope it lives in, nothing if there are no metrics.
+  struct Timer {
+    Timer(Metrics* parent, Stage stage) : parent(parent), stage(stage) {}
+    Timer(const Timer&) = delete;
+    ~Timer() { if(parent) parent->record(stage, my_clock::now() - start); }
+
+  protected:
+    Metrics* parent;
+    Stage stage;
+    my_clock::time_point start = my_clock::now();
+  };
+
+  struct Snapshot {
+    std::chrono::duration<double> elapsed {};
+    uint64_t captured = 0;
+    uint64_t presented = 0;
+    uint64_t dropped = 0; // captured but never shown
+    uint64_t lost = 0;    // dropped by the driver, gaps in its sequence
+    std::array<LatencyHistogram::Summary, STAGE_COUNT> stages {};
+
+    double fps() const { return elapsed.count() > 0 ? presented / elapsed.count() : 0; }
+  };
+
+  // which target this is, when there are several
+  std::string name;
+
+  std::atomic<uint64_t> captured = 0;
+  std::atomic<uint64_t> presented = 0;
+  std::atomic<uint64_t> dropped = 0;
+  std::atomic<uint64_t> lost = 0;
+
+  void record(Stage s, my_clock::duration d) { stages[s].record(d); }
+
+  // The viewer uploaded a frame captured at t, the next present puts it on
+  // screen. Viewer thread only.
+  void frame_uploaded(my_clock::time_point t) {
+    if(t.time_since_epoch().count()) on_screen = t;
+  }
+
+  void frame_presented() {
+    if(!on_screen) return;
+    record(GLASS, my_clock::now() - *on_screen);
+    on_screen.reset();
+  }
+
+  // Summarise and restart once interval has passed. True if it did.
+  bool roll(bool force = false) {
+    auto now = my_clock::now();
+    if(!force && now - last_roll < interval) return false;
+
+    last.elapsed = now - last_roll;
+    last.captured = captured.exchange(0, std::memory_order_relaxed);
+    last.presented = presented.exchange(0, std::memory_order_relaxed);
+    last.dropped = dropped.exchange(0, std::memory_order_relaxed);
+    last.lost = lost.exchange(0, std::memory_order_relaxed);
+    for(int i = 0; i < STAGE_COUNT; i++) {
+      last.stages[i] = stages[i].summary();
+      stages[i].reset();
+    }
+
+    last_roll = now;
+    return true;
+  }
+
+  // the last interval rolled up
+  const Snapshot& snapshot() const { return last; }
+
+  // For the HUD: a headline and one line per stage that saw samples.
+  std::vector<std::string> lines() const {
+    std::vector<std::string> ret;
+    ret.push_back(fmt::format("{}{:.1f} fps  {} captured  {} dropped  {} lost", name.empty() ? "" : name + "  ",
+                              last.fps(), last.captured, last.dropped, last.lost));
+    ret.push_back(fmt::format("{:<8} {:>6} {:>9} {:>9}", "stage", "n", "p50 us", "p99 us"));
+    for(int i = 0; i < STAGE_COUNT; i++) {
+      auto& s = last.stages[i];
+      if(!s.count) continue;
+      ret.push_back(fmt::format("{:<8} {:>6} {:>9.1f} {:>9.1f}", stage_names[i], s.count, us(s.p50), us(s.p99)));
+    }
+    return ret;
+  }
+
+  // One line of JSON for the last interval.
+  std::string json() const {
+    auto wall = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+
+    std::string ret = fmt::format("{{\"time_ms\":{},\"target\":\"{}\",\"elapsed_s\":{:.3f},\"fps\":{:.2f},"
+                                  "\"captured\":{},\"presented\":{},\"dropped\":{},\"lost\":{},\"stages\":{{",
+                                  wall.count(), escaped(name), last.elapsed.count(), last.fps(),
+                                  last.captured, last.presented, last.dropped, last.lost);
+    for(int i = 0; i < STAGE_COUNT; i++) {
+      auto& s = last.stages[i];
+      ret += fmt::format("{}\"{}\":{{\"n\":{},\"mean_us\":{:.1f},\"p50_us\":{:.1f},\"p99_us\":{:.1f},\"max_us\":{:.1f}}}",
+                         i ? "," : "", stage_names[i], s.count, us(s.mean), us(s.p50), us(s.p99), us(s.max));
+    }
+    return ret + "}}";
+  }
+
+  void print() const {
+    for(auto& l: lines()) fmt::print("  {}\n", l);
+  }
+
+protected:
+  std::array<LatencyHistogram, STAGE_COUNT> stages;
+  my_clock::time_point last_roll = my_clock::now();
+  Snapshot last;
+  std::optional<my_clock::time_point> on_screen;
+
+  static double us(std::chrono::nanoseconds d) { return d.count() / 1e3; }
+
+  // target names are device paths, but quotes and backslashes are legal there
+  static std::string escaped(const std::string& s) {
+    std::string ret;
+    for(char c: s) {
+      if(c == '"' || c == '\\') ret += '\\';
+      if(uint8_t(c) >= 0x20) ret += c;
+    }
+    return ret;
+  }
+};
+
+// Where --metrics lines go: appended to a file, or sent to a unix socket a
+// monitor listens on (a datagram per line, or a stream). Writes never block,
+// a monitor that isn't keeping up loses lines rather than stalling the viewer.
+struct MetricsExport {
+  static ErrorOr<MetricsExport> open(const char* path) {
+    MetricsExport ret;
+
+    struct stat st;
+    if(::stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      sockaddr_un addr = { .sun_family = AF_UNIX };
+      if(strlen(path) >= sizeof(addr.sun_path)) return Error::format("Socket path {} is too long", path);
+      strcpy(addr.sun_path, path);
+
+      for(int type: { SOCK_DGRAM, SOCK_STREAM }) {
+        ret.fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(ret.fd < 0) return Error(errno, "Failed to create socket");
+        if(connect(ret.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) return ret;
+
+        int err = errno;
+        close(std::exchange(ret.fd, -1));
+        if(err != EPROTOTYPE) return Error::format(err, "Failed to connect to {}", path);
+      }
+      return Error::format("Failed to connect to {}", path);
+    }
+
+    ret.fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(ret.fd < 0) return Error::format(errno, "Failed to open {}", path);
+    return ret;
+  }
+
+  MetricsExport(MetricsExport&& o) : fd(std::exchange(o.fd, -1)), lost(o.lost) {}
+  MetricsExport(const MetricsExport&) = delete;
+  ~MetricsExport() { if(fd >= 0) close(fd); }
+
+  void write(std::string line) {
+    line += '\n';
+    if(send(fd, line.data(), line.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == ssize_t(line.size())) return;
+
+    // not a socket
+    if(errno == ENOTSOCK && ::write(fd, line.data(), line.size()) == ssize_t(line.size())) return;
+
+    if(!lost++) fmt::print("Failed to export metrics: {}\n", Error(errno, "write failed").what());
+  }
+
+  // lines that didn't make it
+  uint64_t get_lost() const { return lost; }
+
+protected:
+  int fd = -1;
+  uint64_t lost = 0;
+
+  MetricsExport() {}
+};
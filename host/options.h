@@ -0,0 +1,253 @@
+#pragma once
+
+#include "capture.h"
+
+#include <common/err.h>
+#include <common/transport.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+template <typename T>
+ErrorOr<T> parse_number(std::string_view s) {
+  T ret;
+  auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), ret);
+  if(ec != std::errc() || ptr != s.data() + s.size())
+    return Error::format("Invalid number '{}'", s);
+  return ret;
+}
+
+struct Options {
+  // a capture card (or a raw recording to replay) and the links to the pi
+  // plugged into the same machine, fastest first
+  struct Target {
+    const char* capture_device = nullptr;
+    std::vector<Transport::Spec> link;
+  };
+
+  // more than one opens an overview of all of them
+  std::vector<Target> targets;
+
+  // of the UART links, the pi's end has to match
+  uint32_t baud = Transport::default_baud;
+
+  // number of V4L2 buffers to request, at least 4 are needed so the capture
+  // thread can still dequeue while the mailbox holds three
+  uint32_t buffer_count = 4;
+  Capture::Memory memory = Capture::Memory::USERPTR;
+
+  // capture size and minimum frame rate, zero keeps the device's setting
+  Capture::Request mode;
+
+  // send mouse motion as relative deltas instead of absolute positions
+  bool relative = false;
+
+  // type on the pi's N-key rollover keyboard instead of the boot keyboard
+  bool nkro = false;
+
+  // present in step with the display instead of as soon as a frame arrives
+  bool vsync = false;
+
+  // start with the pipeline metrics shown over the video
+  bool hud = false;
+
+  // append the pipeline metrics to this file or unix socket, a JSON line per
+  // target per second
+  const char* metrics_path = nullptr;
+
+  // measure input to photon latency by tapping this HID usage, watching
+  // calibrate_region (the whole frame if empty) for the change
+  std::optional<uint8_t> calibrate;
+  Rect calibrate_region;
+
+  // record the session to this file
+  const char* record_path = nullptr;
+
+  // with whole frames, for replaying in place of the capture card
+  bool record_raw = false;
+
+  // play the input of a recording back through the pi's scheduler
+  const char* replay_path = nullptr;
+
+  // type this file's text on the target, and the target's keyboard layout
+  // for it and for right ctrl + v pastes
+  const char* paste_path = nullptr;
+  const char* layout = "us";
+
+  // stream to remote viewers on this port instead of opening a window.
+  // Viewers can type on the target, so only local ones unless an address
+  // to listen on is given.
+  uint16_t serve_port = 0;
+  std::string serve_address = "127.0.0.1";
+
+  // view a remote --serve at host:port instead of local devices
+  const char* connect = nullptr;
+
+  static constexpr const char* usage =
+    "USAGE: {} [options] <v4l2 device or raw recording> <link> [<v4l2 device> <link>...]\n"
+    "       {} [options] --connect <host:port>\n"
+    "  <link> is a comma separated list, fastest first, failed over in order:\n"
+    "    /dev/ttyUSB0, acm:/dev/ttyACM0, tcp:host:port or unix:/path\n"
+    "  --baud <n>           UART baud rate (default 115200)\n"
+    "  --buffers <n>        number of capture buffers (default and least 4, 6 with --record)\n"
+    "  --memory <mode>      capture buffer memory, userptr or mmap (default userptr)\n"
+    "  --mode <WxH[@fps]>   capture size and minimum frame rate (default: as configured)\n"
+    "  --vsync              align presentation with the display refresh\n"
+    "  --hud                show per stage timings over the video (toggle with right ctrl + h)\n"
+    "  --metrics <path>     export per stage timings as JSON lines to a file or unix socket\n"
+    "  --calibrate <key>    measure input to photon latency with a key that changes the screen\n"
+    "                       (capslock, numlock, scrolllock, space or a HID usage)\n"
+    "  --calibrate-region <WxH+X+Y> only watch this part of the screen for the change\n"
+    "  --relative           relative mouse (toggle with right ctrl + m)\n"
+    "  --nkro               N-key rollover keyboard, if the pi has one (default: 6 key boot keyboard)\n"
+    "  --record <file>      record video and input to a file\n"
+    "  --record-raw <file>  record whole frames, to use in place of the v4l2 device later\n"
+    "  --pace <pace>        replay a raw recording as recorded, fast, or at <fps> (default: recorded)\n"
+    "  --replay <file>      play back the input of a recording with its original timing\n"
+    "  --paste <file>       type a UTF-8 text file on the target (right ctrl + v pastes the clipboard)\n"
+    "  --layout <layout>    the target's keyboard layout for pasting, us or gb (default us)\n"
+    "  --serve [<addr>:]<port> stream to viewers instead of opening a window, they can send input\n"
+    "                       (default address 127.0.0.1, 0.0.0.0 to take viewers from anywhere)\n"
+    "  --connect <host:port> view a remote --serve";
+
+  static ErrorOr<Options> parse(int argc, char** argv) {
+    Options ret;
+    int positional = 0;
+    bool buffers_given = false;
+
+    for(int i = 1; i < argc; i++) {
+      std::string_view arg = argv[i];
+
+      auto value = [&]() -> ErrorOr<std::string_view> {
+        if(i + 1 >= argc) return Error::format("Missing value for {}", arg);
+        return std::string_view(argv[++i]);
+      };
+
+      if(arg == "--baud") {
+        ret.baud = TRY(parse_number<uint32_t>(TRY(value())));
+      } else if(arg == "--buffers") {
+        ret.buffer_count = TRY(parse_number<uint32_t>(TRY(value())));
+        buffers_given = true;
+      } else if(arg == "--memory") {
+        auto mode = TRY(value());
+        if(mode == "userptr") ret.memory = Capture::Memory::USERPTR;
+        else if(mode == "mmap") ret.memory = Capture::Memory::MMAP;
+        else return Error::format("Unknown memory mode {}", mode);
+      } else if(arg == "--mode") {
+        auto mode = TRY(parse_mode(TRY(value())));
+        ret.mode.width = mode.width;
+        ret.mode.height = mode.height;
+        ret.mode.fps = mode.fps;
+      } else if(arg == "--pace") {
+        auto pace = TRY(value());
+        if(pace == "recorded") ret.mode.pace = Capture::Request::Pace::RECORDED;
+        else if(pace == "fast") ret.mode.pace = Capture::Request::Pace::FAST;
+        else {
+          ret.mode.pace = Capture::Request::Pace::FIXED;
+          ret.mode.fps = TRY(parse_number<uint32_t>(pace));
+        }
+      } else if(arg == "--vsync") {
+        ret.vsync = true;
+      } else if(arg == "--hud") {
+        ret.hud = true;
+      } else if(arg == "--metrics") {
+        ret.metrics_path = TRY(value()).data();
+      } else if(arg == "--calibrate") {
+        ret.calibrate = TRY(parse_usage(TRY(value())));
+      } else if(arg == "--calibrate-region") {
+        ret.calibrate_region = TRY(parse_region(TRY(value())));
+      } else if(arg == "--relative") {
+        ret.relative = true;
+      } else if(arg == "--nkro") {
+        ret.nkro = true;
+      } else if(arg == "--record") {
+        ret.record_path = TRY(value()).data();
+      } else if(arg == "--record-raw") {
+        ret.record_path = TRY(value()).data();
+        ret.record_raw = true;
+      } else if(arg == "--replay") {
+        ret.replay_path = TRY(value()).data();
+      } else if(arg == "--paste") {
+        ret.paste_path = TRY(value()).data();
+      } else if(arg == "--layout") {
+        ret.layout = TRY(value()).data();
+      } else if(arg == "--serve") {
+        auto v = TRY(value());
+        auto colon = v.rfind(':');
+        if(colon != std::string_view::npos) {
+          ret.serve_address = v.substr(0, colon);
+          v.remove_prefix(colon + 1);
+        }
+        ret.serve_port = TRY(parse_number<uint16_t>(v));
+      } else if(arg == "--connect") {
+        ret.connect = TRY(value()).data();
+      } else if(arg.starts_with("--")) {
+        return Error::format("Unknown option {}", arg);
+      } else if(positional++ % 2 == 0) {
+        ret.targets.push_back({ .capture_device = argv[i] });
+      } else {
+        ret.targets.back().link = TRY(Transport::Spec::parse_list(arg));
+      }
+    }
+
+    if(ret.connect ? positional != 0 : positional < 2 || positional % 2)
+      return Error::format(usage, argv[0], argv[0]);
+
+    if(ret.targets.size() > 1 && (ret.record_path || ret.replay_path || ret.serve_port))
+      return Error("--record, --replay and --serve take a single target");
+
+    if(ret.calibrate && (ret.targets.size() != 1 || ret.serve_port))
+      return Error("--calibrate needs a single local target and a window");
+
+    // the recorder's sink can pin two more buffers
+    uint32_t min_buffers = ret.record_path ? 6 : 4;
+    if(buffers_given && ret.buffer_count < min_buffers)
+      return Error::format("--buffers {} is too few, capture needs at least {}{}", ret.buffer_count, min_buffers,
+                           ret.record_path ? " with --record" : "");
+    ret.buffer_count = std::max(ret.buffer_count, min_buffers);
+    return ret;
+  }
+
+  static ErrorOr<Capture::Request> parse_mode(std::string_view s) {
+    Capture::Request ret;
+
+    if(auto at = s.find('@'); at != s.npos) {
+      ret.fps = TRY(parse_number<uint32_t>(s.substr(at + 1)));
+      s = s.substr(0, at);
+    }
+
+    auto x = s.find('x');
+    if(x == s.npos) return Error::format("Invalid mode '{}', expected WxH[@fps]", s);
+
+    ret.width = TRY(parse_number<uint32_t>(s.substr(0, x)));
+    ret.height = TRY(parse_number<uint32_t>(s.substr(x + 1)));
+    return ret;
+  }
+
+  static ErrorOr<uint8_t> parse_usage(std::string_view s) {
+    if(s == "capslock") return uint8_t(0x39);
+    if(s == "numlock") return uint8_t(0x53);
+    if(s == "scrolllock") return uint8_t(0x47);
+    if(s == "space") return uint8_t(0x2C);
+    return parse_number<uint8_t>(s);
+  }
+
+  // X style geometry, WxH+X+Y
+  static ErrorOr<Rect> parse_region(std::string_view s) {
+    auto x = s.find('x'), plus = s.find('+'), plus2 = plus == s.npos ? s.npos : s.find('+', plus + 1);
+    if(x == s.npos || plus == s.npos || plus2 == s.npos || x > plus)
+      return Error::format("Invalid region '{}', expected WxH+X+Y", s);
+
+    return Rect {
+      .x = TRY(parse_number<int>(s.substr(plus + 1, plus2 - plus - 1))),
+      .y = TRY(parse_number<int>(s.substr(plus2 + 1))),
+      .w = TRY(parse_number<int>(s.substr(0, x))),
+      .h = TRY(parse_number<int>(s.substr(x + 1, plus - x - 1))),
+    };
+  }
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+// Grid layout of the multi-target overview: one cell per target in the order
+// they were given, filled row by row.
+struct Overview {
+  static constexpr int margin = 4;
+
+  int count;
+  int cols;
+  int rows;
+
+  explicit Overview(int count)
+    : count(count), cols(int(std::ceil(std::sqrt(count)))), rows((count + cols - 1) / cols) {}
+
+  // Where a w x h image goes in cell i, letterboxed to keep its aspect.
+  SDL_Rect place(int i, int win_w, int win_h, int w, int h) const {
+    int cell_w = win_w / cols, cell_h = win_h / rows;
+    double scale = std::min(double(cell_w - 2 * margin) / w, double(cell_h - 2 * margin) / h);
+    int dw = std::max(1, int(w * scale)), dh = std::max(1, int(h * scale));
+
+    return { (i % cols) * cell_w + (cell_w - dw) / 2, (i / cols) * cell_h + (cell_h - dh) / 2, dw, dh };
+  }
+
+  std::optional<int> hit(int x, int y, int win_w, int win_h) const {
+    int col = x * cols / std::max(win_w, 1), row = y * rows / std::max(win_h, 1);
+    int i = row * cols + col;
+    if(col < 0 || col >= cols || row < 0 || row >= rows || i >= count) return std::nullopt;
+    return i;
+  }
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "macro.h"
+
+#include <common/err.h>
+#include <common/msg.h>
+
+#include <fmt/core.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Typing text into the target: UTF-8 is mapped through a keyboard layout to
+// key strokes, and the strokes to the fewest reports that type them. The
+// reports go to the pi as one macro (see macro.h) spaced by the target's poll
+// interval, so they're played as fast as it takes them without the host's
+// loop or the link in between. The macro is uploaded a few frames per turn of
+// the host's loop, which holds other input back meanwhile.
+namespace paste {
+  // left shift and right alt (AltGr) as bits of the modifier byte
+  static constexpr uint8_t SHIFT = 1 << 1;
+  static constexpr uint8_t ALTGR = 1 << 6;
+
+  struct Stroke {
+    uint8_t usage = 0; // 0 if there's no key for it
+    uint8_t mods = 0;
+  };
+
+  // Where the target's keyboard layout puts each character.
+  struct Layout {
+    std::array<Stroke, 128> ascii {};
+    std::vector<std::pair<char32_t, Stroke>> other;
+
+    std::optional<Stroke> find(char32_t c) const {
+      if(c < ascii.size()) {
+        if(!ascii[c].usage) return std::nullopt;
+        return ascii[c];
+      }
+      for(auto& [k, s]: other)
+        if(k == c) return s;
+      return std::nullopt;
+    }
+
+    void set(char32_t c, uint8_t usage, uint8_t mods = 0) {
+      if(c < ascii.size()) ascii[c] = { usage, mods };
+      else other.push_back({ c, { usage, mods } });
+    }
+
+    static Layout us() {
+      Layout ret;
+      for(int i = 0; i < 26; i++) {
+        ret.set('a' + i, 0x04 + i);
+        ret.set('A' + i, 0x04 + i, SHIFT);
+      }
+
+      static constexpr std::string_view digits = "1234567890", shifted_digits = "!@#$%^&*()";
+      for(size_t i = 0; i < digits.size(); i++) {
+        ret.set(digits[i], 0x1E + i);
+        ret.set(shifted_digits[i], 0x1E + i, SHIFT);
+      }
+
+      // - = [ ] \ ; ' ` , . / and their shifted characters
+      static constexpr std::string_view punct = "-=[]\\;'`,./", shifted_punct = "_+{}|:\"~<>?";
+      static constexpr std::array<uint8_t, 11> punct_usages = {
+        0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38,
+      };
+      for(size_t i = 0; i < punct.size(); i++) {
+        ret.set(punct[i], punct_usages[i]);
+        ret.set(shifted_punct[i], punct_usages[i], SHIFT);
+      }
+
+      ret.set(' ', 0x2C);
+      ret.set('\n', 0x28);
+      ret.set('\t', 0x2B);
+      return ret;
+    }
+
+    // UK: " and @ swap places, # and ~ move to the key left of enter, \ and |
+    // to the one left of z
+    static Layout gb() {
+      Layout ret = us();
+      ret.set('"', 0x1F, SHIFT);
+      ret.set('@', 0x34, SHIFT);
+      ret.set('#', 0x32);
+      ret.set('~', 0x32, SHIFT);
+      ret.set('\\', 0x64);
+      ret.set('|', 0x64, SHIFT);
+      ret.set(U'£', 0x20, SHIFT);
+      ret.set(U'¬', 0x35, SHIFT);
+      ret.set(U'€', 0x21, ALTGR);
+      return ret;
+    }
+
+    static ErrorOr<Layout> named(std::string_view name) {
+      if(name == "us") return us();
+      if(name == "gb" || name == "uk") return gb();
+      return Error::format("Unknown keyboard layout {}, expected us or gb", name);
+    }
+  };
+
+  struct Typed {
+    Macro macro;
+    size_t chars = 0;   // typed
+    size_t skipped = 0; // no key in the layout, or not UTF-8
+  };
+
+  inline keyboard_nkro_t report(uint8_t usage, uint8_t mods) {
+    keyboard_nkro_t ret {};
+    if(usage) ret[usage / 8] |= 1 << usage % 8;
+    ret[NKRO_MODIFIERS] = mods;
+    return ret;
+  }
+
+  // Next code point of s, or nullopt and one byte eaten if it isn't UTF-8.
+  inline std::optional<char32_t> next_utf8(std::string_view& s) {
+    uint8_t c = s[0];
+    int n = c < 0x80 ? 0 : (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : -1;
+    if(n < 0 || s.size() <= size_t(n)) {
+      s.remove_prefix(1);
+      return std::nullopt;
+    }
+
+    char32_t ret = n ? c & (0x3F >> n) : c;
+    for(int i = 1; i <= n; i++) {
+      if((uint8_t(s[i]) & 0xC0) != 0x80) {
+        s.remove_prefix(1);
+        return std::nullopt;
+      }
+      ret = ret << 6 | (s[i] & 0x3F);
+    }
+
+    s.remove_prefix(n + 1);
+    return ret;
+  }
+
+  // One report per stroke, with the key of the one before it let go in the
+  // same report. A release report only goes in between when the same key
+  // comes twice in a row, or the modifiers change: they're switched with no
+  // key down, so no target sees the new key with the old modifiers. \r is
+  // dropped, \r\n is one enter.
+  inline Typed type(std::string_view text, const Layout& layout, std::chrono::microseconds interval) {
+    Typed ret;
+    std::optional<Stroke> prev;
+    std::chrono::microseconds at {};
+
+    auto put = [&](uint8_t usage, uint8_t mods) {
+      ret.macro.steps.push_back({ at, report(usage, mods) });
+      at += interval;
+    };
+
+    while(!text.empty()) {
+      auto c = next_utf8(text);
+      if(c == U'\r') continue;
+
+      auto s = c ? layout.find(*c) : std::nullopt;
+      if(!s) {
+        ret.skipped++;
+        continue;
+      }
+
+      if(prev && (prev->usage == s->usage || prev->mods != s->mods)) put(0, s->mods);
+      put(s->usage, s->mods);
+      prev = s;
+      ret.chars++;
+    }
+
+    if(prev) put(0, 0);
+    return ret;
+  }
+
+  // Pastes on one pi and says how fast it went when the pi is done. Reports
+  // are spaced by the target's mouse poll interval, the only one the pi
+  // measures without typing. A keyboard endpoint polled slower doesn't lose
+  // keys to its queue's cap: the pi's scheduler holds the macro back while
+  // the queue is backed up, so it only makes the paste take longer.
+  struct Paster {
+    static constexpr uint8_t macro_id = 1;
+    // until the pi has measured the target, full speed USB's default
+    static constexpr auto default_interval = std::chrono::microseconds(4000);
+
+    using my_clock = std::chrono::steady_clock;
+
+    Layout layout;
+    uint32_t caps = 0; // the pi's
+
+    Paster(Layout layout, uint32_t caps) : layout(std::move(layout)), caps(caps) {}
+
+    // Start a paste, pump() then uploads it. interval_us is the target's
+    // poll interval, 0 if not known yet.
+    ErrorOr<void> paste(std::string_view text, uint32_t interval_us) {
+      if(!(caps & CAP_MACRO)) return Error("The pi can't play macros, update harness_server");
+      if(upload) return Error("The last paste is still uploading");
+
+      auto interval = interval_us ? std::chrono::microseconds(interval_us) : default_interval;
+      auto typed = type(text, layout, interval);
+      if(typed.skipped) fmt::print("Paste: {} characters have no key in the layout, skipped\n", typed.skipped);
+      if(!typed.chars) return {};
+      if(typed.macro.steps.size() > max_reports)
+        return Error::format("Paste of {} characters is too long, the pi takes {} reports", typed.chars, max_reports);
+
+      if(!(caps & CAP_NKRO)) typed.macro.boot_only();
+      chars = typed.chars;
+      started = my_clock::now().time_since_epoch().count();
+      upload.emplace(std::move(typed.macro), macro_id);
+      return {};
+    }
+
+    // Upload some more of the paste, from the thread that writes to stream.
+    // True while there's more to go: hold other input back until then, or
+    // the pi would record it into the paste.
+    bool pump(auto& stream, FrameWriter& frame) {
+      if(!upload) return false;
+
+      auto res = upload->pump(stream, frame);
+      if(res.is_error()) {
+        fmt::print("Paste failed: {}\n", res.error().what());
+        chars = 0;
+      } else if(!res.release_value()) {
+        return true;
+      }
+
+      upload.reset();
+      return false;
+    }
+
+    bool uploading() const { return upload.has_value(); }
+
+    // From LinkReader::on_macro_done. Every paste reuses macro_id, so a new
+    // one cancels the one still playing; that completion belongs to a paste
+    // that's been superseded, the new one reports when it's done.
+    void on_done(const macro_done_t& d) {
+      if(d.id != macro_id || d.status == MACRO_CANCELLED) return;
+      size_t n = chars.exchange(0);
+      if(!n) return;
+
+      if(d.status == MACRO_ABORTED && d.reports) {
+        fmt::print("Paste of {} characters stopped after {} reports, the target isn't taking them\n", n, d.reports);
+        return;
+      }
+
+      if(d.status == MACRO_ABORTED) {
+        fmt::print("Paste of {} characters didn't reach the pi whole or the target took none of it, nothing was typed\n", n);
+        return;
+      }
+
+      std::chrono::duration<double> total = my_clock::now() - my_clock::time_point(my_clock::duration(started.load()));
+      fmt::print("Pasted {} characters in {:.2f}s, {:.0f} chars/s ({:.0f} chars/s played)\n", n, total.count(),
+                 n / total.count(), d.duration ? n * 1e6 / d.duration : 0.0);
+    }
+
+  protected:
+    // Scheduler::max_steps on the pi
+    static constexpr size_t max_reports = 1 << 16;
+
+    std::optional<MacroUpload> upload;
+    std::atomic<size_t> chars = 0;
+    std::atomic<my_clock::rep> started = 0;
+  };
+}
@@ -0,0 +1,83 @@
+// Measures input latency against a running harness_server without a capture
+// card or window, e.g. over a pty pair in CI:
+//
+//   socat pty,link=/tmp/host,raw pty,link=/tmp/pi,raw &
+//   harness_server /tmp/pi /dev/null /dev/null &
+//   harness_probe /tmp/host
+//
+// or with no pty at all, over a unix socket:
+//
+//   harness_server unix:/tmp/harness.sock /dev/null /dev/null &
+//   harness_probe unix:/tmp/harness.sock
+//
+// Sends stamped empty keyboard reports, which are harmless on a real target.
+#include "link.h"
+#include "options.h"
+#include "telemetry.h"
+
+#include <common/transport.h>
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include <thread>
+
+ErrorOr<void> go(int argc, char** argv) {
+  if(argc < 2) return Error::format("USAGE: {} <link> [reports per second] [seconds]", argv[0]);
+
+  int rate = argc > 2 ? TRY(parse_number<int>(argv[2])) : 100;
+  int seconds = argc > 3 ? TRY(parse_number<int>(argv[3])) : 10;
+  if(rate <= 0) return Error("Rate must be positive");
+
+  asio::io_service service;
+  Transport stream(service, TRY(Transport::Spec::parse_list(argv[1])));
+  TRY(stream.connect());
+
+  FrameWriter frame;
+  auto link = TRY(handshake(service, stream, frame, std::chrono::seconds(1)));
+  if(!(link.caps & CAP_TELEMETRY))
+    return Error("The pi doesn't support telemetry");
+
+  Telemetry telemetry;
+  LinkWriter writer(service, stream);
+  LinkReader reader(service, stream, telemetry);
+  reader.on_reconnect = [&]() { writer.resume(); };
+  reader.start();
+
+  using my_clock = std::chrono::steady_clock;
+  auto period = std::chrono::duration_cast<my_clock::duration>(std::chrono::seconds(1)) / rate;
+  auto next = my_clock::now();
+  auto end = next + std::chrono::seconds(seconds);
+
+  while(next < end) {
+    frame.add(stamp_t{ stamp_now() });
+    frame.add(keyboard_t{});
+
+    auto bytes = frame.finish();
+    writer.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    writer.flush();
+
+    next += period;
+    std::this_thread::sleep_until(next);
+  }
+
+  // let the last echoes come back
+  writer.finish();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  reader.stop();
+
+  telemetry.print();
+  writer.print();
+  return {};
+}
+
+int main(int argc, char** argv) {
+  auto ret = go(argc, argv);
+
+  if(ret.is_error()) {
+    fmt::print("{}\n", ret.error().what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,422 @@
+#pragma once
+
+#include "async_capture.h"
+#include "tile_codec.h"
+#include "tiles.h"
+
+#include <common/err.h>
+#include <fmt/core.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Records a session to disk off the capture and display paths. Frames come in
+// through their own capture sink and are delta encoded on the recorder's
+// thread: only tiles that changed since the last recorded frame are stored,
+// with a keyframe every couple of seconds so playback can seek. Input
+// reports sent to the pi go into the same file, stamped on the same clock.
+//
+// Chunks are packed into large aligned segments, which a second thread writes
+// with O_DIRECT. Segments come from a fixed pool; when the disk can't keep up
+// and the pool runs dry, frames are dropped (and counted) rather than letting
+// anything upstream wait.
+//
+// The file is a chunk stream as described in tile_codec.h. It starts with a
+// FILE_HEADER chunk and ends with an INDEX chunk of IndexEntry and a TRAILER
+// chunk holding the index offset. A raw recording stores every frame whole as
+// a RAW_FRAME chunk instead, for FileSource to replay; it's large, but costs
+// no more than a copy to make.
+struct Recorder {
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr uint32_t MAGIC = 'H' | 'R' << 8 | 'E' << 16 | 'C' << 24;
+  static constexpr uint32_t VERSION = 1;
+
+  using ChunkType = codec::ChunkType;
+  using ChunkHeader = codec::ChunkHeader;
+
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    int64_t start_unix_ns;
+  };
+
+  struct IndexEntry {
+    uint32_t seq;
+    uint32_t key;
+    int64_t time;
+    uint64_t offset; // of the FRAME chunk
+  };
+
+  // INPUT payloads are a sequence of these, each followed by len bytes of wire frame
+  struct InputRecord {
+    int64_t time;
+    uint16_t len;
+  } __attribute__((packed));
+
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t keyframes = 0;
+    uint64_t dropped = 0;        // no room in the segment pool, or replaced before we got to it
+    uint64_t tiles = 0;
+    uint64_t inputs = 0;
+    uint64_t inputs_dropped = 0;
+    uint64_t bytes = 0;
+    uint64_t write_errors = 0;
+  };
+
+  static constexpr size_t segment_size = 4 << 20;
+  static constexpr size_t segment_count = 8;
+  static constexpr size_t max_pending_input = 64 << 10;
+  static constexpr auto keyframe_interval = std::chrono::seconds(2);
+
+  Recorder(AsyncCapture::Sink& sink) : sink(sink) {}
+  Recorder(const Recorder&) = delete;
+  ~Recorder() { stop(); }
+
+  // Call before the capture is started.
+  ErrorOr<void> start(const char* path, bool raw = false) {
+    this->raw = raw;
+
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if(fd < 0 && errno == EINVAL) // filesystem without O_DIRECT (tmpfs)
+      fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+      return Error::format(errno, "Failed to open {}", path);
+
+    for(size_t i = 0; i < segment_count; i++) {
+      void* p = aligned_alloc(alignment, segment_size);
+      if(!p) return Error(ENOMEM, "Failed to allocate recording segment");
+      segments.emplace_back(static_cast<std::byte*>(p), segment_size, false);
+      free_segments.push_back(&segments.back());
+    }
+
+    start_time = my_clock::now();
+    int64_t unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+    chunk(codec::FILE_HEADER, 0, FileHeader{ MAGIC, VERSION, unix_ns });
+
+    sink.on_frame([this]() {
+      wake_up();
+      return true;
+    });
+
+    running = true;
+    writer = std::jthread([this]() { write_segments(); });
+    encoder = std::jthread([this]() { encode_frames(); });
+    return {};
+  }
+
+  // Finish the file: flush what's queued, then write the index and trailer.
+  void stop() {
+    if(!encoder.joinable()) return;
+
+    running = false;
+    wake_up();
+    encoder.join();
+
+    uint64_t index_offset = offset;
+    chunk_header(codec::INDEX, 0, index.size() * sizeof(IndexEntry), true);
+    append(index.data(), index.size() * sizeof(IndexEntry), true);
+    chunk(codec::TRAILER, 0, index_offset, true);
+
+    {
+      std::lock_guard lock(mutex);
+      if(current) full_segments.push_back({ current, used });
+      current = nullptr;
+      finishing = true;
+    }
+    cv.notify_all();
+    writer.join();
+
+    // the last segment went out padded to the block size
+    if(ftruncate(fd, offset) < 0) stats.write_errors++;
+    close(fd);
+
+    stats.bytes = offset;
+    stats.dropped += sink.dropped();
+  }
+
+  // Queue a wire frame sent to the pi. Safe from any thread, never waits on
+  // the disk.
+  void record_input(std::span<const uint8_t> data) {
+    auto now = since_start(my_clock::now());
+    {
+      std::lock_guard lock(input_mutex);
+      if(pending_input.size() + sizeof(InputRecord) + data.size() > max_pending_input) {
+        inputs_dropped++;
+        return;
+      }
+
+      InputRecord r = { now, uint16_t(data.size()) };
+      auto* p = reinterpret_cast<const uint8_t*>(&r);
+      pending_input.insert(pending_input.end(), p, p + sizeof(r));
+      pending_input.insert(pending_input.end(), data.begin(), data.end());
+    }
+    wake_up();
+  }
+
+  // only consistent once stopped
+  Stats get_stats() const {
+    Stats ret = stats;
+    std::lock_guard lock(input_mutex);
+    ret.inputs_dropped = inputs_dropped;
+    return ret;
+  }
+
+protected:
+  static constexpr size_t alignment = 4096;
+
+  struct Full {
+    BufferSpan* segment;
+    size_t used;
+  };
+
+  AsyncCapture::Sink& sink;
+  bool raw = false;
+  int fd = -1;
+  my_clock::time_point start_time;
+
+  std::atomic<bool> running = false;
+  std::atomic<bool> wake = false;
+  std::jthread encoder;
+  std::jthread writer;
+
+  // segments, shared with the writer thread
+  std::deque<BufferSpan> segments;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<BufferSpan*> free_segments;
+  std::deque<Full> full_segments;
+  bool finishing = false;
+
+  // encoder thread state
+  BufferSpan* current = nullptr;
+  size_t used = 0;
+  uint64_t offset = 0;
+  Stats stats;
+
+  tiles::DirtyTracker tracker;
+  codec::Encoder encoder_state;
+  codec::Format format {};
+  my_clock::time_point last_key;
+  bool need_key = true;
+  std::vector<IndexEntry> index;
+  std::vector<uint8_t> input;
+
+  mutable std::mutex input_mutex;
+  std::vector<uint8_t> pending_input;
+  uint64_t inputs_dropped = 0;
+
+  int64_t since_start(my_clock::time_point t) const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - start_time).count();
+  }
+
+  void wake_up() {
+    wake.store(true, std::memory_order_release);
+    wake.notify_one();
+  }
+
+  void encode_frames() {
+    while(true) {
+      wake.wait(false, std::memory_order_acquire);
+      wake.store(false, std::memory_order_relaxed);
+
+      write_input();
+
+      if(auto* f = sink.pop(); f && f->buf) {
+        encode(*f);
+        f->buf.reset();
+      }
+
+      if(!running) break;
+    }
+
+    write_input();
+  }
+
+  void write_input() {
+    {
+      std::lock_guard lock(input_mutex);
+      input.swap(pending_input);
+    }
+    if(input.empty()) return;
+
+    uint64_t count = 0;
+    for(size_t i = 0; i < input.size(); i += sizeof(InputRecord) + reinterpret_cast<InputRecord*>(&input[i])->len)
+      count++;
+
+    if(sizeof(ChunkHeader) + input.size() > room()) {
+      std::lock_guard lock(input_mutex);
+      inputs_dropped += count;
+    } else {
+      chunk_header(codec::INPUT, reinterpret_cast<InputRecord*>(input.data())->time, input.size());
+      append(input.data(), input.size());
+      stats.inputs += count;
+    }
+    input.clear();
+  }
+
+  void encode(const AsyncCapture::Frame& f) {
+    auto view = f.buf->view();
+    int64_t time = since_start(f.time);
+
+    auto fmt = codec::format_of(view);
+    if(fmt != format) {
+      if(sizeof(ChunkHeader) + sizeof(fmt) > room()) {
+        stats.dropped++;
+        return;
+      }
+      chunk(codec::FORMAT, time, fmt);
+      format = fmt;
+      need_key = true;
+    }
+
+    if(raw) {
+      encode_raw(f, view, time);
+      return;
+    }
+
+    // unchanged frames still get a (tiny) chunk, so the index has every frame
+    bool key = need_key || f.time - last_key >= keyframe_interval;
+    if(key) tracker.invalidate();
+    tracker.update(f.tiles);
+
+    size_t size = encoder_state.prepare(view, tracker, f.seq, key);
+    if(sizeof(ChunkHeader) + size > room()) {
+      // the next frame has to be diffed against something that made it to disk
+      stats.dropped++;
+      need_key = true;
+      return;
+    }
+
+    index.push_back({ f.seq, key, time, offset });
+    chunk_header(codec::FRAME, time, size);
+    encoder_state.write([this](const void* p, size_t n) { append(p, n); });
+
+    stats.frames++;
+    stats.tiles += tracker.dirty_count();
+    if(key) {
+      stats.keyframes++;
+      last_key = f.time;
+      need_key = false;
+    }
+  }
+
+  void encode_raw(const AsyncCapture::Frame& f, const FrameView& view, int64_t time) {
+    codec::RawFrameHeader h = { f.seq, uint32_t(view.planes[0].stride) };
+    size_t luma = size_t(h.stride) * view.height;
+    size_t size = codec::raw_size(view.format, view.height, h.stride);
+
+    if(sizeof(ChunkHeader) + sizeof(h) + size > room()) {
+      stats.dropped++;
+      return;
+    }
+
+    index.push_back({ f.seq, 1, time, offset });
+    chunk_header(codec::RAW_FRAME, time, sizeof(h) + size);
+    append(&h, sizeof(h));
+    append(view.planes[0].data, luma);
+    if(size > luma) append(view.planes[1].data, size - luma);
+
+    stats.frames++;
+    stats.keyframes++;
+  }
+
+  // bytes that can be appended right now without waiting for the disk
+  size_t room() {
+    std::lock_guard lock(mutex);
+    return (current ? segment_size - used : 0) + free_segments.size() * segment_size;
+  }
+
+  void chunk_header(ChunkType type, int64_t time, size_t size, bool wait = false) {
+    ChunkHeader h = { type, uint32_t(size), time };
+    append(&h, sizeof(h), wait);
+  }
+
+  template <typename T>
+  void chunk(ChunkType type, int64_t time, const T& payload, bool wait = false) {
+    chunk_header(type, time, sizeof(T), wait);
+    append(&payload, sizeof(T), wait);
+  }
+
+  // Copy into the current segment, handing it to the writer when it fills up.
+  // Callers check room() first unless they're allowed to wait.
+  void append(const void* data, size_t n, bool wait = false) {
+    auto* p = static_cast<const std::byte*>(data);
+    offset += n;
+
+    while(n) {
+      if(!current) {
+        std::unique_lock lock(mutex);
+        if(wait) cv.wait(lock, [this]() { return !free_segments.empty(); });
+        current = free_segments.back();
+        free_segments.pop_back();
+        used = 0;
+      }
+
+      size_t len = std::min(n, segment_size - used);
+      std::memcpy(current->data() + used, p, len);
+      used += len;
+      p += len;
+      n -= len;
+
+      if(used == segment_size) {
+        {
+          std::lock_guard lock(mutex);
+          full_segments.push_back({ current, used });
+        }
+        cv.notify_all();
+        current = nullptr;
+      }
+    }
+  }
+
+  void write_segments() {
+    uint64_t pos = 0;
+
+    while(true) {
+      Full seg;
+      {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [this]() { return !full_segments.empty() || finishing; });
+        if(full_segments.empty()) return;
+
+        seg = full_segments.front();
+        full_segments.pop_front();
+      }
+
+      // O_DIRECT wants whole blocks, the file is truncated to size at the end
+      size_t len = (seg.used + alignment - 1) / alignment * alignment;
+      std::memset(seg.segment->data() + seg.used, 0, len - seg.used);
+
+      for(size_t done = 0; done < len;) {
+        ssize_t rc = pwrite(fd, seg.segment->data() + done, len - done, pos + done);
+        if(rc < 0 && errno == EINTR) continue;
+        if(rc <= 0) {
+          if(!stats.write_errors++)
+            fmt::print("Recording write failed: {}\n", strerror(errno));
+          break;
+        }
+        done += rc;
+      }
+      pos += seg.used;
+
+      {
+        std::lock_guard lock(mutex);
+        free_segments.push_back(seg.segment);
+      }
+      cv.notify_all();
+    }
+  }
+};
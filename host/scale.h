@@ -0,0 +1,191 @@
+#pragma once
+
+#include "convert.h"
+#include "frame.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Box filtered downscaling by a power of two, for overview thumbnails. Source
+// rows are summed into 16 bit accumulators, which is the only pass that reads
+// every source byte and the one that's vectorised; the horizontal pass then
+// only sees 1/factor of the data. Works in the capture's own format, so a
+// thumbnail is uploaded like any other frame.
+namespace scale {
+
+static constexpr int max_factor = 16; // 16 * 16 * 255 still fits in 16 bits
+
+using Accumulate = void(*)(const uint8_t* row, int bytes, uint16_t* acc);
+
+namespace scalar {
+
+inline void accumulate(const uint8_t* row, int bytes, uint16_t* acc) {
+  for(int i = 0; i < bytes; i++)
+    acc[i] += row[i];
+}
+
+}
+
+#ifdef CONVERT_AVX2
+namespace avx2 {
+
+__attribute__((target("avx2")))
+inline void accumulate(const uint8_t* row, int bytes, uint16_t* acc) {
+  int i = 0;
+  for(; i + 16 <= bytes; i += 16) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+    __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), _mm256_add_epi16(a, d));
+  }
+  scalar::accumulate(row + i, bytes - i, acc + i);
+}
+
+}
+#endif
+
+#ifdef CONVERT_NEON
+namespace neon {
+
+inline void accumulate(const uint8_t* row, int bytes, uint16_t* acc) {
+  int i = 0;
+  for(; i + 16 <= bytes; i += 16) {
+    uint8x16_t d = vld1q_u8(row + i);
+    vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(d)));
+    vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(d)));
+  }
+  scalar::accumulate(row + i, bytes - i, acc + i);
+}
+
+}
+#endif
+
+inline Accumulate best() {
+#if defined(CONVERT_AVX2)
+  static const Accumulate ret = __builtin_cpu_supports("avx2") ? avx2::accumulate : scalar::accumulate;
+  return ret;
+#elif defined(CONVERT_NEON)
+  return neon::accumulate;
+#else
+  return scalar::accumulate;
+#endif
+}
+
+// Bytes that are averaged together horizontally: a pixel, an NV12 chroma
+// pair, or a packed YUV macropixel.
+inline int element_bytes(uint32_t fourcc) {
+  switch(fourcc) {
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY: return 4;
+  default: return convert::bytes_per_pixel(fourcc);
+  }
+}
+
+// Smallest power of two that fits width into max_width.
+inline int factor_for(int width, int max_width) {
+  int f = 1;
+  while(f < max_factor && width / f > max_width) f *= 2;
+  return f;
+}
+
+// A downscaled copy of a frame that's kept up to date one rect at a time.
+struct Thumbnail {
+  void resize(uint32_t fourcc, int src_width, int src_height, int factor) {
+    format = fourcc;
+    this->src_width = src_width;
+    this->src_height = src_height;
+    this->factor = factor;
+    shift = std::countr_zero(unsigned(factor)) * 2;
+
+    // even, so chroma and macropixels never get split
+    width = (src_width / factor) & ~1;
+    height = (src_height / factor) & ~1;
+    stride = width * convert::bytes_per_pixel(fourcc);
+
+    size_t size = size_t(stride) * height;
+    if(format == V4L2_PIX_FMT_NV12) size += size / 2;
+    image.assign(size, std::byte(0));
+  }
+
+  int get_width() const { return width; }
+  int get_height() const { return height; }
+
+  // false once the source changed mode, update() would read past its frame
+  bool fits(const FrameView& src) const {
+    return src.format == format && src.width == src_width && src.height == src_height;
+  }
+
+  FrameView view() const {
+    if(format == V4L2_PIX_FMT_NV12)
+      return FrameView::nv12(image, width, height, stride);
+    return FrameView::packed(format, image, width, height, stride);
+  }
+
+  // Downscale the given rects of src (all of it if empty) and return what
+  // changed, in thumbnail pixels.
+  const std::vector<Rect>& update(const FrameView& src, std::span<const Rect> rects, Accumulate f = best()) {
+    Rect full = { 0, 0, src.width, src.height };
+    if(rects.empty()) rects = std::span(&full, 1);
+
+    auto dst = view();
+    int bpp = convert::bytes_per_pixel(format), elem = element_bytes(format);
+    changed.clear();
+
+    for(auto& r: rects) {
+      int x0 = r.x / factor & ~1, x1 = std::min(width, ((r.x + r.w + factor - 1) / factor + 1) & ~1);
+      int y0 = r.y / factor & ~1, y1 = std::min(height, ((r.y + r.h + factor - 1) / factor + 1) & ~1);
+      if(x0 >= x1 || y0 >= y1) continue;
+
+      box(src.planes[0], dst.planes[0], x0 * bpp, x1 * bpp, y0, y1, elem, f);
+      if(format == V4L2_PIX_FMT_NV12)
+        box(src.planes[1], dst.planes[1], x0, x1, y0 / 2, y1 / 2, 2, f);
+
+      changed.push_back({ x0, y0, x1 - x0, y1 - y0 });
+    }
+
+    return changed;
+  }
+
+protected:
+  uint32_t format = 0;
+  int src_width = 0;
+  int src_height = 0;
+  int factor = 1;
+  int shift = 0;
+  int width = 0;
+  int height = 0;
+  int stride = 0;
+  std::vector<std::byte> image;
+  std::vector<uint16_t> acc;
+  std::vector<Rect> changed;
+
+  // Rows [y0, y1) and bytes [b0, b1) of a destination plane, each element
+  // the average of a factor x factor block of source elements.
+  void box(const FrameView::Plane& src, const FrameView::Plane& dst, int b0, int b1, int y0, int y1, int elem, Accumulate f) {
+    int span = (b1 - b0) * factor;
+    acc.resize(span);
+
+    for(int y = y0; y < y1; y++) {
+      std::fill(acc.begin(), acc.end(), 0);
+      for(int i = 0; i < factor; i++) {
+        auto* row = reinterpret_cast<const uint8_t*>(src.data) + size_t(src.stride) * (y * factor + i) + b0 * factor;
+        f(row, span, acc.data());
+      }
+
+      auto* out = reinterpret_cast<uint8_t*>(const_cast<std::byte*>(dst.data)) + size_t(dst.stride) * y + b0;
+      for(int b = 0; b < b1 - b0; b += elem) {
+        const uint16_t* block = acc.data() + b * factor;
+        for(int k = 0; k < elem; k++) {
+          unsigned sum = 0;
+          for(int g = 0; g < factor; g++)
+            sum += block[g * elem + k];
+          out[b + k] = uint8_t((sum + (1u << shift >> 1)) >> shift);
+        }
+      }
+    }
+  }
+};
+
+}
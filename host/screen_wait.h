@@ -0,0 +1,343 @@
+#pragma once
+
+#include "convert.h"
+#include "frame.h"
+#include "tiles.h"
+
+#include <common/err.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Waiting for the target's screen instead of sleeping: until a region of it
+// matches a reference image, or until anything in a region changes. Frames
+// are checked on the capture thread as they're published, straight from the
+// driver's buffer, against the luma of the frame (the Y plane of NV12, every
+// other byte of packed 4:2:2). Matching is the mean absolute difference over
+// the region, summed with vector SAD instructions where there are some, and
+// given up on as soon as a row puts it over the tolerance.
+namespace match {
+
+// sum of absolute differences of n bytes
+using SadRow = uint64_t(*)(const uint8_t* a, const uint8_t* b, int n);
+
+namespace scalar {
+
+inline uint64_t sad_row(const uint8_t* a, const uint8_t* b, int n) {
+  uint64_t ret = 0;
+  for(int i = 0; i < n; i++)
+    ret += std::abs(int(a[i]) - int(b[i]));
+  return ret;
+}
+
+}
+
+#ifdef CONVERT_AVX2
+namespace avx2 {
+
+__attribute__((target("avx2")))
+inline uint64_t sad_row(const uint8_t* a, const uint8_t* b, int n) {
+  __m256i sum = _mm256_setzero_si256();
+  int i = 0;
+  for(; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(x, y));
+  }
+
+  alignas(32) uint64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sum);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + scalar::sad_row(a + i, b + i, n - i);
+}
+
+}
+#endif
+
+#ifdef CONVERT_NEON
+namespace neon {
+
+inline uint64_t sad_row(const uint8_t* a, const uint8_t* b, int n) {
+  uint32x4_t sum = vdupq_n_u32(0);
+  int i = 0;
+  for(; i + 16 <= n; i += 16)
+    sum = vpadalq_u16(sum, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+
+  uint64x2_t wide = vpaddlq_u32(sum);
+  return vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1) + scalar::sad_row(a + i, b + i, n - i);
+}
+
+}
+#endif
+
+inline SadRow best() {
+#if defined(CONVERT_AVX2)
+  static const SadRow ret = __builtin_cpu_supports("avx2") ? avx2::sad_row : scalar::sad_row;
+  return ret;
+#elif defined(CONVERT_NEON)
+  return neon::sad_row;
+#else
+  return scalar::sad_row;
+#endif
+}
+
+// Rows of a frame's luma. Planar formats are read in place, packed ones go
+// through a row of scratch.
+struct Luma {
+  static bool supported(uint32_t fourcc) {
+    return fourcc == V4L2_PIX_FMT_NV12 || fourcc == V4L2_PIX_FMT_YUYV || fourcc == V4L2_PIX_FMT_UYVY;
+  }
+
+  explicit Luma(const FrameView& frame) : frame(frame) {}
+
+  // w pixels of row y from x
+  const uint8_t* row(int x, int y, int w) {
+    auto& p = frame.planes[0];
+    auto* src = reinterpret_cast<const uint8_t*>(p.data) + size_t(p.stride) * y;
+    if(frame.format == V4L2_PIX_FMT_NV12) return src + x;
+
+    scratch.resize(w);
+    src += x * 2 + (frame.format == V4L2_PIX_FMT_UYVY);
+    for(int i = 0; i < w; i++)
+      scratch[i] = src[i * 2];
+    return scratch.data();
+  }
+
+protected:
+  const FrameView& frame;
+  std::vector<uint8_t> scratch;
+};
+
+// The luma of what a region should look like.
+struct Template {
+  int width = 0;
+  int height = 0;
+  std::vector<uint8_t> luma;
+
+  // An 8 bit binary PGM (P5), as saved by most image tools.
+  static ErrorOr<Template> load(const char* path) {
+    std::ifstream f(path, std::ios::binary);
+    if(!f) return Error::format(errno, "Failed to open {}", path);
+
+    // header fields are separated by whitespace, comments run to the end of the line
+    auto field = [&]() {
+      std::string ret;
+      while(f) {
+        int c = f.get();
+        if(c == '#') {
+          while(f && c != '\n') c = f.get();
+        } else if(std::isspace(c) || c == EOF) {
+          if(!ret.empty()) break;
+        } else {
+          ret += char(c);
+        }
+      }
+      return ret;
+    };
+
+    if(field() != "P5") return Error::format("{} is not a binary PGM", path);
+
+    Template ret;
+    ret.width = std::atoi(field().c_str());
+    ret.height = std::atoi(field().c_str());
+    if(field() != "255") return Error::format("{} is not an 8 bit PGM", path);
+    if(ret.width <= 0 || ret.height <= 0) return Error::format("{} has no pixels", path);
+
+    ret.luma.resize(size_t(ret.width) * ret.height);
+    if(!f.read(reinterpret_cast<char*>(ret.luma.data()), ret.luma.size()))
+      return Error::format("{} is truncated", path);
+    return ret;
+  }
+
+  // What region of frame looks like now, to wait for it to come back.
+  static ErrorOr<Template> grab(const FrameView& frame, Rect region) {
+    if(!Luma::supported(frame.format)) return Error::format("No luma to match in {} frames", fourcc_str(frame.format));
+    if(region.x < 0 || region.y < 0 || region.w <= 0 || region.h <= 0 ||
+       region.x + region.w > frame.width || region.y + region.h > frame.height)
+      return Error::format("Region {}x{}+{}+{} is outside the frame", region.w, region.h, region.x, region.y);
+
+    Template ret { region.w, region.h };
+    ret.luma.resize(size_t(region.w) * region.h);
+
+    Luma l(frame);
+    for(int y = 0; y < region.h; y++)
+      std::copy_n(l.row(region.x, region.y + y, region.w), region.w, ret.luma.data() + size_t(y) * region.w);
+    return ret;
+  }
+};
+
+// Mean absolute difference per pixel between t and the frame at (x, y), or
+// nullopt once it's clearly more than limit.
+inline std::optional<double> difference(const FrameView& frame, int x, int y, const Template& t,
+                                        double limit, SadRow f = best()) {
+  Luma l(frame);
+  double pixels = double(t.width) * t.height;
+  auto stop = uint64_t(limit * pixels);
+
+  uint64_t sum = 0;
+  for(int r = 0; r < t.height; r++) {
+    sum += f(l.row(x, y + r, t.width), t.luma.data() + size_t(r) * t.width, t.width);
+    if(sum > stop) return std::nullopt;
+  }
+  return sum / pixels;
+}
+
+}
+
+// Waits on what the capture thread publishes. Any thread may wait, the
+// capture thread calls check() with every frame before it goes to the sinks.
+struct ScreenWait {
+  using my_clock = std::chrono::steady_clock;
+
+  struct Condition {
+    // where to look, in pixels; no width or height is to the frame's edge.
+    // With a reference only x and y count, the reference has its own size.
+    // A change is looked for in exactly the region's luma, except in the
+    // first frame: all that's kept of the one before it is its tile hashes,
+    // so there a change anywhere in a tile the region overlaps counts.
+    // Frames without luma (RGB) are compared by tiles throughout.
+    Rect region;
+    // what the region should look like, nullptr waits for any change
+    const match::Template* reference = nullptr;
+    // mean absolute luma difference per pixel that still counts as a match
+    double tolerance = 4;
+  };
+
+  struct Result {
+    enum Kind { MATCHED, CHANGED, TIMED_OUT } kind = TIMED_OUT;
+    double difference = -1;    // from the reference of the last frame compared, -1 if over the tolerance
+    my_clock::time_point time; // when the frame that did it was dequeued
+  };
+
+  // Block until the condition holds on a frame published after the call, or
+  // timeout passes. Changes are against the frame published before that.
+  ErrorOr<Result> wait(const Condition& c, my_clock::duration timeout) {
+    std::unique_lock lock(mutex);
+    auto& w = waiters.emplace_back(Waiter{ .condition = c });
+    active.fetch_add(1, std::memory_order_relaxed);
+
+    ready.wait_for(lock, timeout, [&]() { return w.done; });
+
+    auto error = std::move(w.error);
+    auto ret = w.result;
+    waiters.remove_if([&](auto& o) { return &o == &w; });
+    active.fetch_sub(1, std::memory_order_relaxed);
+
+    if(error) return *error;
+    return ret;
+  }
+
+  // Capture thread: frame was dequeued at time, its tiles hashed into h.
+  // previous is the frame before it, the baseline of waits started since.
+  void check(const FrameView& frame, my_clock::time_point time, const tiles::Hashes& h,
+             const tiles::Hashes& previous) {
+    if(!active.load(std::memory_order_relaxed)) return;
+
+    std::lock_guard lock(mutex);
+    bool any = false;
+    for(auto& w: waiters) {
+      if(w.done) continue;
+      evaluate(w, frame, time, h, previous);
+      any |= w.done;
+    }
+    if(any) ready.notify_all();
+  }
+
+protected:
+  struct Waiter {
+    Condition condition;
+    std::optional<std::vector<uint64_t>> baseline;
+    std::optional<match::Template> luma; // of the region in the frame before
+    bool done = false;
+    Result result;
+    std::optional<Error> error;
+  };
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::list<Waiter> waiters;
+  std::atomic<size_t> active = 0; // so frames nobody waits on don't take the lock
+
+  void evaluate(Waiter& w, const FrameView& frame, my_clock::time_point time, const tiles::Hashes& h,
+                const tiles::Hashes& previous) {
+    auto& c = w.condition;
+    auto finish = [&](Result::Kind kind) {
+      w.result.kind = kind;
+      w.result.time = time;
+      w.done = true;
+    };
+
+    if(!c.reference) {
+      Rect r = c.region;
+      if(!r.w) r.w = frame.width - r.x;
+      if(!r.h) r.h = frame.height - r.y;
+      if(r.x < 0 || r.y < 0 || r.w <= 0 || r.h <= 0 || r.x + r.w > frame.width || r.y + r.h > frame.height) {
+        w.error = Error::format("Region {}x{}+{}+{} is outside the {}x{} frame", r.w, r.h, r.x, r.y,
+                                frame.width, frame.height);
+        w.done = true;
+        return;
+      }
+
+      // tile hashes tell what changed without keeping the old frame. With
+      // no previous frame of this size, this one is the baseline.
+      bool same_shape = previous.width == h.width && previous.height == h.height;
+      if(!w.baseline) {
+        w.baseline = watched(same_shape ? previous : h, r);
+        if(same_shape && watched(h, r) != *w.baseline) return finish(Result::CHANGED);
+        if(match::Luma::supported(frame.format)) w.luma = match::Template::grab(frame, r).release_value();
+        return;
+      }
+
+      if(!w.luma) {
+        if(watched(h, r) != *w.baseline) finish(Result::CHANGED);
+        return;
+      }
+
+      // tiles that are the same as in the frame before can't hold a change,
+      // the rest are looked into. The frame changing shape is a change.
+      if(!same_shape || !match::Luma::supported(frame.format)) return finish(Result::CHANGED);
+      if(watched(h, r) == watched(previous, r)) return;
+      if(!match::difference(frame, r.x, r.y, *w.luma, 0)) finish(Result::CHANGED);
+      return;
+    }
+
+    auto& t = *c.reference;
+    if(!match::Luma::supported(frame.format)) {
+      w.error = Error::format("No luma to match in {} frames", fourcc_str(frame.format));
+      w.done = true;
+      return;
+    }
+    if(c.region.x < 0 || c.region.y < 0 || c.region.x + t.width > frame.width || c.region.y + t.height > frame.height) {
+      w.error = Error::format("Reference of {}x{} at {},{} is outside the {}x{} frame", t.width, t.height,
+                              c.region.x, c.region.y, frame.width, frame.height);
+      w.done = true;
+      return;
+    }
+
+    auto d = match::difference(frame, c.region.x, c.region.y, t, c.tolerance);
+    w.result.difference = d.value_or(-1);
+    if(d) finish(Result::MATCHED);
+  }
+
+  // hashes of the tiles that overlap region, in pixels
+  static std::vector<uint64_t> watched(const tiles::Hashes& h, Rect region) {
+    std::vector<uint64_t> ret;
+    int x1 = region.x + region.w, y1 = region.y + region.h;
+
+    for(int r = region.y / tiles::tile_h; r < h.rows && r * tiles::tile_h < y1; r++)
+      for(int c = region.x / tiles::tile_w; c < h.cols && c * tiles::tile_w < x1; c++)
+        ret.push_back(h.hash[size_t(r) * h.cols + c]);
+    return ret;
+  }
+};
@@ -0,0 +1,505 @@
+#pragma once
+
+#include "async_capture.h"
+#include "tile_codec.h"
+#include "tiles.h"
+
+#include <common/err.h>
+#include <common/msg.h>
+#include <common/stats.h>
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <netinet/tcp.h>
+
+using tcp = asio::ip::tcp;
+
+// Writes one chunk (header and payload) to the end of a byte vector.
+inline void put_chunk(std::vector<uint8_t>& out, codec::ChunkType type, int64_t time, const void* data, size_t size) {
+  codec::ChunkHeader h = { type, uint32_t(size), time };
+  auto* hp = reinterpret_cast<const uint8_t*>(&h);
+  auto* dp = static_cast<const uint8_t*>(data);
+  out.insert(out.end(), hp, hp + sizeof(h));
+  out.insert(out.end(), dp, dp + size);
+}
+
+// Reads chunks off a socket, calling f(header, payload) for each until the
+// connection closes. f returns false to stop reading, on_close is then called
+// with no error.
+struct ChunkReader {
+  tcp::socket& sock;
+  codec::ChunkHeader header;
+  std::vector<uint8_t> payload;
+
+  static constexpr size_t max_chunk = 64 << 20;
+
+  void read(auto&& f, auto&& on_close) {
+    asio::async_read(sock, asio::buffer(&header, sizeof(header)), [this, f, on_close](const asio::error_code& ec, size_t) {
+      if(ec || header.size > max_chunk) return on_close(ec);
+
+      payload.resize(header.size);
+      asio::async_read(sock, asio::buffer(payload.data(), payload.size()), [this, f, on_close](const asio::error_code& ec, size_t) {
+        if(ec) return on_close(ec);
+        if(!f(header, std::span<const uint8_t>(payload))) return on_close(asio::error_code());
+        read(f, on_close);
+      });
+    });
+  }
+};
+
+// Serves captured frames to remote viewers over TCP, as the same chunks a
+// recording is made of. A viewer gets a keyframe when it connects and only
+// the tiles that changed since its previous frame after that.
+//
+// At most one frame is in flight per viewer. The next one is encoded only
+// once the socket is writable again, and TCP_NOTSENT_LOWAT keeps the unsent
+// part of the kernel queue to about 10ms at the measured link rate. A slow
+// link therefore gets fewer, fresher frames instead of a growing backlog.
+// Viewers acknowledge presented frames, which gives capture to display
+// latency (plus the return trip) per viewer.
+struct StreamServer {
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr auto report_interval = std::chrono::seconds(10);
+  static constexpr auto queue_target = std::chrono::milliseconds(10);
+  static constexpr int min_lowat = 16 << 10;
+  static constexpr int max_lowat = 1 << 20;
+
+  // payload of every wire frame a viewer sends, to be forwarded to the pi
+  std::function<void(std::span<const uint8_t>)> on_input;
+
+  // Viewers' input goes to the pi unchecked, bind to loopback unless they're
+  // all trusted.
+  StreamServer(asio::io_service& service, const tcp::endpoint& endpoint, AsyncCapture& cap)
+    : service(service), acceptor(service, endpoint), cap(cap), report(service) {}
+
+  // Call before the capture is started.
+  void start() {
+    cap.on_frame([this]() {
+      asio::post(service, [this]() { on_frame(); });
+      return true;
+    });
+    accept();
+    schedule_report();
+  }
+
+protected:
+  struct Client {
+    tcp::socket sock;
+    std::string name;
+    ChunkReader reader { sock };
+    FrameParser parser;
+
+    tiles::DirtyTracker tracker;
+    codec::Format format {};
+    std::vector<uint8_t> tx;
+    bool busy = false;
+    bool closed = false;
+    uint32_t last_seq = 0;
+    bool sent_any = false;
+
+    // since the last report
+    uint64_t frames = 0;
+    uint64_t dropped = 0;
+    uint64_t bytes = 0;
+    LatencyHistogram latency;
+
+    double bandwidth = 0; // bytes/s, decaying max of the achieved rate
+    uint64_t tuned_bytes = 0;
+    int lowat = max_lowat;
+
+    Client(tcp::socket sock) : sock(std::move(sock)) {}
+  };
+
+  asio::io_service& service;
+  tcp::acceptor acceptor;
+  AsyncCapture& cap;
+  asio::steady_timer report;
+  my_clock::time_point last_report = my_clock::now();
+  my_clock::time_point last_tune = my_clock::now();
+  my_clock::time_point start_time = my_clock::now();
+
+  std::list<Client> clients;
+  codec::Encoder encoder;
+
+  // newest frame, kept until every viewer has had it
+  AsyncCapture::Frame current;
+  std::array<my_clock::time_point, 64> sent_times {};
+  std::array<uint32_t, 64> sent_seqs {};
+
+  int64_t since_start(my_clock::time_point t) const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - start_time).count();
+  }
+
+  void accept() {
+    acceptor.async_accept([this](const asio::error_code& ec, tcp::socket sock) {
+      if(!ec) {
+        sock.set_option(tcp::no_delay(true));
+
+        auto& c = clients.emplace_back(std::move(sock));
+        asio::error_code ignored;
+        auto ep = c.sock.remote_endpoint(ignored);
+        c.name = fmt::format("{}:{}", ep.address().to_string(), ep.port());
+        fmt::print("Viewer {} connected\n", c.name);
+
+        set_lowat(c, c.lowat);
+        read(c);
+        send(c);
+      }
+      accept();
+    });
+  }
+
+  void on_frame() {
+    auto* f = cap.pop_frame();
+    if(!f || !f->buf) return;
+
+    current.buf = std::move(f->buf);
+    current.tiles = f->tiles;
+    current.time = f->time;
+    current.seq = f->seq;
+
+    for(auto& c: clients)
+      if(!c.busy) send(c);
+    release_if_done();
+  }
+
+  void release_if_done() {
+    for(auto& c: clients)
+      if(!c.closed && (!c.sent_any || c.last_seq != current.seq)) return;
+    current.buf.reset();
+  }
+
+  void send(Client& c) {
+    if(c.closed || c.busy || !current.buf || (c.sent_any && c.last_seq == current.seq)) return;
+
+    auto view = current.buf->view();
+    auto fmt = codec::format_of(view);
+    int64_t time = since_start(current.time);
+    c.tx.clear();
+
+    bool key = !c.sent_any || fmt != c.format;
+    if(fmt != c.format) {
+      put_chunk(c.tx, codec::FORMAT, time, &fmt, sizeof(fmt));
+      c.format = fmt;
+    }
+
+    if(key) c.tracker.invalidate();
+    c.tracker.update(current.tiles);
+
+    if(c.sent_any) c.dropped += current.seq - c.last_seq - 1;
+    c.last_seq = current.seq;
+    c.sent_any = true;
+    sent_times[current.seq % sent_times.size()] = current.time;
+    sent_seqs[current.seq % sent_seqs.size()] = current.seq;
+
+    size_t size = encoder.prepare(view, c.tracker, current.seq, key);
+    codec::ChunkHeader h = { codec::FRAME, uint32_t(size), time };
+    auto* hp = reinterpret_cast<const uint8_t*>(&h);
+    c.tx.insert(c.tx.end(), hp, hp + sizeof(h));
+    encoder.write([&](const void* p, size_t n) {
+      auto* bp = static_cast<const uint8_t*>(p);
+      c.tx.insert(c.tx.end(), bp, bp + n);
+    });
+
+    c.busy = true;
+    asio::async_write(c.sock, asio::buffer(c.tx.data(), c.tx.size()), [this, &c](const asio::error_code& ec, size_t n) {
+      if(ec) return close(c);
+
+      c.frames++;
+      c.bytes += n;
+
+      // wait until the unsent part of the queue is below the low water mark
+      c.sock.async_wait(tcp::socket::wait_write, [this, &c](const asio::error_code& ec) {
+        c.busy = false;
+        if(ec) return close(c);
+        send(c);
+        release_if_done();
+      });
+    });
+  }
+
+  void read(Client& c) {
+    c.reader.read([this, &c](const codec::ChunkHeader& h, std::span<const uint8_t> payload) {
+      if(h.type == codec::INPUT) {
+        c.parser.parse(payload, [&](uint8_t, std::span<const uint8_t> frame) {
+          if(on_input) on_input(frame);
+        });
+      } else if(h.type == codec::ACK && payload.size() >= 4) {
+        uint32_t seq;
+        std::memcpy(&seq, payload.data(), 4);
+        if(sent_seqs[seq % sent_seqs.size()] == seq)
+          c.latency.record(my_clock::now() - sent_times[seq % sent_times.size()]);
+      }
+      return true;
+    }, [this, &c](const asio::error_code&) { close(c); });
+  }
+
+  void close(Client& c) {
+    if(c.closed) return;
+    c.closed = true;
+
+    asio::error_code ignored;
+    c.sock.close(ignored);
+    fmt::print("Viewer {} disconnected\n", c.name);
+
+    // let the pending handlers run before the client goes away
+    asio::post(service, [this, &c]() {
+      clients.remove_if([&](const Client& o) { return &o == &c; });
+      release_if_done();
+    });
+  }
+
+  void set_lowat(Client& c, int lowat) {
+    c.lowat = lowat;
+    setsockopt(c.sock.native_handle(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+  }
+
+  void schedule_report() {
+    report.expires_after(std::chrono::seconds(1));
+    report.async_wait([this](const asio::error_code& ec) {
+      if(ec) return;
+      update_rates();
+      schedule_report();
+    });
+  }
+
+  // re-tune the low water marks every second, print every report_interval
+  void update_rates() {
+    auto now = my_clock::now();
+    double secs = std::chrono::duration<double>(now - last_tune).count();
+    last_tune = now;
+
+    bool print = now - last_report >= report_interval;
+    double report_secs = std::chrono::duration<double>(now - last_report).count();
+
+    for(auto& c: clients) {
+      double rate = (c.bytes - c.tuned_bytes) / secs;
+      c.bandwidth = std::max(rate, c.bandwidth * 0.9);
+      set_lowat(c, std::clamp(int(c.bandwidth * std::chrono::duration<double>(queue_target).count()), min_lowat, max_lowat));
+      c.tuned_bytes = c.bytes;
+
+      if(!print) continue;
+
+      auto us = [](auto d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+      auto s = c.latency.summary();
+      fmt::print("Viewer {}: {:.1f} fps, {:.2f} MB/s (link ~{:.2f} MB/s), {:.1f} dropped/s, "
+                 "latency p50 {}us p99 {}us max {}us\n",
+                 c.name, c.frames / report_secs, c.bytes / report_secs / 1e6, c.bandwidth / 1e6,
+                 c.dropped / report_secs, us(s.p50), us(s.p99), us(s.max));
+
+      c.frames = c.dropped = c.bytes = 0;
+      c.tuned_bytes = 0;
+      c.latency.reset();
+    }
+
+    if(print) last_report = now;
+  }
+};
+
+// Remote end of a StreamServer: keeps a decoded copy of the remote screen and
+// sends input back. The connection is serviced on a thread of its own; the
+// UI thread picks up decoded frames with take() and writes input through
+// write()/flush(), which makes it a stream KeyState::dump() can write to.
+struct StreamClient {
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr auto report_interval = std::chrono::seconds(10);
+
+  StreamClient(asio::io_service& service) : service(service), sock(service) {}
+  StreamClient(const StreamClient&) = delete;
+  ~StreamClient() { stop(); }
+
+  ErrorOr<void> connect(const std::string& host, const std::string& port) {
+    asio::error_code ec;
+    tcp::resolver resolver(service);
+    auto endpoints = resolver.resolve(host, port, ec);
+    if(!ec) asio::connect(sock, endpoints, ec);
+    if(ec) return Error::format(ec.value(), "Failed to connect to {}:{}: {}", host, port, ec.message());
+
+    sock.set_option(tcp::no_delay(true));
+    return {};
+  }
+
+  // Called from the network thread when a frame was decoded. Only called
+  // again once take() has run, or f failed, like AsyncCapture::on_frame.
+  void on_frame(std::function<bool()> f) { notify = std::move(f); }
+
+  void start() {
+    read();
+    service.restart();
+    thread = std::jthread([this]() { service.run(); });
+  }
+
+  void stop() {
+    if(!thread.joinable()) return;
+    asio::post(service, [this]() {
+      asio::error_code ignored;
+      sock.close(ignored);
+    });
+    thread.join();
+  }
+
+  bool is_connected() const { return connected; }
+
+  // Blocks until the server has said what it's sending.
+  std::optional<codec::Format> wait_format(my_clock::duration timeout) {
+    std::unique_lock lock(mutex);
+    cv.wait_for(lock, timeout, [this]() { return decoder.get_format().fourcc != 0 || !connected; });
+    if(!decoder.get_format().fourcc) return std::nullopt;
+    return decoder.get_format();
+  }
+
+  // f(format, view, rects) with everything that changed since the last call,
+  // then acknowledges the newest frame. Returns false if nothing changed.
+  bool take(auto&& f) {
+    std::optional<uint32_t> seq;
+    {
+      std::lock_guard lock(mutex);
+      notified = false;
+      if(!fresh) return false;
+
+      f(decoder.get_format(), decoder.view(), std::span<const Rect>(dirty));
+      dirty.clear();
+      fresh = false;
+      seq = last_seq;
+    }
+
+    asio::post(service, [this, seq = *seq]() {
+      std::vector<uint8_t> ack;
+      put_chunk(ack, codec::ACK, 0, &seq, sizeof(seq));
+      send(std::move(ack));
+    });
+    return true;
+  }
+
+  // input, as written by KeyState::dump()
+  void write(const char* s, int len) {
+    pending.insert(pending.end(), s, s + len);
+  }
+
+  void flush() {
+    if(pending.empty()) return;
+
+    std::vector<uint8_t> chunk;
+    put_chunk(chunk, codec::INPUT, 0, pending.data(), pending.size());
+    pending.clear();
+    asio::post(service, [this, chunk = std::move(chunk)]() mutable { send(std::move(chunk)); });
+  }
+
+protected:
+  asio::io_service& service;
+  tcp::socket sock;
+  ChunkReader reader { sock };
+  std::jthread thread;
+  std::atomic<bool> connected = true;
+
+  std::function<bool()> notify;
+  bool notified = false;
+
+  // decoded image, shared with the UI thread
+  std::mutex mutex;
+  std::condition_variable cv;
+  codec::Decoder decoder;
+  std::vector<Rect> dirty;
+  uint32_t last_seq = 0;
+  bool fresh = false;
+
+  // input being gathered by the UI thread until flush()
+  std::vector<uint8_t> pending;
+
+  // network thread only
+  std::list<std::vector<uint8_t>> tx;
+
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  my_clock::time_point last_report = my_clock::now();
+
+  void read() {
+    reader.read([this](const codec::ChunkHeader& h, std::span<const uint8_t> payload) {
+      bytes += sizeof(h) + payload.size();
+
+      bool wake = false;
+      {
+        std::lock_guard lock(mutex);
+        if(h.type == codec::FORMAT && payload.size() >= sizeof(codec::Format)) {
+          codec::Format fmt;
+          std::memcpy(&fmt, payload.data(), sizeof(fmt));
+          if(auto err = decoder.set_format(fmt); err.is_error()) {
+            fmt::print("Bad format from server: {}\n", err.error().what());
+            return false;
+          }
+          dirty.clear();
+        } else if(h.type == codec::FRAME) {
+          codec::FrameHeader hdr;
+          // the image may be half updated, nothing after it can be trusted
+          if(!decoder.apply(payload, dirty, &hdr)) {
+            fmt::print("Malformed frame from server\n");
+            return false;
+          }
+
+          frames++;
+          last_seq = hdr.seq;
+          fresh = true;
+          wake = !std::exchange(notified, true);
+        }
+      }
+      cv.notify_all();
+      if(wake && notify && !notify()) {
+        std::lock_guard lock(mutex);
+        notified = false;
+      }
+
+      maybe_report();
+      return true;
+    }, [this](const asio::error_code& ec) {
+      if(ec && ec != asio::error::operation_aborted)
+        fmt::print("Connection to server lost: {}\n", ec.message());
+      asio::error_code ignored;
+      sock.close(ignored);
+      connected = false;
+      cv.notify_all();
+      if(notify) notify();
+    });
+  }
+
+  // queued writes go out one after the other
+  void send(std::vector<uint8_t> data) {
+    tx.push_back(std::move(data));
+    if(tx.size() == 1) write_next();
+  }
+
+  void write_next() {
+    asio::async_write(sock, asio::buffer(tx.front().data(), tx.front().size()), [this](const asio::error_code& ec, size_t) {
+      if(ec) return;
+      tx.pop_front();
+      if(!tx.empty()) write_next();
+    });
+  }
+
+  void maybe_report() {
+    auto now = my_clock::now();
+    if(now - last_report < report_interval) return;
+
+    double secs = std::chrono::duration<double>(now - last_report).count();
+    fmt::print("Stream: {:.1f} fps, {:.2f} MB/s\n", frames / secs, bytes / secs / 1e6);
+    frames = bytes = 0;
+    last_report = now;
+  }
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <common/msg.h>
+#include <common/stats.h>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <string>
+
+// Input latency measured from the pi's echoes. The serial hop (host send to
+// pi receive) crosses clocks, so the pi's clock offset is estimated NTP style
+// from the echo with the smallest round trip in a recent window. The HID hop
+// (pi receive to gadget write completing) is on the pi's clock alone.
+struct Telemetry {
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr size_t window = 64;
+  static constexpr my_clock::duration report_interval = std::chrono::seconds(10);
+
+  // which pi this is, when there are several
+  std::string name;
+
+  LatencyHistogram serial;
+  LatencyHistogram hid;
+  LatencyHistogram total;
+
+  void on_echo(const echo_t& e, uint32_t now) {
+    int32_t rtt = int32_t(now - e.host) - int32_t(e.tx - e.rx);
+    int32_t offset = (int32_t(e.rx - e.host) + int32_t(e.tx - now)) / 2;
+
+    samples[n++ % window] = { rtt, offset };
+    auto best = *std::min_element(samples.begin(), samples.begin() + std::min(n, window),
+                                  [](auto& a, auto& b) { return a.rtt < b.rtt; });
+
+    auto serial_us = std::chrono::microseconds(int32_t(e.rx - e.host - best.offset));
+    auto hid_us = std::chrono::microseconds(int32_t(e.hid - e.rx));
+
+    serial.record(serial_us);
+    hid.record(hid_us);
+    total.record(serial_us + hid_us);
+    clock_offset = best.offset;
+  }
+
+  // Print and restart the rolling window once report_interval has passed.
+  void maybe_report(bool force = false) {
+    auto now = my_clock::now();
+    if(!force && now - last_report < report_interval) return;
+
+    print();
+    serial.reset();
+    hid.reset();
+    total.reset();
+    last_report = now;
+  }
+
+  void print() const {
+    auto us = [](auto d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+    auto line = [&](const char* name, const LatencyHistogram& h) {
+      auto s = h.summary();
+      fmt::print("  {:<7} n {:<6} p50 {:>6}us p99 {:>6}us max {:>6}us\n", name, s.count, us(s.p50), us(s.p99), us(s.max));
+    };
+
+    fmt::print("Input latency{}{} (clock offset {}us):\n", name.empty() ? "" : " for ", name, clock_offset);
+    line("serial", serial);
+    line("hid", hid);
+    line("total", total);
+  }
+
+protected:
+  struct Sample {
+    int32_t rtt;
+    int32_t offset;
+  };
+
+  std::array<Sample, window> samples {};
+  size_t n = 0;
+  int32_t clock_offset = 0;
+  my_clock::time_point last_report = my_clock::now();
+};
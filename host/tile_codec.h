@@ -0,0 +1,266 @@
+#pragma once
+
+#include "convert.h"
+#include "frame.h"
+#include "tiles.h"
+
+#include <common/err.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+// Frames as changed tiles, the encoding shared by recordings and network
+// streams. Both are a sequence of chunks, each a ChunkHeader followed by size
+// bytes of payload.
+//
+// FRAME payloads are a FrameHeader, run lengths of unchanged and changed
+// tiles in raster order (varints, starting with unchanged), then the raw
+// pixels of each changed tile: its rows of the first plane, then its NV12
+// chroma rows. A FORMAT chunk precedes the first frame and every change of
+// format, and the frame after it is a keyframe with every tile present.
+//
+// Raw recordings store RAW_FRAME chunks instead: a RawFrameHeader and the
+// frame as captured, every row of the first plane at stride, then the NV12
+// chroma rows, so a replay can hand it out without copying.
+namespace codec {
+
+enum ChunkType : uint32_t {
+  FILE_HEADER = 1, // recordings only
+  FORMAT,
+  FRAME,
+  INPUT,           // wire frames sent to the pi
+  INDEX,           // recordings only
+  TRAILER,         // recordings only
+  ACK,             // stream viewer to server: a frame was presented
+  RAW_FRAME,       // recordings only
+};
+
+struct ChunkHeader {
+  uint32_t type;
+  uint32_t size;
+  int64_t time; // ns, relative to the start of the recording or stream
+};
+
+struct Format {
+  uint32_t fourcc;
+  uint32_t width;
+  uint32_t height;
+  uint32_t tile_w;
+  uint32_t tile_h;
+
+  bool operator==(const Format&) const = default;
+};
+
+struct FrameHeader {
+  uint32_t seq;
+  uint32_t tiles; // number of changed tiles stored
+  uint8_t key;
+  uint8_t reserved[3];
+};
+
+struct RawFrameHeader {
+  uint32_t seq;
+  uint32_t stride;
+};
+
+// Bytes of a whole frame laid out as in a RAW_FRAME chunk.
+inline size_t raw_size(uint32_t fourcc, int height, int stride) {
+  size_t ret = size_t(stride) * height;
+  if(fourcc == V4L2_PIX_FMT_NV12) ret += size_t(stride) * ((height + 1) / 2);
+  return ret;
+}
+
+inline Format format_of(const FrameView& view) {
+  return { view.format, uint32_t(view.width), uint32_t(view.height), tiles::tile_w, tiles::tile_h };
+}
+
+inline Rect tile_rect(const Format& f, int cols, size_t i) {
+  int x0 = (i % cols) * f.tile_w, y0 = (i / cols) * f.tile_h;
+  return { x0, y0, std::min<int>(x0 + f.tile_w, f.width) - x0, std::min<int>(y0 + f.tile_h, f.height) - y0 };
+}
+
+// Walk the rows of tile r in the order they're stored, f(plane, x_bytes, y, bytes).
+inline void for_tile_rows(const Format& fmt, const Rect& r, auto&& f) {
+  int bpp = convert::bytes_per_pixel(fmt.fourcc);
+
+  for(int y = r.y; y < r.y + r.h; y++)
+    f(0, r.x * bpp, y, r.w * bpp);
+
+  if(fmt.fourcc == V4L2_PIX_FMT_NV12) {
+    for(int y = r.y / 2; y < (r.y + r.h + 1) / 2; y++)
+      f(1, r.x, y, r.w);
+  }
+}
+
+// Builds FRAME payloads. prepare() works out the size first so the caller
+// can decide whether there's room for it before anything is copied.
+struct Encoder {
+  size_t prepare(const FrameView& frame, const tiles::DirtyTracker& tracker, uint32_t seq, bool key) {
+    view = frame;
+    format = format_of(frame);
+    mask = tracker.mask();
+    cols = tracker.get_cols();
+    header = { seq, uint32_t(tracker.dirty_count()), key };
+
+    runs.clear();
+    pixels = 0;
+    bool changed = false;
+    uint32_t run = 0;
+
+    for(size_t i = 0; i < mask.size(); i++) {
+      if(bool(mask[i]) != changed) {
+        put_varint(run);
+        changed = !changed;
+        run = 0;
+      }
+      run++;
+
+      if(mask[i])
+        for_tile_rows(format, tile_rect(format, cols, i), [&](int, int, int, int bytes) { pixels += bytes; });
+    }
+    put_varint(run);
+
+    return sizeof(FrameHeader) + runs.size() + pixels;
+  }
+
+  // append(const void*, size_t) is called with the payload in pieces
+  void write(auto&& append) const {
+    append(&header, sizeof(header));
+    append(runs.data(), runs.size());
+
+    for(size_t i = 0; i < mask.size(); i++) {
+      if(!mask[i]) continue;
+
+      for_tile_rows(format, tile_rect(format, cols, i), [&](int plane, int x, int y, int bytes) {
+        auto& p = view.planes[plane];
+        append(p.data + size_t(p.stride) * y + x, bytes);
+      });
+    }
+  }
+
+protected:
+  FrameView view;
+  Format format;
+  std::span<const uint8_t> mask;
+  int cols = 0;
+  FrameHeader header;
+  std::vector<uint8_t> runs;
+  size_t pixels = 0;
+
+  void put_varint(uint32_t v) {
+    while(v >= 0x80) {
+      runs.push_back(uint8_t(v) | 0x80);
+      v >>= 7;
+    }
+    runs.push_back(uint8_t(v));
+  }
+};
+
+// Rebuilds frames from FRAME payloads into a tightly packed image.
+struct Decoder {
+  // largest frame a peer may announce, each way
+  static constexpr uint32_t max_dimension = 1 << 14;
+
+  // f comes off the network, check it before sizing anything by it
+  ErrorOr<void> set_format(const Format& f) {
+    if(!convert::bytes_per_pixel(f.fourcc))
+      return Error::format("Unsupported stream format {}", fourcc_str(f.fourcc));
+    if(!f.width || !f.height || f.width > max_dimension || f.height > max_dimension)
+      return Error::format("Stream frame size {}x{} is out of range", f.width, f.height);
+    if(!f.tile_w || !f.tile_h || f.tile_w > max_dimension || f.tile_h > max_dimension)
+      return Error::format("Stream tile size {}x{} is out of range", f.tile_w, f.tile_h);
+
+    format = f;
+    cols = (f.width + f.tile_w - 1) / f.tile_w;
+    rows = (f.height + f.tile_h - 1) / f.tile_h;
+    stride = f.width * convert::bytes_per_pixel(f.fourcc);
+
+    size_t size = size_t(stride) * f.height;
+    if(f.fourcc == V4L2_PIX_FMT_NV12) size += size_t(stride) * ((f.height + 1) / 2);
+    image.assign(size, std::byte(0));
+    return {};
+  }
+
+  const Format& get_format() const { return format; }
+
+  FrameView view() const {
+    if(format.fourcc == V4L2_PIX_FMT_NV12)
+      return FrameView::nv12(image, format.width, format.height, stride);
+    return FrameView::packed(format.fourcc, image, format.width, format.height, stride);
+  }
+
+  // Apply a FRAME payload, adding the rects it touched (runs of changed
+  // tiles on a tile row) to dirty. Returns false if it's malformed.
+  bool apply(std::span<const uint8_t> payload, std::vector<Rect>& dirty, FrameHeader* out = nullptr) {
+    FrameHeader hdr;
+    if(!format.fourcc || payload.size() < sizeof(hdr)) return false;
+    std::memcpy(&hdr, payload.data(), sizeof(hdr));
+    if(out) *out = hdr;
+
+    size_t pos = sizeof(hdr);
+    auto get_varint = [&](uint32_t& v) {
+      v = 0;
+      for(int shift = 0; shift < 35 && pos < payload.size(); shift += 7) {
+        uint8_t b = payload[pos++];
+        v |= uint32_t(b & 0x7f) << shift;
+        if(!(b & 0x80)) return true;
+      }
+      return false;
+    };
+
+    // collect the runs first, the pixels follow all of them
+    size_t total = size_t(cols) * rows;
+    spans.clear();
+    for(size_t i = 0; i < total;) {
+      uint32_t skip, copy;
+      if(!get_varint(skip)) return false;
+      i += skip;
+      if(i >= total) break;
+      if(!get_varint(copy) || i + copy > total) return false;
+      spans.push_back({ i, copy });
+      i += copy;
+    }
+
+    auto planes = view().planes;
+    for(auto [start, count]: spans) {
+      for(size_t i = start; i < start + count; i++) {
+        bool ok = true;
+        for_tile_rows(format, tile_rect(format, cols, i), [&](int plane, int x, int y, int bytes) {
+          if(!ok || pos + bytes > payload.size()) { ok = false; return; }
+          auto* dst = const_cast<std::byte*>(planes[plane].data) + size_t(planes[plane].stride) * y + x;
+          std::memcpy(dst, payload.data() + pos, bytes);
+          pos += bytes;
+        });
+        if(!ok) return false;
+      }
+
+      // a run never crosses a tile row in the rects we hand out
+      for(size_t i = start; i < start + count;) {
+        size_t row_end = std::min(start + count, (i / cols + 1) * cols);
+        auto a = tile_rect(format, cols, i), b = tile_rect(format, cols, row_end - 1);
+        dirty.push_back({ a.x, a.y, b.x + b.w - a.x, a.h });
+        i = row_end;
+      }
+    }
+
+    return true;
+  }
+
+protected:
+  Format format {};
+  int cols = 0;
+  int rows = 0;
+  int stride = 0;
+  std::vector<std::byte> image;
+
+  struct Span {
+    size_t start;
+    uint32_t count;
+  };
+  std::vector<Span> spans;
+};
+
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "convert.h"
+#include "frame.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+// Per-tile hashes of a frame, used to find what changed between two frames
+// without keeping a copy of the previous one. Each tile is hashed in eight
+// 32 bit lanes, every 32 bytes of a row going through
+//
+//   lane = (lane ^ data) * K; lane ^= lane >> 16
+//
+// Both steps are bijective, so a single changed chunk always changes the
+// hash. Rows are walked in memory order with a running state per tile, which
+// keeps the whole frame a single streaming read.
+namespace tiles {
+
+static constexpr int tile_w = 64;
+static constexpr int tile_h = 32;
+
+using Lanes = std::array<uint32_t, 8>;
+using HashRow = void(*)(const uint8_t* row, int row_bytes, int tile_bytes, Lanes* state);
+
+static constexpr uint32_t K = 0x9e3779b1;
+
+namespace scalar {
+
+inline void mix(Lanes& s, const uint8_t* chunk) {
+  for(int i = 0; i < 8; i++) {
+    uint32_t d;
+    std::memcpy(&d, chunk + i * 4, 4);
+    s[i] = (s[i] ^ d) * K;
+    s[i] ^= s[i] >> 16;
+  }
+}
+
+// tiles that don't end on a 32 byte boundary get their last chunk zero padded
+inline void tail(Lanes& s, const uint8_t* p, int n, auto&& mix) {
+  alignas(32) uint8_t chunk[32] = {};
+  std::memcpy(chunk, p, n);
+  mix(s, chunk);
+}
+
+inline void hash_row(const uint8_t* row, int row_bytes, int tile_bytes, Lanes* state) {
+  for(int x0 = 0, t = 0; x0 < row_bytes; x0 += tile_bytes, t++) {
+    int end = std::min(x0 + tile_bytes, row_bytes), x = x0;
+    for(; x + 32 <= end; x += 32)
+      mix(state[t], row + x);
+    if(x < end)
+      tail(state[t], row + x, end - x, mix);
+  }
+}
+
+}
+
+#ifdef CONVERT_AVX2
+namespace avx2 {
+
+__attribute__((target("avx2")))
+inline __m256i mix(__m256i s, __m256i d) {
+  s = _mm256_mullo_epi32(_mm256_xor_si256(s, d), _mm256_set1_epi32(int(K)));
+  return _mm256_xor_si256(s, _mm256_srli_epi32(s, 16));
+}
+
+__attribute__((target("avx2")))
+inline void hash_row(const uint8_t* row, int row_bytes, int tile_bytes, Lanes* state) {
+  for(int x0 = 0, t = 0; x0 < row_bytes; x0 += tile_bytes, t++) {
+    int end = std::min(x0 + tile_bytes, row_bytes), x = x0;
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[t].data()));
+
+    for(; x + 32 <= end; x += 32)
+      s = mix(s, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x)));
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[t].data()), s);
+
+    if(x < end)
+      scalar::tail(state[t], row + x, end - x, scalar::mix);
+  }
+}
+
+}
+#endif
+
+#ifdef CONVERT_NEON
+namespace neon {
+
+inline uint32x4_t mix(uint32x4_t s, uint32x4_t d) {
+  s = vmulq_n_u32(veorq_u32(s, d), K);
+  return veorq_u32(s, vshrq_n_u32(s, 16));
+}
+
+inline void hash_row(const uint8_t* row, int row_bytes, int tile_bytes, Lanes* state) {
+  for(int x0 = 0, t = 0; x0 < row_bytes; x0 += tile_bytes, t++) {
+    int end = std::min(x0 + tile_bytes, row_bytes), x = x0;
+    uint32x4_t lo = vld1q_u32(state[t].data()), hi = vld1q_u32(state[t].data() + 4);
+
+    for(; x + 32 <= end; x += 32) {
+      lo = mix(lo, vreinterpretq_u32_u8(vld1q_u8(row + x)));
+      hi = mix(hi, vreinterpretq_u32_u8(vld1q_u8(row + x + 16)));
+    }
+
+    vst1q_u32(state[t].data(), lo);
+    vst1q_u32(state[t].data() + 4, hi);
+
+    if(x < end)
+      scalar::tail(state[t], row + x, end - x, scalar::mix);
+  }
+}
+
+}
+#endif
+
+inline HashRow best() {
+#if defined(CONVERT_AVX2)
+  static const HashRow ret = __builtin_cpu_supports("avx2") ? avx2::hash_row : scalar::hash_row;
+  return ret;
+#elif defined(CONVERT_NEON)
+  return neon::hash_row;
+#else
+  return scalar::hash_row;
+#endif
+}
+
+// Tile hashes of one frame. Computed once, on the capture thread, and then
+// compared by each consumer against whatever frame it saw last.
+struct Hashes {
+  int width = 0;
+  int height = 0;
+  int cols = 0;
+  int rows = 0;
+  std::vector<uint64_t> hash;
+
+  void update(const FrameView& frame, HashRow f = best()) {
+    width = frame.width;
+    height = frame.height;
+    cols = (width + tile_w - 1) / tile_w;
+    rows = (height + tile_h - 1) / tile_h;
+
+    state.assign(cols, Lanes {});
+    hash.resize(size_t(cols) * rows);
+
+    int bpp = convert::bytes_per_pixel(frame.format);
+    bool nv12 = frame.format == V4L2_PIX_FMT_NV12;
+
+    for(int r = 0; r < rows; r++) {
+      std::fill(state.begin(), state.end(), Lanes {});
+      int y0 = r * tile_h, y1 = std::min(y0 + tile_h, height);
+
+      for(int y = y0; y < y1; y++)
+        f(row(frame.planes[0], y), width * bpp, tile_w * bpp, state.data());
+
+      // chroma rows are shared by two luma rows
+      if(nv12) {
+        for(int y = y0 / 2; y < (y1 + 1) / 2; y++)
+          f(row(frame.planes[1], y), width, tile_w, state.data());
+      }
+
+      for(int c = 0; c < cols; c++)
+        hash[size_t(r) * cols + c] = fold(state[c]);
+    }
+  }
+
+protected:
+  std::vector<Lanes> state;
+
+  static const uint8_t* row(const FrameView::Plane& p, int y) {
+    return reinterpret_cast<const uint8_t*>(p.data) + size_t(p.stride) * y;
+  }
+
+  static uint64_t fold(const Lanes& s) {
+    uint64_t h = 0;
+    for(uint32_t lane: s)
+      h = (h ^ lane) * 0x9e3779b97f4a7c15;
+    return h;
+  }
+};
+
+// One consumer's view of what changed: the tiles that differ from the last
+// frame it looked at, merged into rectangles. Display, recording and
+// streaming each keep their own, since they don't see the same frames.
+struct DirtyTracker {
+  // once more than this fraction of the tiles is dirty, a single rect
+  // covering the frame is cheaper than many small ones
+  static constexpr double full_threshold = 0.5;
+
+  // Returns false if nothing changed.
+  bool update(const Hashes& h) {
+    bool reshaped = h.cols != cols || h.rows != rows || h.width != width || h.height != height;
+    if(reshaped) {
+      cols = h.cols;
+      rows = h.rows;
+      width = h.width;
+      height = h.height;
+      last.assign(h.hash.size(), 0);
+      all = true;
+    }
+
+    dirty.assign(h.hash.size(), 0);
+    count = 0;
+    for(size_t i = 0; i < h.hash.size(); i++) {
+      if(all || h.hash[i] != last[i]) {
+        dirty[i] = 1;
+        count++;
+      }
+    }
+
+    last = h.hash;
+    all = false;
+
+    build_rects();
+    return count;
+  }
+
+  // report everything as dirty next time, e.g. after the texture was recreated
+  void invalidate() { all = true; }
+
+  bool is_dirty(int col, int row) const { return dirty[size_t(row) * cols + col]; }
+  std::span<const uint8_t> mask() const { return dirty; }
+  size_t dirty_count() const { return count; }
+  const std::vector<Rect>& rects() const { return rect_list; }
+
+  int get_cols() const { return cols; }
+  int get_rows() const { return rows; }
+
+protected:
+  int cols = 0;
+  int rows = 0;
+  int width = 0;
+  int height = 0;
+  bool all = true;
+  size_t count = 0;
+
+  std::vector<uint64_t> last;
+  std::vector<uint8_t> dirty;
+  std::vector<Rect> rect_list;
+
+  // runs of dirty tiles on a tile row become one rect, clipped to the frame
+  void build_rects() {
+    rect_list.clear();
+    if(!count) return;
+
+    if(count > full_threshold * dirty.size()) {
+      rect_list.push_back({ 0, 0, width, height });
+      return;
+    }
+
+    for(int r = 0; r < rows; r++) {
+      for(int c = 0; c < cols; c++) {
+        if(!is_dirty(c, r)) continue;
+
+        int start = c;
+        while(c + 1 < cols && is_dirty(c + 1, r)) c++;
+
+        int x = start * tile_w, y = r * tile_h;
+        rect_list.push_back({ x, y, std::min((c + 1) * tile_w, width) - x, std::min(y + tile_h, height) - y });
+      }
+    }
+  }
+};
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Single producer, single consumer triple buffer. The producer fills back() in
+// place and publishes it, the consumer always picks up the newest published
+// slot. Neither side ever waits on the other.
+template <typename T>
+struct TripleBuffer {
+  // producer side
+
+  T& back() { return slots[back_idx]; }
+
+  // Swap back() with the shared slot. Returns true if the slot we got back was
+  // published but never consumed (i.e. a frame was dropped).
+  bool publish() {
+    auto prev = middle.exchange(back_idx | FRESH, std::memory_order_acq_rel);
+    back_idx = prev & INDEX;
+    return prev & FRESH;
+  }
+
+  // Take back whatever is sitting in the shared slot, so the producer can
+  // release it. Returns true if it was never consumed.
+  bool retract() {
+    auto prev = middle.exchange(back_idx, std::memory_order_acq_rel);
+    back_idx = prev & INDEX;
+    return prev & FRESH;
+  }
+
+  // consumer side
+
+  // Returns the newest published slot, or nullptr if nothing new has been
+  // published since the last call. The slot stays owned by the consumer until
+  // the next call to consume().
+  T* consume() {
+    if(!(middle.load(std::memory_order_relaxed) & FRESH))
+      return nullptr;
+
+    auto prev = middle.exchange(front_idx, std::memory_order_acq_rel);
+    front_idx = prev & INDEX;
+    return &slots[front_idx];
+  }
+
+protected:
+  static constexpr uint8_t INDEX = 0x3;
+  static constexpr uint8_t FRESH = 0x4;
+
+  std::array<T, 3> slots;
+
+  uint8_t back_idx = 0;
+  std::atomic<uint8_t> middle = 1;
+  uint8_t front_idx = 2;
+};
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <SDL2/SDL_clipboard.h>
 #include <SDL2/SDL_render.h>
 #include <SDL2/SDL_video.h>
 #include <common/err.h>
+#include <algorithm>
+#include <cstring>
 #include <span>
+#include <string>
 #include <utility>
 #include <stdexcept>
 #include <optional>
@@ -11,6 +15,9 @@
 
 #include <SDL2/SDL.h>
 
+#include "convert.h"
+#include "frame.h"
+
 Error sdl_error() {
   return Error(SDL_GetError());
 }
@@ -18,48 +25,135 @@ Error sdl_error() {
 struct Window {
   struct Texture {
     Texture(const Texture& o) = delete;
-    Texture(Texture&& o): texture(std::exchange(o.texture, nullptr)) {}
+    Texture(Texture&& o)
+      : texture(std::exchange(o.texture, nullptr)), format(o.format), width(o.width), height(o.height),
+        source(o.source), convert_to(o.convert_to), direct_upload(o.direct_upload) {}
     ~Texture() { if(texture) SDL_DestroyTexture(texture); }
 
     void set_scale_mode(SDL_ScaleMode mode) {
       SDL_SetTextureScaleMode(texture, mode);
     }
 
+    // Upload a captured frame, or only the given rects of it. The planes are
+    // handed to the renderer straight from the capture buffer when it
+    // supports that, otherwise they are copied row by row into the locked
+    // texture, honouring both strides. Formats the renderer can't take are
+    // converted on the way into the texture. Locked textures aren't
+    // guaranteed to keep their old contents, so those paths always write
+    // the whole frame.
+    ErrorOr<void> upload(const FrameView& frame, std::span<const Rect> rects = {}) {
+      if(frame.format != source)
+        return Error::format("Frame format {} doesn't match texture ({})", fourcc_str(frame.format), fourcc_str(source));
+
+      if(convert_to) {
+        FrameView clipped = frame;
+        clipped.width = std::min(width, frame.width);
+        clipped.height = std::min(height, frame.height);
+
+        auto pixels = guard();
+        convert::convert(clipped, convert_to, pixels.data.data(), pixels.pitch, height);
+        return {};
+      }
+
+      Rect full = { 0, 0, std::min(width, frame.width), std::min(height, frame.height) };
+      if(rects.empty()) rects = std::span(&full, 1);
+
+      if(frame.format != V4L2_PIX_FMT_NV12) {
+        int bpp = convert::bytes_per_pixel(frame.format);
+        for(auto& r: rects) {
+          SDL_Rect rect = { r.x, r.y, r.w, r.h };
+          auto* pixels = frame.planes[0].data + size_t(frame.planes[0].stride) * r.y + r.x * bpp;
+          if(SDL_UpdateTexture(texture, &rect, pixels, frame.planes[0].stride) != 0)
+            return sdl_error();
+        }
+        return {};
+      }
+
+      if(direct_upload) {
+        int rc = 0;
+        for(auto& r: rects) {
+          SDL_Rect rect = { r.x, r.y, r.w, r.h };
+          auto* y = frame.planes[0].data + size_t(frame.planes[0].stride) * r.y + r.x;
+          auto* uv = frame.planes[1].data + size_t(frame.planes[1].stride) * (r.y / 2) + r.x;
+
+          rc = SDL_UpdateNVTexture(texture, &rect, reinterpret_cast<const Uint8*>(y), frame.planes[0].stride,
+                                   reinterpret_cast<const Uint8*>(uv), frame.planes[1].stride);
+          if(rc != 0) break;
+        }
+        if(rc == 0) return {};
+
+        // not supported by this renderer, don't bother trying again
+        direct_upload = false;
+      }
+
+      int w = std::min(width, frame.width), h = std::min(height, frame.height);
+
+      auto pixels = guard();
+      copy_plane(pixels.data.data(), pixels.pitch, frame.planes[0], w, h);
+      copy_plane(pixels.data.data() + size_t(pixels.pitch) * height, pixels.pitch, frame.planes[1], w, h / 2);
+      return {};
+    }
+
   protected:
     friend struct Window;
     friend struct Guard;
 
     struct Guard {
-      Guard(Texture* parent) : parent(parent), data(parent->lock()) {}
+      Guard(Texture* parent) : data(parent->lock(pitch)), parent(parent) {}
       Guard(const Guard& o) = delete;
       ~Guard() { parent->unlock(); }
 
-      const std::span<std::byte> data;
       int pitch;
+      const std::span<std::byte> data;
     protected:
       Texture* parent;
     };
 
-    Texture(SDL_Texture* texture, int width, int height)
-      : texture(texture), width(width), height(height) {}
+    Texture(SDL_Texture* texture, uint32_t format, int width, int height, uint32_t source, uint32_t convert_to)
+      : texture(texture), format(format), width(width), height(height), source(source), convert_to(convert_to) {}
 
-    std::span<std::byte> lock() {
+    std::span<std::byte> lock(int& pitch) {
       void* mem;
-      int pitch;
 
-      // TODO: lock subrect?
       SDL_LockTexture(texture, nullptr, &mem, &pitch);
-      return {static_cast<std::byte*>(mem), size_t(pitch * height)};
+
+      // planar YUV formats keep the chroma planes right after luma
+      size_t size = size_t(pitch) * height;
+      if(format == SDL_PIXELFORMAT_NV12) size += size / 2;
+
+      return {static_cast<std::byte*>(mem), size};
     }
 
     void unlock() { SDL_UnlockTexture(texture); }
 
+    static void copy_plane(std::byte* dst, int dst_stride, const FrameView::Plane& src, int row_bytes, int rows) {
+      if(dst_stride == src.stride) {
+        std::memcpy(dst, src.data, size_t(src.stride) * rows);
+        return;
+      }
+
+      for(int i = 0; i < rows; i++)
+        std::memcpy(dst + size_t(dst_stride) * i, src.data + size_t(src.stride) * i, row_bytes);
+    }
+
     SDL_Texture* texture;
+    uint32_t format;
     int width;
     int height;
+    uint32_t source;     // V4L2 format of the frames uploaded
+    uint32_t convert_to; // V4L2 format they're converted to, 0 if uploaded as is
+    bool direct_upload = true;
 
   public:
     Guard guard() { return Guard(this); }
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+
+    // false once the source changed mode, the texture has to be recreated
+    bool fits(const FrameView& frame) const {
+      return frame.format == source && frame.width == width && frame.height == height;
+    }
   };
 
   Window(SDL_Window* win, SDL_Renderer* render)
@@ -69,7 +163,7 @@ struct Window {
   Window(Window&& o):
     win(std::exchange(o.win, nullptr)), render(std::exchange(o.render, nullptr)) {}
 
-  static ErrorOr<Window, Error> create(int width, int height) {
+  static ErrorOr<Window, Error> create(int width, int height, bool vsync = false) {
     SDL_Window* win;
     SDL_Renderer* render;
 
@@ -82,16 +176,49 @@ struct Window {
     win = SDL_CreateWindow("", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, SDL_WINDOW_RESIZABLE);
     if(!win) return sdl_error();
 
-    render = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED);
+    render = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
     if(!render) return sdl_error();
 
     return Window(win, render);
   }
 
-  ErrorOr<Texture> create_texture(uint32_t format, int width, int height) {
+  // Texture for frames of a V4L2 format. The frames are uploaded as they are
+  // if the renderer supports the format natively, otherwise they're converted
+  // to one it does. NV12 is always uploaded directly.
+  ErrorOr<Texture> create_texture(uint32_t fourcc, int width, int height) {
+    uint32_t format = sdl_format(fourcc), convert_to = 0;
+
+    if(fourcc != V4L2_PIX_FMT_NV12 && (!format || !renderer_supports(format))) {
+      convert_to = convert::target(fourcc);
+      format = sdl_format(convert_to);
+    }
+
+    if(!format)
+      return Error::format("No texture format for {}", fourcc_str(fourcc));
+
     auto* ret = SDL_CreateTexture(render, format, SDL_TEXTUREACCESS_STREAMING, width, height);
     if(ret == nullptr) return sdl_error();
-    return Texture(ret, width, height);
+    return Texture(ret, format, width, height, fourcc, convert_to);
+  }
+
+  bool renderer_supports(uint32_t format) {
+    SDL_RendererInfo info;
+    if(SDL_GetRendererInfo(render, &info) != 0) return false;
+    return std::find(info.texture_formats, info.texture_formats + info.num_texture_formats, format)
+        != info.texture_formats + info.num_texture_formats;
+  }
+
+  static uint32_t sdl_format(uint32_t fourcc) {
+    switch(fourcc) {
+    case V4L2_PIX_FMT_NV12: return SDL_PIXELFORMAT_NV12;
+    case V4L2_PIX_FMT_YUYV: return SDL_PIXELFORMAT_YUY2;
+    case V4L2_PIX_FMT_UYVY: return SDL_PIXELFORMAT_UYVY;
+    case V4L2_PIX_FMT_RGB24: return SDL_PIXELFORMAT_RGB24;
+    case V4L2_PIX_FMT_BGR24: return SDL_PIXELFORMAT_BGR24;
+    case V4L2_PIX_FMT_XBGR32: return SDL_PIXELFORMAT_XRGB8888;
+    case V4L2_PIX_FMT_XRGB32: return SDL_PIXELFORMAT_BGRX8888;
+    default: return 0;
+    }
   }
 
   void render_clear() {
@@ -103,14 +230,42 @@ struct Window {
     SDL_RenderCopy(render, texture.texture, nullptr, dst ? &dst.value() : nullptr);
   }
 
+  // Solid rects over what has been rendered so far, blended by color's alpha.
+  void fill_rects(std::span<const SDL_Rect> rects, SDL_Color color) {
+    Uint8 r, g, b, a;
+    SDL_GetRenderDrawColor(render, &r, &g, &b, &a);
+
+    SDL_SetRenderDrawBlendMode(render, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(render, color.r, color.g, color.b, color.a);
+    SDL_RenderFillRects(render, rects.data(), int(rects.size()));
+
+    // render_clear() goes on using the old color
+    SDL_SetRenderDrawColor(render, r, g, b, a);
+  }
+
   void render_present() { SDL_RenderPresent(render); }
 
+  // Take in what the OS has for us without handling the queue, so event
+  // watches (see InputWatch) see input in the middle of a slow frame.
+  void pump_events() { SDL_PumpEvents(); }
+
   void process_events(auto&& f) {
     SDL_Event e;
     while(SDL_PollEvent(&e))
       f(e);
   }
 
+  // Block until there is at least one event (or the timeout passes), then
+  // handle everything that is queued.
+  void wait_events(int timeout_ms, auto&& f) {
+    SDL_Event e;
+    if(!SDL_WaitEventTimeout(&e, timeout_ms))
+      return;
+
+    f(e);
+    process_events(f);
+  }
+
   bool is_grabbed() {
     auto state = SDL_GetWindowFlags(win);
     return state & SDL_WINDOW_INPUT_GRABBED;
@@ -137,6 +292,15 @@ struct Window {
     return {w, h};
   }
 
+  // the clipboard's text, empty if there's none
+  static std::string get_clipboard() {
+    char* text = SDL_GetClipboardText();
+    if(!text) return {};
+    std::string ret = text;
+    SDL_free(text);
+    return ret;
+  }
+
   ~Window() {
     if(win && render) {
       SDL_DestroyWindow(win);
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include "trace.h"
+
+#include <common/msg.h>
+#include <common/stats.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Fold next into a report that is still waiting for the endpoint. Only
+// changes that lose nothing the target could observe are merged.
+inline bool merge_report(keyboard_t& queued, const keyboard_t& next) {
+  return queued == next;
+}
+
+inline bool merge_report(keyboard_nkro_t& queued, const keyboard_nkro_t& next) {
+  return queued == next;
+}
+
+// Whether next changes nothing but motion from prev, i.e. could be dropped
+// without a key or button edge going missing. Keyboard reports are all edges.
+inline bool motion_only(const keyboard_t&, const keyboard_t&) { return false; }
+inline bool motion_only(const keyboard_nkro_t&, const keyboard_nkro_t&) { return false; }
+
+inline bool motion_only(const mouse_t& prev, const mouse_t& next) {
+  return prev[1] == next[1];
+}
+
+inline bool merge_report(mouse_t& queued, const mouse_t& next) {
+  auto a = unpack_mouse(queued), b = unpack_mouse(next);
+
+  // button transitions always go out as they are
+  if(a.id != b.id || a.buttons != b.buttons) return false;
+
+  // relative motion and scrolling add up, as long as the sum still fits
+  int wheel = a.wheel + b.wheel, pan = a.pan + b.pan;
+  if(wheel < -127 || wheel > 127 || pan < -127 || pan > 127) return false;
+
+  if(a.id == MOUSE_RELATIVE) {
+    int x = a.x + b.x, y = a.y + b.y;
+    if(x < -32767 || x > 32767 || y < -32767 || y > 32767) return false;
+    a.x = x;
+    a.y = y;
+  } else {
+    a.x = b.x;
+    a.y = b.y;
+  }
+
+  a.wheel = wheel;
+  a.pan = pan;
+  queued = pack_mouse(a);
+  return true;
+}
+
+// Fold next into the report queued before it, which may be a button edge.
+// Only relative deltas can move earlier: an absolute position would shift
+// where the edge lands.
+inline bool merge_back(keyboard_t&, const keyboard_t&) { return false; }
+inline bool merge_back(keyboard_nkro_t&, const keyboard_nkro_t&) { return false; }
+
+inline bool merge_back(mouse_t& queued, const mouse_t& next) {
+  return unpack_mouse(next).id == MOUSE_RELATIVE && merge_report(queued, next);
+}
+
+// Writes reports to a /dev/hidg* function without ever blocking the caller.
+// Time from push() to the write completing goes into a latency histogram.
+//
+// Reports can carry tag bits. Tags stick to the newest queued report that was
+// pushed with them, and on_written fires with those bits once it is written
+// (or dropped), i.e. when everything pushed with the tag has left the queue.
+// Reports queue up while the endpoint is busy (the target hasn't polled yet,
+// or the link is suspended) and are flushed as soon as epoll says it's
+// writable again. A lossless writer grows its queue rather than dropping
+// anything. The others make room by folding the oldest motion-only report
+// into a neighbour, and only grow when no report can be folded away, so
+// neither a press or release nor any motion is lost.
+template <typename Report>
+struct HidWriter {
+  struct Stats {
+    uint64_t written = 0;
+    uint64_t merged = 0;
+    uint64_t busy = 0;      // writes that hit EAGAIN
+    uint64_t errors = 0;
+    uint64_t dropped = 0;
+    uint64_t grown = 0;
+    size_t depth = 0;
+    size_t max_depth = 0;
+  };
+
+  HidWriter(asio::io_service& service, const char* path, uint8_t id, size_t capacity, bool lossless)
+    : fd(service), retry(service), path(path), id(id), queue(capacity), lossless(lossless) {
+    int raw = ::open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if(raw < 0)
+      throw std::system_error(errno, std::system_category(), fmt::format("Failed to open {}", path));
+    fd.assign(raw);
+  }
+
+  using my_clock = std::chrono::steady_clock;
+
+  std::function<void(uint32_t tags, my_clock::time_point)> on_written;
+
+  void push(const Report& report, uint32_t tags = 0) {
+    if(count && merge_report(at(count - 1).report, report)) {
+      at(count - 1).tags |= tags;
+      stats.merged++;
+    } else {
+      if(count) at(count - 1).tags &= ~tags;
+      if(count == queue.size()) make_room();
+      at(count++) = { report, my_clock::now(), tags };
+    }
+
+    stats.max_depth = std::max(stats.max_depth, count);
+
+    if(!waiting) flush();
+  }
+
+  Stats get_stats() const {
+    Stats ret = stats;
+    ret.depth = count;
+    return ret;
+  }
+
+  const LatencyHistogram& get_latency() const { return latency; }
+
+  // reports queued behind the endpoint
+  size_t depth() const { return count; }
+
+  // Smoothed time between writes that had to wait for the endpoint, i.e. how
+  // often the target actually polls. Zero until it's been seen.
+  my_clock::duration get_drain_interval() const { return drain; }
+
+protected:
+  // lossless queues stop growing here, at that point the target has clearly
+  // stopped listening
+  static constexpr size_t max_capacity = 4096;
+
+  struct Entry {
+    Report report;
+    my_clock::time_point queued;
+    uint32_t tags = 0;
+  };
+
+  asio::posix::stream_descriptor fd;
+  asio::steady_timer retry;
+  const char* path;
+  uint8_t id;
+
+  std::vector<Entry> queue;
+  size_t head = 0;
+  size_t count = 0;
+  Report last {}; // the last report written, what the first queued one follows
+
+  bool lossless;
+  bool waiting = false;
+
+  bool polled = false; // the last write had to wait for the endpoint
+  my_clock::time_point last_write;
+  my_clock::duration drain {};
+  Stats stats;
+  LatencyHistogram latency;
+
+  Entry& at(size_t i) { return queue[(head + i) % queue.size()]; }
+
+  void make_room() {
+    if(!lossless && drop_motion()) return;
+
+    if(queue.size() < max_capacity) {
+      std::vector<Entry> bigger(queue.size() * 2);
+      for(size_t i = 0; i < count; i++)
+        bigger[i] = at(i);
+
+      queue = std::move(bigger);
+      head = 0;
+      stats.grown++;
+    } else {
+      complete(at(0), my_clock::now());
+      last = at(0).report;
+      head = (head + 1) % queue.size();
+      count--;
+      stats.dropped++;
+    }
+  }
+
+  // Take out the oldest report that only moves, its motion folded into the
+  // report after it or, if that's an edge or the sum won't fit, the relative
+  // deltas into the one before. False if none can go without losing anything.
+  bool drop_motion() {
+    for(size_t i = 0; i < count; i++) {
+      if(!motion_only(i ? at(i - 1).report : last, at(i).report)) continue;
+
+      Report folded = at(i).report;
+      if(i + 1 < count && merge_report(folded, at(i + 1).report)) {
+        at(i + 1).report = folded;
+        at(i + 1).tags |= std::exchange(at(i).tags, 0);
+      } else if(i && merge_back(at(i - 1).report, at(i).report)) {
+        at(i - 1).tags |= std::exchange(at(i).tags, 0);
+      } else {
+        continue;
+      }
+
+      for(size_t j = i; j > 0; j--)
+        at(j) = at(j - 1);
+      head = (head + 1) % queue.size();
+      count--;
+      stats.dropped++;
+      return true;
+    }
+    return false;
+  }
+
+  void flush() {
+    while(count) {
+      auto& [report, queued, tags] = at(0);
+      ssize_t rc = ::write(fd.native_handle(), report.data(), report.size());
+
+      if(rc < 0 && errno == EINTR) continue;
+
+      if(rc < 0 && errno == EAGAIN) {
+        polled = true;
+        stats.busy++;
+        trace().record(TraceRing::HID_BUSY, std::span(&id, 1));
+        wait([this](auto&& handler) { fd.async_wait(asio::posix::descriptor_base::wait_write, handler); });
+        return;
+      }
+
+      if(rc < 0) {
+        // not connected to a host (ESHUTDOWN) or similar, try again later
+        if(!stats.errors++)
+          fmt::print("Write to {} failed: {}\n", path, strerror(errno));
+
+        wait([this](auto&& handler) {
+          retry.expires_after(std::chrono::milliseconds(100));
+          retry.async_wait(handler);
+        });
+        return;
+      }
+
+      auto now = my_clock::now();
+      auto took = now - queued;
+      latency.record(took);
+
+      // a long gap is the target going idle, not its poll interval
+      if(auto interval = now - last_write; std::exchange(polled, false) && interval < std::chrono::milliseconds(100))
+        drain = drain.count() ? (drain * 7 + interval) / 8 : interval;
+      last_write = now;
+
+      uint32_t us = std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+      trace().record(TraceRing::HID_WRITE, std::array<uint8_t, 5> { id, uint8_t(us), uint8_t(us >> 8), uint8_t(us >> 16), uint8_t(us >> 24) });
+
+      complete(at(0), now);
+      last = report;
+      head = (head + 1) % queue.size();
+      count--;
+      stats.written++;
+    }
+  }
+
+  void complete(Entry& e, my_clock::time_point when) {
+    if(e.tags && on_written)
+      on_written(std::exchange(e.tags, 0), when);
+  }
+
+  void wait(auto&& start) {
+    waiting = true;
+    start([this](const asio::error_code& ec) {
+      waiting = false;
+      if(!ec) flush();
+    });
+  }
+};
@@ -1,73 +1,77 @@
+#include "server.h"
+
+#include <common/transport.h>
+
 #include <asio.hpp>
-#include <fstream>
 #include <fmt/core.h>
 
-#include <common/msg.h>
-#include <common/serial.h>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+#include <vector>
 
-void write_keyboard(const char* keyboard_file, keyboard_t& buf) {
-  static std::ofstream out(keyboard_file, std::ios::out
-                           | std::ios::binary
-                           | std::ios::app);
-  out.write((char*)buf.data(), buf.size());
-  out.flush();
-
-  fmt::print("kbd: ");
-  for(auto& b: buf)
-    fmt::print("{:2X}", b);
-  fmt::print("\n");
-}
+void run_server(const std::vector<Transport::Spec>& links,
+                uint32_t baud,
+                const char* keyboard_file,
+                const char* mouse_file,
+                const char* nkro_file) {
+  asio::io_service service;
 
-void write_mouse(const char* mouse_file, mouse_t& buf) {
-  static std::ofstream out(mouse_file, std::ios::out
-                           | std::ios::binary
-                           | std::ios::app);
-  out.write((char*)buf.data(), buf.size());
-  out.flush();
+  Server server(service, links, baud, keyboard_file, mouse_file, nkro_file);
+  server.start();
 
-  fmt::print("mouse: ");
-  for(auto& b: buf)
-    fmt::print("{:2X}", b);
-  fmt::print("\n");
+  service.run();
 }
 
-void run_server(const char* serial_file,
-                const char* keyboard_file,
-                const char* mouse_file) {
-  asio::io_service service;
-  serial_iostream stream(service, serial_file);
-  stream.set_option(asio::serial_port_base::baud_rate(115200));
-
-  while(stream.is_open()) {
-    int cmd = read_trivial<int>(stream);
+int main(int argc, char** argv) {
+  uint32_t baud = Transport::default_baud;
 
-    switch(cmd) {
-      case CMD_KEYBOARD: {
-        auto buf = read_trivial<keyboard_t>(stream);
-        write_keyboard(keyboard_file, buf);
-        break;
-      }
+  // options go before the files, each shifted off as it's read
+  auto shift = [&](int n) {
+    argv[n] = argv[0];
+    argc -= n;
+    argv += n;
+  };
 
-      case CMD_MOUSE: {
-        auto buf = read_trivial<mouse_t>(stream);
-        write_mouse(mouse_file, buf);
-        break;
+  while(argc > 1) {
+    std::string_view opt = argv[1];
+    if(opt == "-v") {
+      trace().verbose = true;
+      shift(1);
+    } else if(opt == "-b" && argc > 2) {
+      auto [end, ec] = std::from_chars(argv[2], argv[2] + strlen(argv[2]), baud);
+      if(ec != std::errc() || *end) {
+        fmt::print("Invalid baud rate {}\n", argv[2]);
+        return 1;
       }
+      shift(2);
+    } else {
+      break;
     }
   }
-}
 
-int main(int argc, char** argv) {
   if(argc < 4) {
-    fmt::print("Usage: {} <serial file> <keyboard file> <mouse file>\n", argv[0]);
+    fmt::print("Usage: {} [-v] [-b <baud>] <links> <keyboard file> <mouse file> [<nkro keyboard file>]\n"
+               "  <links> is a comma separated list listened on all at once, e.g. acm:/dev/ttyGS0,/dev/serial0,\n"
+               "          each a UART device, acm:<device>, tcp::<port> or unix:<path>\n"
+               "  -v  print every event as it happens\n"
+               "  -b  UART baud rate (default 115200)\n"
+               "  send SIGUSR1 to dump the trace ring and statistics\n", argv[0]);
+    return 1;
+  }
+
+  auto links = Transport::Spec::parse_list(argv[1]);
+  if(links.is_error()) {
+    fmt::print("{}\n", links.error().what());
     return 1;
   }
 
-  fmt::print("Starting server on serial device {}\n", argv[1]);
+  fmt::print("Starting server on {}\n", argv[1]);
   fmt::print("Using keyboard file {}\n", argv[2]);
   fmt::print("Using mouse file {}\n", argv[3]);
+  if(argc > 4) fmt::print("Using NKRO keyboard file {}\n", argv[4]);
 
-  run_server(argv[1], argv[2], argv[3]);
+  run_server(links.release_value(), baud, argv[2], argv[3], argc > 4 ? argv[4] : nullptr);
 
   return 0;
 }
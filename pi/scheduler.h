@@ -0,0 +1,312 @@
+#pragma once
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include <common/err.h>
+#include <common/msg.h>
+#include <common/stats.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <variant>
+#include <vector>
+
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Plays macros back on the pi's clock, so their timing no longer depends on
+// when their frames came over serial or how the host's loop was paced. The
+// server's io_service wakes up from an absolute CLOCK_MONOTONIC timerfd a
+// little before a report is due, and the last stretch is spun out so reports
+// go to the gadget within microseconds of their time. A macro timed faster
+// than the target polls doesn't pile up in the writers' queues: once the
+// next report's queue holds max_backlog, the rest of the macro slides back
+// until the target has taken some. Held for max_hold, the target has stopped
+// taking reports and the playback is given up.
+struct Scheduler {
+  using Report = std::variant<keyboard_t, keyboard_nkro_t, mouse_t>;
+  using my_clock = std::chrono::steady_clock;
+
+  // wake this much early and spin the rest, timerfd wakeups alone are tens
+  // of microseconds late on a pi
+  static constexpr auto spin = std::chrono::microseconds(200);
+  static constexpr size_t max_steps = 1 << 16;
+  // an open recording that gets no records for this long has lost its end
+  static constexpr auto record_timeout = std::chrono::seconds(1);
+  // reports queued for the endpoint before playback waits, and how long
+  static constexpr size_t max_backlog = 4;
+  static constexpr auto hold = std::chrono::microseconds(500);
+  static constexpr auto max_hold = std::chrono::seconds(2);
+
+  struct Step {
+    my_clock::duration offset;
+    Report report;
+  };
+
+  struct Stats {
+    uint64_t macros = 0;
+    uint64_t reports = 0;
+    uint64_t overflows = 0; // steps beyond max_steps, dropped
+    uint64_t cancelled = 0;
+    uint64_t aborted = 0;   // recordings that lost their end
+    uint64_t held = 0;      // times playback waited for a queue
+    uint64_t stalled = 0;   // playbacks given up after max_hold
+  };
+
+  // hands a due report to the HID writers
+  std::function<void(const Report&)> emit;
+  std::function<void(const macro_done_t&)> on_done;
+  // reports queued in the writer a report would go to
+  std::function<size_t(const Report&)> backlog;
+
+  Scheduler(asio::io_service& service) : timer(service) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd < 0)
+      throw std::system_error(errno, std::system_category(), "Failed to create timerfd");
+    timer.assign(fd);
+
+    // the default 50us of slack would be added to every wakeup
+    prctl(PR_SET_TIMERSLACK, 1);
+  }
+
+  // Records between begin() and end() are stored instead of written. A
+  // recording that went quiet for record_timeout is aborted here, so the
+  // record that arrives now is written after all.
+  bool recording(my_clock::time_point now) {
+    if(current < 0) return false;
+    if(now - last_record > record_timeout) {
+      abort();
+      return false;
+    }
+    last_record = now;
+    return true;
+  }
+
+  // A begin while a recording is open means that one's end was lost. The new
+  // macro isn't started, its records are swallowed up to its end, and both
+  // are aborted there.
+  void begin(uint8_t id, my_clock::time_point now) {
+    if(recording(now)) {
+      broken = true;
+      return;
+    }
+
+    cancel(id);
+    current = id;
+    offset = {};
+    dropped = 0;
+    last_record = now;
+    macros[id].clear();
+  }
+
+  void at(uint32_t us) { offset = std::chrono::microseconds(us); }
+
+  void add(const Report& r) {
+    auto& steps = macros[current];
+    if(steps.size() >= max_steps) {
+      stats.overflows++;
+      dropped++;
+      return;
+    }
+    steps.push_back({ offset, r });
+  }
+
+  void end(const macro_end_t& m, my_clock::time_point received) {
+    if(broken || m.id != current) {
+      if(m.id != current) done(Playback(m.id, received), MACRO_ABORTED);
+      abort();
+      return;
+    }
+    current = -1;
+
+    auto& steps = macros[m.id];
+    std::stable_sort(steps.begin(), steps.end(), [](auto& a, auto& b) { return a.offset < b.offset; });
+
+    cancel(m.id);
+    stats.macros++;
+
+    auto p = std::make_unique<Playback>(m.id, received + std::chrono::microseconds(m.delay));
+    p->dropped = dropped;
+    if(steps.empty()) {
+      done(*p);
+      return;
+    }
+
+    playing.push_back(std::move(p));
+    arm();
+  }
+
+  Stats get_stats() const { return stats; }
+
+protected:
+  struct Playback {
+    uint8_t id;
+    my_clock::time_point start; // moved back when playback is held
+    my_clock::time_point first; // as it was scheduled, lateness counts from here
+    std::optional<my_clock::time_point> held; // since when, while waiting for a queue
+    size_t next = 0;
+    my_clock::time_point last {};
+    LatencyHistogram late;
+    uint32_t dropped = 0;
+
+    Playback(uint8_t id, my_clock::time_point start) : id(id), start(start), first(start) {}
+  };
+
+  asio::posix::stream_descriptor timer;
+  bool waiting = false;
+
+  std::array<std::vector<Step>, 256> macros;
+  int current = -1;
+  my_clock::duration offset {};
+  my_clock::time_point last_record;
+  uint32_t dropped = 0; // steps of the recording beyond max_steps
+  bool broken = false;  // another begin came before the end
+
+  std::vector<std::unique_ptr<Playback>> playing;
+  Stats stats;
+
+  // a macro that's redefined or restarted stops where it is, and lets go of
+  // whatever it was holding down
+  void cancel(uint8_t id) {
+    for(auto it = playing.begin(); it != playing.end(); it++) {
+      if((*it)->id != id) continue;
+      stats.cancelled++;
+      release(**it);
+      done(**it, MACRO_CANCELLED);
+      playing.erase(it);
+      return;
+    }
+  }
+
+  // an all released report for every device the macro has written to
+  void release(const Playback& p) {
+    bool keyboard = false, nkro = false, mouse = false;
+    for(size_t i = 0; i < p.next; i++) {
+      std::visit(overloaded {
+          [&](const keyboard_t&) { keyboard = true; },
+          [&](const keyboard_nkro_t&) { nkro = true; },
+          [&](const mouse_t&) { mouse = true; },
+        }, macros[p.id][i].report);
+    }
+
+    if(keyboard) emit(keyboard_t{});
+    if(nkro) emit(keyboard_nkro_t{});
+    if(mouse) emit(pack_mouse({ .id = MOUSE_RELATIVE }));
+  }
+
+  // drop the open recording, nothing of it plays
+  void abort() {
+    stats.aborted++;
+    macros[current].clear();
+    done(Playback(current, my_clock::now()), MACRO_ABORTED);
+    current = -1;
+    broken = false;
+  }
+
+  std::optional<my_clock::time_point> next_due() const {
+    std::optional<my_clock::time_point> ret;
+    for(auto& p: playing) {
+      auto due = p->start + macros[p->id][p->next].offset;
+      if(!ret || due < *ret) ret = due;
+    }
+    return ret;
+  }
+
+  void arm() {
+    auto due = next_due();
+    if(!due) return;
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>((*due - spin).time_since_epoch()).count();
+    itimerspec spec {};
+    spec.it_value = { time_t(ns / 1'000'000'000), long(ns % 1'000'000'000) };
+
+    // steady_clock is CLOCK_MONOTONIC, a time in the past fires right away
+    if(spec.it_value.tv_sec <= 0 && spec.it_value.tv_nsec <= 0) spec.it_value.tv_nsec = 1;
+    timerfd_settime(timer.native_handle(), TFD_TIMER_ABSTIME, &spec, nullptr);
+
+    if(waiting) return;
+    waiting = true;
+    timer.async_wait(asio::posix::descriptor_base::wait_read, [this](const asio::error_code& ec) {
+      waiting = false;
+      if(ec) return;
+
+      uint64_t expirations;
+      IGNORE(::read(timer.native_handle(), &expirations, sizeof(expirations)));
+      run_due();
+      arm();
+    });
+  }
+
+  void run_due() {
+    auto horizon = my_clock::now() + spin;
+
+    while(true) {
+      auto due = next_due();
+      if(!due || *due > horizon) break;
+
+      while(my_clock::now() < *due);
+
+      for(auto it = playing.begin(); it != playing.end();) {
+        auto& p = **it;
+        auto& steps = macros[p.id];
+
+        while(p.next < steps.size() && p.start + steps[p.next].offset <= *due) {
+          if(backlog && backlog(steps[p.next].report) >= max_backlog) {
+            auto now = my_clock::now();
+            if(!p.held) p.held = now;
+            p.start = now + hold - steps[p.next].offset;
+            stats.held++;
+            break;
+          }
+          emit(steps[p.next].report);
+          p.held.reset();
+
+          auto now = my_clock::now();
+          p.late.record(now - (p.first + steps[p.next].offset));
+          p.last = now;
+          p.next++;
+          stats.reports++;
+        }
+
+        if(p.next == steps.size()) {
+          done(p);
+          it = playing.erase(it);
+        } else if(p.held && my_clock::now() - *p.held >= max_hold) {
+          // the writer isn't getting through (e.g. the target isn't
+          // connected), what was pressed is let go once it does
+          stats.stalled++;
+          release(p);
+          done(p, MACRO_ABORTED);
+          it = playing.erase(it);
+        } else {
+          it++;
+        }
+      }
+    }
+  }
+
+  void done(const Playback& p, uint8_t status = MACRO_PLAYED) {
+    auto us = [](auto d) { return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(d).count()); };
+    auto s = p.late.summary();
+
+    macro_done_t d {
+      .id = p.id,
+      .reports = uint32_t(s.count),
+      .duration = s.count ? us(p.last - p.first) : 0,
+      .late_p50 = us(s.p50),
+      .late_p99 = us(s.p99),
+      .late_max = us(s.max),
+      .status = status,
+      .dropped = p.dropped,
+    };
+    if(on_done) on_done(d);
+  }
+};
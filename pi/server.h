@@ -0,0 +1,413 @@
+#pragma once
+
+#include "hid.h"
+#include "scheduler.h"
+#include "trace.h"
+
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include <common/err.h>
+#include <common/msg.h>
+#include <common/stream_buffer.h>
+#include <common/transport.h>
+
+#include <bit>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <variant>
+#include <vector>
+
+// Listens on every link at once, e.g. the USB gadget's ACM serial and the
+// UART behind it, and answers on whichever the host was last heard on. A link
+// that fails is reopened, or listened on again, every retry_interval.
+struct Server {
+  using Report = std::variant<keyboard_t, keyboard_nkro_t, mouse_t>;
+  using my_clock = std::chrono::steady_clock;
+
+  static constexpr auto retry_interval = std::chrono::seconds(1);
+
+  // nkro_file is optional, without it NKRO reports go to the boot keyboard
+  Server(asio::io_service& service,
+         const std::vector<Transport::Spec>& specs,
+         uint32_t baud,
+         const char* keyboard_file,
+         const char* mouse_file,
+         const char* nkro_file = nullptr)
+    : keyboard(service, keyboard_file, 0, 64, true),
+      mouse(service, mouse_file, 1, 16, false),
+      scheduler(service),
+      signals(service, SIGUSR1) {
+    for(auto& spec: specs)
+      links.push_back(std::make_unique<Link>(service, spec, baud));
+    batch.reserve(64);
+
+    keyboard.on_written = [this](uint32_t tags, my_clock::time_point t) { on_written(KEYBOARD_WRITER, tags, t); };
+    mouse.on_written = [this](uint32_t tags, my_clock::time_point t) { on_written(MOUSE_WRITER, tags, t); };
+
+    if(nkro_file) {
+      nkro.emplace(service, nkro_file, 2, 64, true);
+      nkro->on_written = [this](uint32_t tags, my_clock::time_point t) { on_written(NKRO_WRITER, tags, t); };
+      caps |= CAP_NKRO;
+    }
+
+    scheduler.emit = [this](const Report& r) {
+      counters.reports.fetch_add(1, std::memory_order_relaxed);
+      push(r);
+    };
+    scheduler.on_done = [this](const macro_done_t& d) { send(d); };
+    scheduler.backlog = [this](const Report& r) -> size_t {
+      return std::visit(overloaded {
+          [&](const keyboard_t&) { return keyboard.depth(); },
+          [&](const keyboard_nkro_t&) { return nkro ? nkro->depth() : keyboard.depth(); },
+          [&](const mouse_t&) { return mouse.depth(); },
+        }, r);
+    };
+  }
+
+  void start() {
+    for(auto& l: links) open(*l);
+    wait_for_signal();
+  }
+
+protected:
+  struct Link {
+    Link(asio::io_service& service, const Transport::Spec& spec, uint32_t baud)
+      : port(service, { spec }, baud), retry(service) {}
+
+    Transport port;
+    StreamBuffer<16 * 1024> rx;
+    FrameParser parser;
+    asio::steady_timer retry;
+  };
+
+  std::vector<std::unique_ptr<Link>> links;
+  Link* active = nullptr; // where replies go
+
+  // keyboard state transitions are never dropped, mouse motion is merged while
+  // the endpoint is busy
+  HidWriter<keyboard_t> keyboard;
+  HidWriter<mouse_t> mouse;
+  std::optional<HidWriter<keyboard_nkro_t>> nkro;
+
+  uint32_t caps = CAP_TELEMETRY | CAP_MACRO;
+
+  // timed playback of macros, straight into the writers above
+  Scheduler scheduler;
+
+  enum : uint8_t {
+    KEYBOARD_WRITER = 1 << 0,
+    MOUSE_WRITER = 1 << 1,
+    NKRO_WRITER = 1 << 2,
+  };
+
+  // replies are batched into frames while a write is in flight
+  FrameWriter tx;
+  std::vector<uint8_t> tx_queue, tx_inflight;
+  bool tx_busy = false;
+
+  struct Queued {
+    Report report;
+    int slot;          // stamp slot of the frame it came in, or -1
+    uint32_t tag = 0;
+  };
+
+  std::vector<Queued> batch;
+
+  // Stamped frames waiting for their reports to reach the gadget. Each slot
+  // is a tag bit for the HID writers.
+  struct Pending {
+    uint32_t host;
+    uint32_t rx;
+    uint32_t hid;
+    uint8_t writers;
+  };
+
+  std::array<Pending, 32> pending {};
+  uint8_t next_slot = 0;
+
+  // live counters, the rates are computed between two dumps
+  struct Counters {
+    std::atomic<uint64_t> rx_bytes = 0;
+    std::atomic<uint64_t> rx_reads = 0;
+    std::atomic<uint64_t> reports = 0;
+  } counters;
+
+  struct {
+    std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+    uint64_t rx_bytes = 0;
+    uint64_t reports = 0;
+  } last_dump;
+
+  struct {
+    my_clock::time_point time;
+    int64_t us = 0;
+  } last_drain;
+
+  asio::signal_set signals;
+
+  void open(Link& l) {
+    l.port.accept([this, &l](const asio::error_code& ec) {
+      if(ec) {
+        fmt::print("Can't open {}: {}\n", l.port.spec().name(), ec.message());
+        return reopen(l);
+      }
+
+      fmt::print("Listening on {}\n", l.port.spec().name());
+      std::fflush(stdout);
+      read(l);
+    });
+  }
+
+  void reopen(Link& l) {
+    l.port.close();
+    l.rx.clear();
+    if(active == &l) active = nullptr;
+
+    l.retry.expires_after(retry_interval);
+    l.retry.async_wait([this, &l](const asio::error_code& ec) { if(!ec) open(l); });
+  }
+
+  void read(Link& l) {
+    auto buf = l.rx.writable();
+    l.port.async_read_some(asio::buffer(buf.data(), buf.size()), [this, &l](const asio::error_code& ec, size_t n) {
+      if(ec) {
+        fmt::print("Read from {} failed: {}\n", l.port.spec().name(), ec.message());
+        std::fflush(stdout);
+        return reopen(l);
+      }
+
+      uint32_t now = stamp_now();
+      auto received = my_clock::now();
+
+      counters.rx_bytes.fetch_add(n, std::memory_order_relaxed);
+      counters.rx_reads.fetch_add(1, std::memory_order_relaxed);
+      trace().record(TraceRing::RX, n);
+
+      auto& parser = l.parser;
+      auto error_count = [&]() { return parser.stats.crc_errors + parser.stats.header_errors + parser.stats.bad_records; };
+      auto errors = error_count();
+
+      l.rx.commit(n);
+      l.rx.consume(parser.parse(l.rx.readable(), [&](uint8_t, std::span<const uint8_t> payload) {
+        int slot = -1;
+        if(active != &l) {
+          if(active) fmt::print("Host moved to {}\n", l.port.spec().name());
+          active = &l;
+        }
+
+        auto queue = [&](const auto& report) {
+          if(scheduler.recording(received)) return scheduler.add(report);
+          batch.push_back({ report, slot });
+          if(slot >= 0) pending[slot].writers |= writer_for(report);
+        };
+
+        bool ok = decode_records(payload, overloaded {
+            [&](const hello_t& h) { on_hello(h); },
+            [&](const stats_request_t&) { dump_stats(); },
+            [&](const stamp_t& st) {
+              slot = next_slot++ % pending.size();
+              pending[slot] = { st.host, now, now, 0 };
+            },
+            [&](const echo_t&) {},
+            [&](const macro_begin_t& m) { scheduler.begin(m.id, received); },
+            [&](const at_t& a) { if(scheduler.recording(received)) scheduler.at(a.offset); },
+            [&](const macro_end_t& m) { if(scheduler.recording(received)) scheduler.end(m, received); },
+            [&](const macro_done_t&) {},
+            [&](const drain_t&) {},
+            [&](const keyboard_t& k) { queue(k); },
+            [&](const keyboard_nkro_t& k) { queue(k); },
+            [&](const mouse_t& m) { queue(m); },
+          });
+
+        if(!ok) parser.stats.bad_records++;
+
+        // a stamp without reports is answered right away
+        if(slot >= 0 && !pending[slot].writers) echo(slot);
+      }));
+
+      if(error_count() != errors)
+        trace().record(TraceRing::PARSE_ERROR, error_count() - errors);
+
+      dispatch();
+      report_drain();
+      read(l);
+    });
+  }
+
+  void on_hello(const hello_t& h) {
+    fmt::print("Host protocol version {}, capabilities {:#x}\n", h.version, h.caps);
+    send(hello_t{ .caps = caps });
+  }
+
+  // everything parsed out of one read goes out together
+  void dispatch() {
+    counters.reports.fetch_add(batch.size(), std::memory_order_relaxed);
+
+    // only the last report of a stamped frame per writer carries the tag,
+    // the writers are FIFO so that one completes last
+    std::array<uint32_t, 3> seen_by {};
+    for(auto it = batch.rbegin(); it != batch.rend(); it++) {
+      if(it->slot < 0) continue;
+
+      uint32_t bit = 1u << it->slot;
+      uint32_t& seen = seen_by[std::countr_zero(std::visit([this](auto& r) { return writer_for(r); }, it->report))];
+      it->tag = seen & bit ? 0 : bit;
+      seen |= bit;
+    }
+
+    for(auto& [report, slot, tag]: batch)
+      push(report, tag);
+
+    batch.clear();
+  }
+
+  uint8_t writer_for(const keyboard_t&) const { return KEYBOARD_WRITER; }
+  uint8_t writer_for(const keyboard_nkro_t&) const { return nkro ? NKRO_WRITER : KEYBOARD_WRITER; }
+  uint8_t writer_for(const mouse_t&) const { return MOUSE_WRITER; }
+
+  void push(const Report& report, uint32_t tag = 0) {
+    std::visit(overloaded {
+        [&](const keyboard_t& k) {
+          trace().record(TraceRing::KEYBOARD, k);
+          keyboard.push(k, tag);
+        },
+        [&](const keyboard_nkro_t& k) {
+          trace().record(TraceRing::KEYBOARD, boot_report(k));
+          if(nkro) nkro->push(k, tag);
+          else keyboard.push(boot_report(k), tag);
+        },
+        [&](const mouse_t& m) {
+          trace().record(TraceRing::MOUSE, m);
+          mouse.push(m, tag);
+        },
+      }, report);
+  }
+
+  // Tell the host how often the target takes a mouse report, so it can
+  // coalesce motion to match. Only sent when it moves by more than 20%.
+  void report_drain() {
+    auto now = my_clock::now();
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(mouse.get_drain_interval()).count();
+    if(!us || now - last_drain.time < std::chrono::seconds(1)) return;
+    if(last_drain.us && std::abs(us - last_drain.us) * 5 < last_drain.us) return;
+
+    send(drain_t{ uint32_t(us) });
+    last_drain = { now, us };
+  }
+
+  void on_written(uint8_t writer, uint32_t tags, my_clock::time_point when) {
+    uint32_t t = std::chrono::duration_cast<std::chrono::microseconds>(when.time_since_epoch()).count();
+
+    for(size_t slot = 0; slot < pending.size(); slot++) {
+      if(!(tags & (1u << slot)) || !(pending[slot].writers & writer)) continue;
+
+      auto& p = pending[slot];
+      p.writers &= ~writer;
+      if(int32_t(t - p.hid) > 0) p.hid = t;
+
+      if(!p.writers) echo(slot);
+    }
+  }
+
+  void echo(int slot) {
+    auto& p = pending[slot];
+    send(echo_t{ p.host, p.rx, p.hid, stamp_now() });
+  }
+
+  void send(const auto& record) {
+    if(!tx.add(record)) {
+      auto bytes = tx.finish();
+      tx_queue.insert(tx_queue.end(), bytes.begin(), bytes.end());
+      IGNORE(tx.add(record));
+    }
+
+    if(!tx_busy) flush_tx();
+  }
+
+  void flush_tx() {
+    if(!tx.empty()) {
+      auto bytes = tx.finish();
+      tx_queue.insert(tx_queue.end(), bytes.begin(), bytes.end());
+    }
+
+    if(tx_queue.empty()) return;
+
+    // nobody to answer yet
+    if(!active) {
+      tx_queue.clear();
+      return;
+    }
+
+    std::swap(tx_queue, tx_inflight);
+    tx_busy = true;
+
+    asio::async_write(active->port, asio::buffer(tx_inflight), [this](const asio::error_code& ec, size_t) {
+      tx_inflight.clear();
+      tx_busy = false;
+
+      if(ec) {
+        fmt::print("Write failed: {}\n", ec.message());
+        return;
+      }
+
+      flush_tx();
+    });
+  }
+
+  void wait_for_signal() {
+    signals.async_wait([this](const asio::error_code& ec, int) {
+      if(ec) return;
+      dump_stats();
+      wait_for_signal();
+    });
+  }
+
+  void dump_stats() {
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - last_dump.time).count();
+
+    uint64_t rx_bytes = counters.rx_bytes.load(std::memory_order_relaxed);
+    uint64_t reports = counters.reports.load(std::memory_order_relaxed);
+
+    fmt::print("--- trace ---\n");
+    trace().dump();
+
+    fmt::print("--- stats ---\n");
+    fmt::print("rx: {} bytes in {} reads, {:.0f} B/s, {} reports, {:.1f} reports/s\n",
+               rx_bytes, counters.rx_reads.load(std::memory_order_relaxed), (rx_bytes - last_dump.rx_bytes) / dt,
+               reports, (reports - last_dump.reports) / dt);
+    for(auto& l: links) {
+      auto& s = l->parser.stats;
+      fmt::print("{}{}: frames {} crc errors {} header errors {} bad records {} lost frames {} skipped bytes {}\n",
+                 l->port.spec().name(), l.get() == active ? " (active)" : "",
+                 s.frames, s.crc_errors, s.header_errors, s.bad_records, s.lost_frames, s.skipped_bytes);
+    }
+
+    auto print = [](const char* name, const auto& writer) {
+      auto s = writer.get_stats();
+      auto l = writer.get_latency().summary();
+      auto us = [](auto d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+
+      fmt::print("{}: written {} merged {} busy {} errors {} dropped {} grown {} depth {} max depth {}\n",
+                 name, s.written, s.merged, s.busy, s.errors, s.dropped, s.grown, s.depth, s.max_depth);
+      fmt::print("{} write latency: p50 {}us p99 {}us max {}us mean {}us\n",
+                 name, us(l.p50), us(l.p99), us(l.max), us(l.mean));
+    };
+
+    print("keyboard", keyboard);
+    print("mouse", mouse);
+    if(nkro) print("nkro keyboard", *nkro);
+
+    auto s = scheduler.get_stats();
+    fmt::print("scheduler: macros {} reports {} cancelled {} aborted {} overflows {} held {} stalled {}\n",
+               s.macros, s.reports, s.cancelled, s.aborted, s.overflows, s.held, s.stalled);
+
+    last_dump = { now, rx_bytes, reports };
+    std::fflush(stdout);
+  }
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <span>
+
+// Fixed size in-memory ring of timestamped events. Recording is a few stores,
+// so it can stay on in the hot path; the ring is only formatted when a
+// snapshot is dumped. In verbose mode every event is also printed as it
+// happens, like the server used to do for each report.
+struct TraceRing {
+  using my_clock = std::chrono::steady_clock;
+
+  enum Type : uint8_t {
+    RX,          // bytes read from the serial port, data = count
+    FRAME,       // valid frame, data = seq
+    KEYBOARD,    // report handed to the keyboard writer
+    MOUSE,       // report handed to the mouse writer
+    HID_WRITE,   // report written, data = device, latency in us
+    HID_BUSY,    // endpoint not ready, report queued
+    PARSE_ERROR, // crc error or malformed record
+  };
+
+  struct Event {
+    my_clock::time_point time;
+    Type type;
+    uint8_t len;
+    std::array<uint8_t, 14> data;
+  };
+
+  static constexpr size_t capacity = 4096;
+  static_assert((capacity & (capacity - 1)) == 0);
+
+  bool verbose = false;
+
+  void record(Type type, std::span<const uint8_t> data = {}) {
+    auto& e = events[next.fetch_add(1, std::memory_order_relaxed) % capacity];
+    e.time = my_clock::now();
+    e.type = type;
+    e.len = std::min(data.size(), e.data.size());
+    std::copy_n(data.begin(), e.len, e.data.begin());
+
+    if(verbose) print(e);
+  }
+
+  void record(Type type, uint32_t value) {
+    std::array<uint8_t, 4> data = { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) };
+    record(type, data);
+  }
+
+  // print the newest n events, oldest first
+  void dump(size_t n = 64) const {
+    uint64_t end = next.load(std::memory_order_relaxed);
+    uint64_t start = end > n ? end - n : 0;
+    if(end - start > capacity) start = end - capacity;
+
+    for(uint64_t i = start; i < end; i++)
+      print(events[i % capacity]);
+  }
+
+protected:
+  std::array<Event, capacity> events;
+  std::atomic<uint64_t> next = 0;
+
+  static constexpr const char* names[] = {
+    "rx", "frame", "kbd", "mouse", "hid write", "hid busy", "parse error",
+  };
+
+  void print(const Event& e) const {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(e.time.time_since_epoch()).count();
+    fmt::print("{:>14} {:<12}", us, names[e.type]);
+    for(int i = 0; i < e.len; i++)
+      fmt::print("{:02X}", e.data[i]);
+    fmt::print("\n");
+  }
+};
+
+inline TraceRing& trace() {
+  static TraceRing ring;
+  return ring;
+}